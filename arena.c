@@ -0,0 +1,96 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN 8
+#define FIRST_BLOCK 512
+#define MAX_BLOCK (64 * 1024)
+
+static size_t round_up(size_t size) {
+    return (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+}
+
+/* Smallest size class (power of two) that holds size bytes. */
+static int size_class(size_t size) {
+    int k = 3;   // a free piece has to hold the free list link
+    while (((size_t)1 << k) < size) {
+        k++;
+    }
+    return k;
+}
+
+static void new_block(Arena *arena, size_t need) {
+    size_t size = FIRST_BLOCK;
+    if (arena->blocks != NULL) {
+        size = arena->blocks->size * 2;
+        if (size > MAX_BLOCK) {
+            size = MAX_BLOCK;
+        }
+    }
+    if (size < need) {
+        size = need;
+    }
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    block->size = size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->bytes += size;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = round_up(size ? size : 1);
+
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        // whatever is left at the end of the old block is given up
+        new_block(arena, size);
+        block = arena->blocks;
+    }
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+void *arena_calloc(Arena *arena, size_t size) {
+    void *result = arena_alloc(arena, size);
+    memset(result, 0, size);
+    return result;
+}
+
+void *arena_alloc_piece(Arena *arena, size_t size) {
+    int k = size_class(size);
+    if (k >= ARENA_CLASSES) {
+        return arena_alloc(arena, size);
+    }
+    if (arena->free_pieces[k] != NULL) {
+        void *piece = arena->free_pieces[k];
+        arena->free_pieces[k] = *(void **)piece;
+        return piece;
+    }
+    return arena_alloc(arena, (size_t)1 << k);
+}
+
+void arena_free_piece(Arena *arena, void *ptr, size_t size) {
+    int k = size_class(size);
+    if (k >= ARENA_CLASSES) {
+        return;
+    }
+    *(void **)ptr = arena->free_pieces[k];
+    arena->free_pieces[k] = ptr;
+}
+
+void arena_release(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(arena, 0, sizeof(Arena));
+}
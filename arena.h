@@ -0,0 +1,52 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* A growable bump allocator. Everything allocated from an arena is
+ * released at once by arena_release, a block at a time. Blocks double in
+ * size as the arena grows so a big poll needs only a few of them.
+ *
+ * Data that gets replaced now and then, like comments, is allocated as a
+ * piece instead: its size is rounded up to a power of two, and pieces
+ * handed back with arena_free_piece go on a free list for that size and
+ * are reused by the next piece of the same size class.
+ * A zero-initialized Arena is empty.
+ */
+#define ARENA_CLASSES 32
+
+typedef struct arena_block {
+   struct arena_block *next;
+   size_t size;   // bytes in data
+   size_t used;
+   char data[];
+} ArenaBlock;
+
+typedef struct arena {
+   ArenaBlock *blocks;   // the newest block, which is bumped from, first
+   size_t bytes;         // total size of all blocks
+   void *free_pieces[ARENA_CLASSES];   // class k pieces are 2^k bytes
+} Arena;
+
+/* Return size bytes from the arena, aligned for any of our records.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/* Return size bytes from the arena, zeroed.
+ */
+void *arena_calloc(Arena *arena, size_t size);
+
+/* Return a piece of at least size bytes that can later be handed back.
+ */
+void *arena_alloc_piece(Arena *arena, size_t size);
+
+/* Hand back ptr, a piece allocated from this arena for size bytes, for
+ * reuse by a later piece of a similar size.
+ */
+void arena_free_piece(Arena *arena, void *ptr, size_t size);
+
+/* Free every block of the arena and leave it empty.
+ */
+void arena_release(Arena *arena);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+#include "check.h"
+
+#define ALLOCS 5000
+
+static void test_alloc() {
+    Arena arena = {0};
+    char *blocks[ALLOCS];
+    int i;
+    for (i = 0; i < ALLOCS; i++) {
+        // sizes that are not multiples of the alignment
+        blocks[i] = arena_alloc(&arena, i % 37 + 1);
+        CHECK((uintptr_t)blocks[i] % 8 == 0);
+        memset(blocks[i], i & 0xff, i % 37 + 1);
+    }
+    // nothing handed out overlaps anything else
+    for (i = 0; i < ALLOCS; i++) {
+        int j;
+        for (j = 0; j < i % 37 + 1 && (unsigned char)blocks[i][j] == (i & 0xff);
+             j++);
+        CHECK(j == i % 37 + 1);
+    }
+    size_t bytes = arena.bytes;
+    CHECK(bytes >= ALLOCS * 8);
+
+    // bigger than any block would be on its own
+    char *big = arena_calloc(&arena, 200000);
+    CHECK(big[0] == 0 && big[199999] == 0);
+    CHECK(arena.bytes >= bytes + 200000);
+
+    arena_release(&arena);
+    CHECK(arena.blocks == NULL && arena.bytes == 0);
+}
+
+static void test_pieces() {
+    Arena arena = {0};
+    char *a = arena_alloc_piece(&arena, 20);
+    char *b = arena_alloc_piece(&arena, 20);
+    strcpy(a, "first comment");
+    strcpy(b, "second comment");
+
+    // a piece handed back is reused for the next one of its class
+    arena_free_piece(&arena, a, 20);
+    size_t bytes = arena.bytes;
+    CHECK(arena_alloc_piece(&arena, 30) == a);
+    CHECK(arena_alloc_piece(&arena, 20) != a);
+    CHECK(strcmp(b, "second comment") == 0);
+
+    // but not for one of another class
+    arena_free_piece(&arena, b, 20);
+    char *c = arena_alloc_piece(&arena, 100);
+    CHECK(c != b);
+    CHECK(arena_alloc_piece(&arena, 17) == b);
+    CHECK(arena.bytes == bytes);
+
+    // pieces of the smallest class still hold the free list link
+    char *d = arena_alloc_piece(&arena, 1);
+    char *e = arena_alloc_piece(&arena, 1);
+    arena_free_piece(&arena, d, 1);
+    arena_free_piece(&arena, e, 1);
+    CHECK(arena_alloc_piece(&arena, 8) == e);
+    CHECK(arena_alloc_piece(&arena, 2) == d);
+    arena_release(&arena);
+}
+
+int main() {
+    test_alloc();
+    test_pieces();
+    return check_result("arena_test");
+}
@@ -0,0 +1,445 @@
+#include "binproto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* A frame is built in a scratch area, like a log record, since its
+ * length goes in front of it.
+ */
+typedef struct frame {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} Frame;
+
+// each thread keeps its frame between calls
+static __thread Frame frame;
+
+static void reserve(size_t more) {
+    if (frame.len + more <= frame.cap) {
+        return;
+    }
+    while (frame.len + more > frame.cap) {
+        frame.cap = frame.cap ? frame.cap * 2 : 256;
+    }
+    if ((frame.data = realloc(frame.data, frame.cap)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+}
+
+void bin_begin(int opcode) {
+    frame.len = 0;
+    reserve(BIN_HEADER + 1);
+    frame.len = BIN_HEADER;
+    frame.data[frame.len++] = opcode;
+}
+
+void bin_u8(int v) {
+    reserve(1);
+    frame.data[frame.len++] = v;
+}
+
+void bin_u16(int v) {
+    reserve(2);
+    frame.data[frame.len++] = v >> 8;
+    frame.data[frame.len++] = v;
+}
+
+void bin_u32(uint32_t v) {
+    reserve(4);
+    frame.data[frame.len++] = v >> 24;
+    frame.data[frame.len++] = v >> 16;
+    frame.data[frame.len++] = v >> 8;
+    frame.data[frame.len++] = v;
+}
+
+void bin_str(const char *s) {
+    size_t len = strlen(s);
+    if (len > 0xffff) {
+        len = 0xffff;
+    }
+    bin_u16(len);
+    reserve(len);
+    memcpy(frame.data + frame.len, s, len);
+    frame.len += len;
+}
+
+/* The bitmap bytes without the count in front. Bit order within a byte
+ * matches the words, so this is a byte at a time off each word.
+ */
+static void bitmap_bytes(const uint64_t *words, int nbits) {
+    int nbytes = (nbits + 7) / 8;
+    int i;
+    reserve(nbytes);
+    for (i = 0; i < nbytes; i++) {
+        frame.data[frame.len++] = words[i / 8] >> (i % 8 * 8);
+    }
+    // bits past the last slot are always clear in the words
+}
+
+void bin_bitmap(const uint64_t *words, int nbits) {
+    bin_u16(nbits);
+    bitmap_bytes(words, nbits);
+}
+
+void bin_end(Buffer *out) {
+    uint32_t body = frame.len - BIN_HEADER;
+    frame.data[0] = body >> 24;
+    frame.data[1] = body >> 16;
+    frame.data[2] = body >> 8;
+    frame.data[3] = body;
+    buf_append(out, (char *)frame.data, frame.len);
+}
+
+void bin_status(Buffer *out, int opcode, int status) {
+    bin_begin(BIN_REPLY);
+    bin_u8(opcode);
+    bin_u8(status);
+    bin_end(out);
+}
+
+void bin_batch(Buffer *out, int opcode, int applied, const uint64_t *failed,
+               int records) {
+    bin_begin(BIN_REPLY);
+    bin_u8(opcode);
+    bin_u8(BIN_OK);
+    bin_u32(applied);
+    bin_bitmap(failed, records);
+    bin_end(out);
+}
+
+void bin_poll_info(Buffer *out, Poll *poll) {
+    Participant *part;
+    int i;
+    bin_begin(BIN_REPLY);
+    bin_u8(BIN_POLL_INFO);
+    bin_u8(BIN_OK);
+    bin_str(poll->name);
+    bin_u16(poll->num_slots);
+    for (i = 0; i < poll->num_slots; i++) {
+        bin_str(poll->slot_labels[i]);
+    }
+    bin_u32(poll->num_participants);
+    for (part = poll->participants; part != NULL; part = part->next) {
+        bin_str(part->name);
+        bitmap_bytes(part->availability, poll->num_slots);
+        bin_str(part->comment != NULL ? part->comment : "");
+    }
+    bin_end(out);
+}
+
+void bin_results(Buffer *out, Poll *poll) {
+    int i;
+    bin_begin(BIN_REPLY);
+    bin_u8(BIN_RESULTS);
+    bin_u8(BIN_OK);
+    bin_str(poll->name);
+    bin_u16(poll->num_slots);
+    for (i = 0; i < poll->num_slots; i++) {
+        bin_str(poll->slot_labels[i]);
+        bin_u32(poll->slot_counts[i]);
+    }
+    bin_end(out);
+}
+
+void bin_hello(Buffer *out) {
+    bin_begin(BIN_HELLO);
+    bin_u8(BIN_VERSION);
+    bin_end(out);
+}
+
+void bin_notify(Buffer *out, char *poll_name) {
+    bin_begin(BIN_NOTIFY);
+    bin_str(poll_name);
+    bin_end(out);
+}
+
+void bin_update(Buffer *out, Poll *poll, int kind, unsigned long from,
+                unsigned long version, Participant **parts, int num_parts,
+                int *counts) {
+    int i, changed = 0;
+    bin_begin(BIN_UPDATE);
+    bin_str(poll->name);
+    bin_u8(kind);
+    bin_u32(from);
+    bin_u32(version);
+    if (kind == BIN_UPDATE_FULL) {
+        bin_u16(poll->num_slots);
+        for (i = 0; i < poll->num_slots; i++) {
+            bin_str(poll->slot_labels[i]);
+        }
+    }
+    if (kind != BIN_UPDATE_DELETED) {
+        for (i = 0; i < poll->num_slots; i++) {
+            changed += counts == NULL || counts[i] != poll->slot_counts[i];
+        }
+    }
+    bin_u16(changed);
+    for (i = 0; i < poll->num_slots && changed > 0; i++) {
+        if (counts == NULL || counts[i] != poll->slot_counts[i]) {
+            bin_u16(i);
+            bin_u32(poll->slot_counts[i]);
+        }
+    }
+    if (kind == BIN_UPDATE_FULL) {
+        Participant *part;
+        bin_u32(poll->num_participants);
+        for (part = poll->participants; part != NULL; part = part->next) {
+            bin_str(part->name);
+            bin_bitmap(part->availability, poll->num_slots);
+            bin_str(part->comment != NULL ? part->comment : "");
+        }
+    } else {
+        bin_u32(num_parts);
+        for (i = 0; i < num_parts; i++) {
+            bin_str(parts[i]->name);
+            bin_bitmap(parts[i]->availability, poll->num_slots);
+            bin_str(parts[i]->comment != NULL ? parts[i]->comment : "");
+        }
+    }
+    bin_end(out);
+}
+
+// commands by opcode
+static char *names[] = {"unknown", "create_poll", "vote", "comment",
+                        "delete_poll", "list_polls", "poll_info",
+                        "results", "quit", "snapshot", "watch", "unwatch",
+                        "vote_many", "comment_many"};
+
+char *bin_command_name(int opcode) {
+    if (opcode < BIN_CREATE_POLL || opcode > BIN_COMMENT_MANY) {
+        return names[0];
+    }
+    return names[opcode];
+}
+
+int bin_opcode(char *name) {
+    int i;
+    for (i = BIN_CREATE_POLL; i <= BIN_COMMENT_MANY; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+long bin_frame_size(const char *buf, long len, long max) {
+    if (len < BIN_HEADER) {
+        return 0;
+    }
+    long size = (long)get_u32((const unsigned char *)buf) + BIN_HEADER;
+    if (size > max) {
+        return -1;
+    }
+    return size <= len ? size : 0;
+}
+
+/* Decoding. at walks the fields of the frame and end is one past it. */
+typedef struct reader {
+    unsigned char *at;
+    unsigned char *end;
+} Reader;
+
+static int get_u16(Reader *r, int *v) {
+    if (r->end - r->at < 2) {
+        return -1;
+    }
+    *v = r->at[0] << 8 | r->at[1];
+    r->at += 2;
+    return 0;
+}
+
+/* Take a string field and '\0' terminate it where it lies, by sliding it
+ * down over its length. Return NULL if it runs past the frame, or holds
+ * a '\0' or a newline, which would cut it short for text clients.
+ */
+static char *get_str(Reader *r) {
+    int len;
+    if (get_u16(r, &len) == -1 || r->end - r->at < len ||
+        memchr(r->at, '\0', len) != NULL || memchr(r->at, '\n', len) != NULL) {
+        return NULL;
+    }
+    char *s = (char *)r->at - 2;
+    memmove(s, r->at, len);
+    s[len] = '\0';
+    r->at += len;
+    return s;
+}
+
+/* Take a poll or participant name, held to what a text client could
+ * send: not empty, no whitespace, and short enough to be kept whole.
+ * Return NULL if it is not.
+ */
+static char *get_name(Reader *r) {
+    char *s = get_str(r);
+    int i;
+    if (s == NULL || *s == '\0') {
+        return NULL;
+    }
+    for (i = 0; s[i] != '\0'; i++) {
+        if (i == MAX_NAME - 1 || isspace((unsigned char)s[i])) {
+            return NULL;
+        }
+    }
+    return s;
+}
+
+// text form of the last list_polls limit decoded on this thread
+static __thread char limit[12];
+
+// '0' and '1' forms of the bitmaps in the last frame decoded on this
+// thread, one after another
+static __thread char *avail;
+static __thread int avail_cap;
+static __thread int avail_used;
+
+/* Take a bitmap field as an availability string, after the others from
+ * this frame in avail. Return where it starts there, as an offset since
+ * avail moves when it grows, or -1 if the field is malformed.
+ */
+static int get_bitmap(Reader *r) {
+    int nbits, i;
+    if (get_u16(r, &nbits) == -1 || r->end - r->at < (nbits + 7) / 8) {
+        return -1;
+    }
+    if (avail_used + nbits + 1 > avail_cap) {
+        avail_cap = (avail_used + nbits + 1) * 2;
+        if ((avail = realloc(avail, avail_cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    char *s = avail + avail_used;
+    for (i = 0; i < nbits; i++) {
+        s[i] = (r->at[i / 8] >> (i % 8)) & 1 ? '1' : '0';
+    }
+    s[nbits] = '\0';
+    r->at += (nbits + 7) / 8;
+    avail_used += nbits + 1;
+    return s - avail;
+}
+
+int bin_decode(char *buf, long size, int *opcode, char **cmd_argv, int max) {
+    Reader r = {(unsigned char *)buf + BIN_HEADER, (unsigned char *)buf + size};
+    int argc = 0;
+    int count, i, at;
+    
+    if (r.at == r.end) {
+        return -1;
+    }
+    *opcode = *r.at++;
+    if (*opcode < BIN_CREATE_POLL || *opcode > BIN_COMMENT_MANY) {
+        return -1;
+    }
+    avail_used = 0;
+    cmd_argv[argc++] = names[*opcode];
+    switch (*opcode) {
+        case BIN_CREATE_POLL:
+            if ((cmd_argv[argc++] = get_name(&r)) == NULL ||
+                get_u16(&r, &count) == -1 || count == 0 || count + 2 > max) {
+                return -1;
+            }
+            for (i = 0; i < count; i++) {
+                if ((cmd_argv[argc++] = get_str(&r)) == NULL) {
+                    return -1;
+                }
+            }
+            break;
+        case BIN_VOTE:
+            if ((cmd_argv[argc++] = get_name(&r)) == NULL ||
+                (at = get_bitmap(&r)) == -1) {
+                return -1;
+            }
+            cmd_argv[argc++] = avail + at;
+            break;
+        case BIN_VOTE_MANY:
+        case BIN_COMMENT_MANY: {
+            // every record takes the same number of words, so the records
+            // need no separator: name, availability and comment for a
+            // vote, "" included, and name and comment otherwise, where a
+            // text comment needs a word. The bitmaps are placed once they
+            // have all been taken.
+            int fields = *opcode == BIN_VOTE_MANY ? 3 : 2;
+            int bitmap_arg[max], bitmap_at[max];
+            int bitmaps = 0;
+            if ((cmd_argv[argc++] = get_name(&r)) == NULL ||
+                get_u16(&r, &count) == -1 || count == 0) {
+                return -1;
+            }
+            for (i = 0; i < count; i++) {
+                if (argc + fields > max) {
+                    return -1;
+                }
+                if ((cmd_argv[argc++] = get_name(&r)) == NULL) {
+                    return -1;
+                }
+                if (*opcode == BIN_VOTE_MANY) {
+                    if ((bitmap_at[bitmaps] = get_bitmap(&r)) == -1) {
+                        return -1;
+                    }
+                    bitmap_arg[bitmaps++] = argc++;
+                }
+                if ((cmd_argv[argc++] = get_str(&r)) == NULL ||
+                    (*opcode == BIN_COMMENT_MANY && *cmd_argv[argc - 1] == '\0')) {
+                    return -1;
+                }
+            }
+            for (i = 0; i < bitmaps; i++) {
+                cmd_argv[bitmap_arg[i]] = avail + bitmap_at[i];
+            }
+            break;
+        }
+        case BIN_COMMENT:
+            if ((cmd_argv[argc++] = get_name(&r)) == NULL ||
+                (cmd_argv[argc++] = get_str(&r)) == NULL) {
+                return -1;
+            }
+            break;
+        case BIN_LIST_POLLS: {
+            // paged if there are fields at all; the words are laid out as
+            // list_polls [prefix] after cursor [limit N]
+            char *prefix, *after;
+            uint32_t n;
+            if (r.at == r.end) {
+                break;
+            }
+            if ((prefix = get_str(&r)) == NULL || (after = get_str(&r)) == NULL ||
+                r.end - r.at < 4 || max < 6) {
+                return -1;
+            }
+            n = get_u32(r.at);
+            r.at += 4;
+            if (*prefix != '\0') {
+                cmd_argv[argc++] = prefix;
+            }
+            cmd_argv[argc++] = "after";
+            cmd_argv[argc++] = after;
+            if (n > 0) {
+                snprintf(limit, sizeof(limit), "%u", n);
+                cmd_argv[argc++] = "limit";
+                cmd_argv[argc++] = limit;
+            }
+            break;
+        }
+        case BIN_SNAPSHOT:
+            // an admin port command now; the opcode stays reserved
+            return -1;
+        case BIN_DELETE_POLL:
+        case BIN_POLL_INFO:
+        case BIN_RESULTS:
+        case BIN_WATCH:
+        case BIN_UNWATCH:
+            if ((cmd_argv[argc++] = get_name(&r)) == NULL) {
+                return -1;
+            }
+            break;
+    }
+    // trailing bytes mean the two ends disagree about the layout
+    return r.at == r.end ? argc : -1;
+}
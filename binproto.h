@@ -0,0 +1,177 @@
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include <stdint.h>
+#include "lists.h"
+#include "buffer.h"
+
+/* The binary protocol, for programs rather than people. A client picks it
+ * by starting its username line with BIN_HANDSHAKE; everything after that
+ * line, both ways, is frames:
+ *
+ *   u32 length of the rest, opcode byte, fields
+ *
+ * Integers are big-endian. A string is a u16 length and its bytes. A
+ * bitmap is a u16 bit count and (count + 7) / 8 bytes, bit i of the
+ * bitmap being bit i % 8 of byte i / 8. Poll and participant names are
+ * held to the text protocol's rules: not empty, no whitespace, and at
+ * most MAX_NAME - 1 bytes.
+ *
+ * Requests, by opcode:
+ *   BIN_CREATE_POLL  poll name, u16 label count, labels
+ *   BIN_VOTE         poll name, availability bitmap
+ *   BIN_COMMENT      poll name, comment
+ *   BIN_DELETE_POLL  poll name
+ *   BIN_LIST_POLLS   nothing, or for a page: prefix, cursor ("" for the
+ *                    start) and u32 limit (0 for none)
+ *   BIN_POLL_INFO    poll name
+ *   BIN_RESULTS      poll name
+ *   BIN_QUIT
+ *   BIN_WATCH        poll name
+ *   BIN_UNWATCH      poll name
+ *   BIN_VOTE_MANY    poll name, u16 record count, then per record a
+ *                    participant name, availability bitmap and comment
+ *                    ("" to leave it be)
+ *   BIN_COMMENT_MANY poll name, u16 record count, then per record a
+ *                    participant name and comment, which as for a
+ *                    text comment may not be empty
+ *
+ * Every request but BIN_QUIT gets one BIN_REPLY frame, in order: the
+ * request's opcode, a status byte, and on success a body.
+ *   BIN_LIST_POLLS   u32 count, poll names in creation order, or in
+ *                    name order for a page
+ *   BIN_POLL_INFO    poll name, u16 slot count, labels, u32 participant
+ *                    count, then per participant its name, availability
+ *                    bitmap bytes (the slot count is not repeated) and
+ *                    comment, "" if none
+ *   BIN_RESULTS      poll name, u16 slot count, then per slot its label
+ *                    and u32 number of participants available
+ *   BIN_VOTE_MANY,   u32 number of records applied, and a bitmap with
+ *   BIN_COMMENT_MANY a bit set for each record that was not
+ *                    applied
+ * The status is the lists.c return value for the command (so 1 is no
+ * such poll for all of them, 2 to 4 as for add_comment and
+ * add_participant), or BIN_BAD_REQUEST. For BIN_WATCH 2 means the
+ * server has no session for the client to send updates to, and for
+ * BIN_UNWATCH that the client was not watching the poll.
+ *
+ * BIN_HELLO, holding BIN_VERSION as a byte, answers the handshake, and
+ * BIN_NOTIFY frames, holding a poll name, report activity on a poll the
+ * client follows.
+ *
+ * BIN_UPDATE frames carry a watched poll's changes:
+ *   poll name, kind byte, u32 from version, u32 version,
+ *   for BIN_UPDATE_FULL only: u16 slot count, labels,
+ *   u16 count of slots, then per slot its index and u32 count,
+ *   u32 participant count, then per participant its name, availability
+ *   bitmap and comment, "" if none
+ * A BIN_UPDATE_FULL update holds the whole poll and replaces whatever
+ * the client had. A BIN_UPDATE_DELTA holds only the slots and
+ * participants that changed between the two versions, and applies only
+ * on top of the from version. A BIN_UPDATE_DELETED update has no slots
+ * or participants and ends the watch.
+ */
+#define BIN_HANDSHAKE '\001'
+#define BIN_VERSION 1
+
+#define BIN_CREATE_POLL 1
+#define BIN_VOTE 2
+#define BIN_COMMENT 3
+#define BIN_DELETE_POLL 4
+#define BIN_LIST_POLLS 5
+#define BIN_POLL_INFO 6
+#define BIN_RESULTS 7
+#define BIN_QUIT 8
+#define BIN_SNAPSHOT 9   // reserved: snapshot is an admin port command
+#define BIN_WATCH 10
+#define BIN_UNWATCH 11
+#define BIN_VOTE_MANY 12
+#define BIN_COMMENT_MANY 13
+
+#define BIN_HELLO 0x80
+#define BIN_REPLY 0x81
+#define BIN_NOTIFY 0x82
+#define BIN_UPDATE 0x83
+
+#define BIN_UPDATE_DELTA 0
+#define BIN_UPDATE_FULL 1
+#define BIN_UPDATE_DELETED 2
+
+#define BIN_OK 0
+#define BIN_BAD_REQUEST 0xff
+
+// bytes of length in front of every frame
+#define BIN_HEADER 4
+
+/* Building a frame. Fields are added to this thread's frame under
+ * construction, and bin_end appends the finished frame to out.
+ */
+void bin_begin(int opcode);
+void bin_u8(int v);
+void bin_u16(int v);
+void bin_u32(uint32_t v);
+void bin_str(const char *s);
+void bin_bitmap(const uint64_t *words, int nbits);
+void bin_end(Buffer *out);
+
+/* Append a reply to request opcode with this status and no body.
+ */
+void bin_status(Buffer *out, int opcode, int status);
+
+/* Append the successful reply to the batch request opcode, for records
+ * records of which applied were applied; failed has a bit set for each
+ * one that was not.
+ */
+void bin_batch(Buffer *out, int opcode, int applied, const uint64_t *failed,
+               int records);
+
+/* Append the BIN_POLL_INFO or BIN_RESULTS reply for poll.
+ */
+void bin_poll_info(Buffer *out, Poll *poll);
+void bin_results(Buffer *out, Poll *poll);
+
+/* Append the BIN_HELLO frame.
+ */
+void bin_hello(Buffer *out);
+
+/* Append a BIN_NOTIFY frame for activity on the poll named poll_name.
+ */
+void bin_notify(Buffer *out, char *poll_name);
+
+/* Append a BIN_UPDATE frame of this kind for poll, going from version
+ * from to version. A full update holds every participant and slot;
+ * otherwise it holds the num_parts participants in parts and, when
+ * counts is not NULL, the slots whose count is no longer the one in
+ * counts.
+ */
+void bin_update(Buffer *out, Poll *poll, int kind, unsigned long from,
+                unsigned long version, Participant **parts, int num_parts,
+                int *counts);
+
+/* Return the name of the command with this opcode, as the text protocol
+ * spells it, or "unknown" if there is none.
+ */
+char *bin_command_name(int opcode);
+
+/* Return the opcode of the command called name, or 0 if there is none.
+ */
+int bin_opcode(char *name);
+
+/* Return the size of the frame at the start of buf, header included,
+ * if all len bytes of it are there, 0 if not yet, or -1 if it says it
+ * is longer than max.
+ */
+long bin_frame_size(const char *buf, long len, long max);
+
+/* Decode the request frame of size bytes at frame in place, as the
+ * words a text command would have: cmd_argv[0] is the command's name
+ * and the fields follow, each '\0' terminated, with a bitmap as a
+ * string of '0' and '1'. The records of BIN_VOTE_MANY and
+ * BIN_COMMENT_MANY are not separated as the text commands' are: each
+ * is all its fields, three and two words. Set *opcode and return the
+ * number of words, or -1 if the frame is malformed, has a name that
+ * breaks the rules above, or has more than max words.
+ */
+int bin_decode(char *frame, long size, int *opcode, char **cmd_argv, int max);
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binproto.h"
+#include "check.h"
+
+#define MAX_WORDS 64
+#define MAX_FRAME (64 * 1024)
+
+// the frames in out, one after another, in a malloc'd block of *size bytes
+static char *take(Buffer *out, long *size) {
+    struct iovec iov[16];
+    char *data = NULL;
+    *size = 0;
+    while (out->len > 0) {
+        int i, n = buf_iov(out, iov, 16);
+        for (i = 0; i < n; i++) {
+            data = realloc(data, *size + iov[i].iov_len);
+            memcpy(data + *size, iov[i].iov_base, iov[i].iov_len);
+            *size += iov[i].iov_len;
+            buf_consume(out, iov[i].iov_len);
+        }
+    }
+    return data;
+}
+
+// decode a copy of the first size bytes of frame, which bin_decode changes
+static int decode(const char *frame, long size, int *opcode, char **cmd_argv,
+                  char **copy) {
+    *copy = realloc(*copy, size ? size : 1);
+    memcpy(*copy, frame, size);
+    return bin_decode(*copy, size, opcode, cmd_argv, MAX_WORDS);
+}
+
+static void bitmap(const char *bits) {
+    uint64_t words[1] = {0};
+    int i;
+    for (i = 0; bits[i] != '\0'; i++) {
+        if (bits[i] == '1') {
+            words[0] |= (uint64_t)1 << i;
+        }
+    }
+    bin_bitmap(words, i);
+}
+
+// a vote_many for lunch whose names and comments look like separators
+static char *vote_many(long *size) {
+    Buffer out = {0};
+    bin_begin(BIN_VOTE_MANY);
+    bin_str("lunch");
+    bin_u16(3);
+    bin_str(";");
+    bitmap("101");
+    bin_str(";");
+    bin_str("bob");
+    bitmap("11");
+    bin_str("");
+    bin_str("carol");
+    bitmap("");
+    bin_str("changed ; mind");
+    bin_end(&out);
+    return take(&out, size);
+}
+
+static void test_frame_size() {
+    long size;
+    char *frame = vote_many(&size);
+    CHECK(bin_frame_size(frame, 0, MAX_FRAME) == 0);
+    CHECK(bin_frame_size(frame, BIN_HEADER - 1, MAX_FRAME) == 0);
+    CHECK(bin_frame_size(frame, size - 1, MAX_FRAME) == 0);
+    CHECK(bin_frame_size(frame, size, MAX_FRAME) == size);
+    CHECK(bin_frame_size(frame, size, size) == size);
+    // too long to ever take, whether or not it has all come in
+    CHECK(bin_frame_size(frame, size, size - 1) == -1);
+    CHECK(bin_frame_size(frame, BIN_HEADER, size - 1) == -1);
+    free(frame);
+}
+
+static void test_batch() {
+    char *cmd_argv[MAX_WORDS];
+    char *copy = NULL;
+    int opcode;
+    long size;
+    char *frame = vote_many(&size);
+
+    // three words a record, with nothing between them
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == 2 + 3 * 3);
+    CHECK(opcode == BIN_VOTE_MANY);
+    CHECK(strcmp(cmd_argv[0], "vote_many") == 0);
+    CHECK(strcmp(cmd_argv[1], "lunch") == 0);
+    CHECK(strcmp(cmd_argv[2], ";") == 0);
+    CHECK(strcmp(cmd_argv[3], "101") == 0);
+    CHECK(strcmp(cmd_argv[4], ";") == 0);
+    CHECK(strcmp(cmd_argv[5], "bob") == 0);
+    CHECK(strcmp(cmd_argv[6], "11") == 0);
+    CHECK(strcmp(cmd_argv[7], "") == 0);
+    CHECK(strcmp(cmd_argv[8], "carol") == 0);
+    CHECK(strcmp(cmd_argv[9], "") == 0);
+    CHECK(strcmp(cmd_argv[10], "changed ; mind") == 0);
+    free(frame);
+
+    // a comment is kept as a word of its own, separator or not
+    Buffer out = {0};
+    bin_begin(BIN_COMMENT_MANY);
+    bin_str("lunch");
+    bin_u16(2);
+    bin_str("bob");
+    bin_str("hi");
+    bin_str(";");
+    bin_str(";");
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == 2 + 2 * 2);
+    CHECK(opcode == BIN_COMMENT_MANY);
+    CHECK(strcmp(cmd_argv[2], "bob") == 0);
+    CHECK(strcmp(cmd_argv[3], "hi") == 0);
+    CHECK(strcmp(cmd_argv[4], ";") == 0);
+    CHECK(strcmp(cmd_argv[5], ";") == 0);
+    free(frame);
+    free(copy);
+}
+
+static void test_malformed() {
+    char *cmd_argv[MAX_WORDS];
+    char *copy = NULL;
+    int opcode, i;
+    long size, n;
+    char *frame = vote_many(&size);
+
+    // cut short anywhere, the frame is refused
+    for (n = BIN_HEADER; n < size; n++) {
+        CHECK(decode(frame, n, &opcode, cmd_argv, &copy) == -1);
+    }
+    // a string said to run past the end
+    frame[BIN_HEADER + 2] = 0x7f;
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+    free(frame);
+
+    // no such opcode
+    Buffer out = {0};
+    bin_begin(BIN_COMMENT_MANY + 1);
+    bin_str("lunch");
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+    free(frame);
+
+    // snapshot is for the admin port only
+    bin_begin(BIN_SNAPSHOT);
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+    free(frame);
+
+    // no records, then more records than words
+    bin_begin(BIN_COMMENT_MANY);
+    bin_str("lunch");
+    bin_u16(0);
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+    free(frame);
+    bin_begin(BIN_COMMENT_MANY);
+    bin_str("lunch");
+    bin_u16(MAX_WORDS);
+    for (i = 0; i < MAX_WORDS; i++) {
+        bin_str("bob");
+        bin_str("hi");
+    }
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+    free(frame);
+
+    // a text comment needs at least a word, so an empty one is refused
+    bin_begin(BIN_COMMENT_MANY);
+    bin_str("lunch");
+    bin_u16(2);
+    bin_str("bob");
+    bin_str("hi");
+    bin_str("carol");
+    bin_str("");
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+    free(frame);
+
+    // a name holding a newline would split the command for text clients
+    bin_begin(BIN_POLL_INFO);
+    bin_str("lu\nnch");
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+    free(frame);
+
+    // names a text client could not have sent, as the poll's name and as
+    // a participant's
+    char longest[MAX_NAME + 1];
+    char *bad[] = {"", "lu nch", "lunch\t", "\rlunch", longest};
+    memset(longest, 'x', MAX_NAME);
+    longest[MAX_NAME] = '\0';
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        bin_begin(BIN_POLL_INFO);
+        bin_str(bad[i]);
+        bin_end(&out);
+        frame = take(&out, &size);
+        CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+        free(frame);
+        bin_begin(BIN_COMMENT_MANY);
+        bin_str("lunch");
+        bin_u16(1);
+        bin_str(bad[i]);
+        bin_str("hi");
+        bin_end(&out);
+        frame = take(&out, &size);
+        CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == -1);
+        free(frame);
+    }
+    // one byte shorter is the longest name kept whole
+    longest[MAX_NAME - 1] = '\0';
+    bin_begin(BIN_POLL_INFO);
+    bin_str(longest);
+    bin_end(&out);
+    frame = take(&out, &size);
+    CHECK(decode(frame, size, &opcode, cmd_argv, &copy) == 2);
+    CHECK(strcmp(cmd_argv[1], longest) == 0);
+    free(frame);
+    free(copy);
+}
+
+int main() {
+    test_frame_size();
+    test_batch();
+    test_malformed();
+    return check_result("binproto_test");
+}
@@ -0,0 +1,165 @@
+#include "buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// emptied chunks are kept for reuse, up to this many
+#define MAX_SPARE_CHUNKS 256
+
+// per thread, so workers never share a list
+static __thread Chunk *spare = NULL;
+static __thread int num_spare = 0;
+
+static Chunk *get_chunk() {
+    Chunk *c;
+    if (spare != NULL) {
+        c = spare;
+        spare = c->next;
+        num_spare--;
+    } else if ((c = malloc(sizeof(Chunk))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    c->next = NULL;
+    c->start = 0;
+    c->end = 0;
+    return c;
+}
+
+static void put_chunk(Chunk *c) {
+    if (num_spare < MAX_SPARE_CHUNKS) {
+        c->next = spare;
+        spare = c;
+        num_spare++;
+    } else {
+        free(c);
+    }
+}
+
+void buf_append(Buffer *b, const char *data, size_t len) {
+    b->len += len;
+    while (len > 0) {
+        if (b->tail == NULL || b->tail->end == CHUNK_SIZE) {
+            Chunk *c = get_chunk();
+            if (b->tail == NULL) {
+                b->head = c;
+            } else {
+                b->tail->next = c;
+            }
+            b->tail = c;
+        }
+        size_t n = CHUNK_SIZE - b->tail->end;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(b->tail->data + b->tail->end, data, n);
+        b->tail->end += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void buf_puts(Buffer *b, const char *s) {
+    buf_append(b, s, strlen(s));
+}
+
+void buf_printf(Buffer *b, const char *fmt, ...) {
+    va_list args;
+    int room = 0;
+    if (b->tail != NULL) {
+        room = CHUNK_SIZE - b->tail->end;
+    }
+
+    // format straight into the tail chunk when the output fits there
+    va_start(args, fmt);
+    int len = vsnprintf(room ? b->tail->data + b->tail->end : NULL, room,
+                        fmt, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+    if (len < room) {
+        b->tail->end += len;
+        b->len += len;
+        return;
+    }
+
+    char small[256];
+    char *out = small;
+    if (len >= sizeof(small) && (out = malloc(len + 1)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    va_start(args, fmt);
+    vsnprintf(out, len + 1, fmt, args);
+    va_end(args);
+    buf_append(b, out, len);
+    if (out != small) {
+        free(out);
+    }
+}
+
+void buf_splice(Buffer *dst, Buffer *src) {
+    if (src->head == NULL) {
+        return;
+    }
+    // a short response is copied into the room left in dst's last chunk,
+    // so a run of replies shares chunks and goes out in few iovecs
+    if (dst->tail != NULL && src->len <= (size_t)(CHUNK_SIZE - dst->tail->end)) {
+        Chunk *c;
+        while ((c = src->head) != NULL) {
+            memcpy(dst->tail->data + dst->tail->end, c->data + c->start,
+                   c->end - c->start);
+            dst->tail->end += c->end - c->start;
+            src->head = c->next;
+            put_chunk(c);
+        }
+        dst->len += src->len;
+        src->tail = NULL;
+        src->len = 0;
+        return;
+    }
+    if (dst->tail == NULL) {
+        dst->head = src->head;
+    } else {
+        dst->tail->next = src->head;
+    }
+    dst->tail = src->tail;
+    dst->len += src->len;
+    src->head = NULL;
+    src->tail = NULL;
+    src->len = 0;
+}
+
+int buf_iov(Buffer *b, struct iovec *iov, int max) {
+    int n = 0;
+    Chunk *c;
+    for (c = b->head; c != NULL && n < max; c = c->next) {
+        iov[n].iov_base = c->data + c->start;
+        iov[n].iov_len = c->end - c->start;
+        n++;
+    }
+    return n;
+}
+
+void buf_consume(Buffer *b, size_t n) {
+    b->len -= n;
+    while (n > 0) {
+        Chunk *c = b->head;
+        size_t avail = c->end - c->start;
+        if (n < avail) {
+            c->start += n;
+            return;
+        }
+        n -= avail;
+        b->head = c->next;
+        if (b->head == NULL) {
+            b->tail = NULL;
+        }
+        put_chunk(c);
+    }
+}
+
+void buf_clear(Buffer *b) {
+    buf_consume(b, b->len);
+}
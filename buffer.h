@@ -0,0 +1,59 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* A byte queue kept as a chain of fixed-size chunks. Appending never moves
+ * bytes that are already queued, and the queued bytes can be handed to
+ * writev() a chunk per iovec. A zero-initialized Buffer is empty.
+ */
+#define CHUNK_SIZE 4096
+
+typedef struct chunk {
+   struct chunk *next;
+   int start;   // first unconsumed byte in data
+   int end;     // one past the last byte written to data
+   char data[CHUNK_SIZE];
+} Chunk;
+
+typedef struct buffer {
+   Chunk *head;
+   Chunk *tail;
+   size_t len;   // bytes queued across all chunks
+} Buffer;
+
+/* Append len bytes of data to the end of b.
+ */
+void buf_append(Buffer *b, const char *data, size_t len);
+
+/* Append the string s to the end of b.
+ */
+void buf_puts(Buffer *b, const char *s);
+
+/* Append printf-style formatted output to the end of b.
+ */
+void buf_printf(Buffer *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Move everything queued in src to the end of dst, leaving src empty.
+ * The chunks are moved over rather than copied, unless src is short
+ * enough to copy into the room left in dst's last chunk.
+ */
+void buf_splice(Buffer *dst, Buffer *src);
+
+/* Point up to max iovecs at the queued bytes of b, in order.
+ * Return the number of iovecs filled in.
+ */
+int buf_iov(Buffer *b, struct iovec *iov, int max);
+
+/* Drop the first n queued bytes of b, which must hold at least n.
+ */
+void buf_consume(Buffer *b, size_t n);
+
+/* Drop everything queued in b.
+ */
+void buf_clear(Buffer *b);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/* What the *_test programs share. CHECK reports a condition that does not
+ * hold and carries on, so one run shows every failure, and main returns
+ * check_result() as the program's exit status for make check.
+ */
+static int check_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, \
+                    __LINE__, #cond); \
+            check_failures++; \
+        } \
+    } while (0)
+
+static int check_result(const char *test) {
+    if (check_failures > 0) {
+        printf("%s: %d checks failed\n", test, check_failures);
+        return 1;
+    }
+    printf("%s: ok\n", test);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,178 @@
+#include "hash_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_CAP 8
+// buckets of the old table moved across on each insert or remove
+#define MIGRATE_STEP 16
+
+// marks a bucket whose entry was removed so probing continues past it
+static char tombstone;
+#define TOMB ((void *)&tombstone)
+
+/* FNV-1a */
+unsigned int name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static NameEntry *alloc_table(int cap) {
+    NameEntry *table = calloc(cap, sizeof(NameEntry));
+    if (table == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return table;
+}
+
+/* Return the bucket holding name in this table, or NULL. */
+static NameEntry *probe(NameEntry *table, int cap, const char *name,
+                        unsigned int hash) {
+    if (cap == 0) {
+        return NULL;
+    }
+    int mask = cap - 1;
+    int i = hash & mask;
+    while (table[i].item != NULL) {
+        // interned keys are looked up by the same pointer they were
+        // stored under, which saves comparing them
+        if (table[i].item != TOMB && table[i].hash == hash &&
+            (table[i].key == name || !strcmp(table[i].key, name))) {
+            return &table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Put an entry in the first free bucket of the current table.
+ * The caller makes sure there is room.
+ */
+static void place(NameIndex *index, const char *key, unsigned int hash,
+                  void *item) {
+    int mask = index->cap - 1;
+    int i = hash & mask;
+    while (index->table[i].item != NULL && index->table[i].item != TOMB) {
+        i = (i + 1) & mask;
+    }
+    if (index->table[i].item == TOMB) {
+        index->tombs--;
+    }
+    index->table[i].hash = hash;
+    index->table[i].key = key;
+    index->table[i].item = item;
+    index->used++;
+}
+
+/* Move up to count buckets from the old table into the current one. */
+static void migrate(NameIndex *index, int count) {
+    while (index->old != NULL && count-- > 0) {
+        NameEntry *e = &index->old[index->old_pos];
+        if (e->item != NULL && e->item != TOMB) {
+            place(index, e->key, e->hash, e->item);
+            index->old_live--;
+            // leave a tombstone so lookups still falling back to the old
+            // table neither find this copy nor stop short of later ones
+            e->item = TOMB;
+            e->key = NULL;
+        }
+        if (++index->old_pos == index->old_cap) {
+            free(index->old);
+            index->old = NULL;
+            index->old_cap = 0;
+            index->old_pos = 0;
+        }
+    }
+}
+
+/* Start moving everything into a fresh table with room for extra more
+ * entries. Live entries still waiting in the old table count against the
+ * new one, so size for all of them. When it is tombstones that filled
+ * the table the new one is the same size, which clears them out.
+ */
+static void start_resize(NameIndex *index, int extra) {
+    // a previous resize must be finished before another can begin
+    migrate(index, index->old_cap - index->old_pos);
+
+    int cap = index->cap ? index->cap : MIN_CAP;
+    while ((index->used + extra) * 2 >= cap) {
+        cap *= 2;
+    }
+    if (index->table == NULL) {
+        index->table = alloc_table(cap);
+        index->cap = cap;
+        return;
+    }
+    index->old = index->table;
+    index->old_cap = index->cap;
+    index->old_pos = 0;
+    index->old_live = index->used;
+    index->table = alloc_table(cap);
+    index->cap = cap;
+    index->used = 0;
+    index->tombs = 0;
+}
+
+void *index_find(NameIndex *index, const char *name, unsigned int hash) {
+    NameEntry *e = probe(index->table, index->cap, name, hash);
+    if (e == NULL && index->old != NULL) {
+        e = probe(index->old, index->old_cap, name, hash);
+    }
+    return e == NULL ? NULL : e->item;
+}
+
+/* Return whether count more entries would take the load of the current
+ * table past three quarters, so that probes would get long. Tombstones
+ * count, and so do the live entries still to come across from the old
+ * table; its empty buckets do not.
+ */
+static int too_full(NameIndex *index, int count) {
+    return (index->used + index->tombs + index->old_live + count) * 4 >
+           index->cap * 3;
+}
+
+void index_insert(NameIndex *index, const char *key, unsigned int hash,
+                  void *item) {
+    if (too_full(index, 1)) {
+        start_resize(index, 0);
+    }
+    place(index, key, hash, item);
+    migrate(index, MIGRATE_STEP);
+}
+
+void index_reserve(NameIndex *index, int count) {
+    if (too_full(index, count)) {
+        start_resize(index, count);
+    }
+}
+
+int index_remove(NameIndex *index, const char *key, unsigned int hash,
+                 void *item) {
+    NameEntry *e = probe(index->table, index->cap, key, hash);
+    if (e != NULL && e->item == item) {
+        index->used--;
+        index->tombs++;
+    } else if (index->old != NULL &&
+               (e = probe(index->old, index->old_cap, key, hash)) != NULL &&
+               e->item == item) {
+        // entries in the old table are not counted in used
+        index->old_live--;
+    } else {
+        return 1;
+    }
+    e->item = TOMB;
+    e->key = NULL;
+    migrate(index, MIGRATE_STEP);
+    return 0;
+}
+
+void index_free(NameIndex *index) {
+    free(index->table);
+    free(index->old);
+    memset(index, 0, sizeof(NameIndex));
+}
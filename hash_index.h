@@ -0,0 +1,58 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+/* An open addressing hash index from names to records. The index does not
+ * own the records or their names; each entry keeps a pointer to the name
+ * stored inside the record along with its cached hash.
+ *
+ * Growing the table is incremental: a resize allocates the bigger table
+ * and then each later insert or remove moves a few buckets across, so no
+ * single insert has to rehash everything. Lookups check both tables while
+ * a resize is in progress. A zero-initialized NameIndex is empty.
+ */
+typedef struct name_entry {
+   unsigned int hash;
+   const char *key;
+   void *item;
+} NameEntry;
+
+typedef struct name_index {
+   NameEntry *table;
+   int cap;          // always a power of two, or 0 before the first insert
+   int used;         // live entries in table
+   int tombs;        // removed entries still occupying a bucket in table
+   NameEntry *old;   // table being drained by an incremental resize
+   int old_cap;
+   int old_pos;      // next bucket of old to move across
+   int old_live;     // live entries still in old
+} NameIndex;
+
+/* Return the hash of this name. Records cache it so it is computed once.
+ */
+unsigned int name_hash(const char *name);
+
+/* Return the item stored under name (whose hash is hash) or NULL.
+ */
+void *index_find(NameIndex *index, const char *name, unsigned int hash);
+
+/* Add item under key. key must stay valid while the item is indexed and
+ * must not already be in the index.
+ */
+void index_insert(NameIndex *index, const char *key, unsigned int hash,
+                  void *item);
+
+/* Make room for count more entries at once, so that many inserts in a
+ * row resize the table at most once.
+ */
+void index_reserve(NameIndex *index, int count);
+
+/* Remove the entry for this item. Return 0 on success, 1 if not found.
+ */
+int index_remove(NameIndex *index, const char *key, unsigned int hash,
+                 void *item);
+
+/* Free the index's tables and leave it empty. Items are not touched.
+ */
+void index_free(NameIndex *index);
+
+#endif
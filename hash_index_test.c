@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "hash_index.h"
+#include "check.h"
+
+#define LIVE 1000
+#define CHURN 200000
+
+// names live here, at a fixed address, for as long as they are indexed
+static char names[LIVE + CHURN][16];
+
+static char *name(int i) {
+    if (names[i][0] == '\0') {
+        snprintf(names[i], sizeof(names[i]), "name%d", i);
+    }
+    return names[i];
+}
+
+static void insert(NameIndex *index, int i) {
+    index_insert(index, name(i), name_hash(name(i)), name(i));
+}
+
+static void *find(NameIndex *index, int i) {
+    return index_find(index, name(i), name_hash(name(i)));
+}
+
+static void test_basic() {
+    NameIndex index = {0};
+    int i;
+    for (i = 0; i < LIVE; i++) {
+        insert(&index, i);
+    }
+    for (i = 0; i < LIVE; i += 2) {
+        CHECK(index_remove(&index, name(i), name_hash(name(i)), name(i)) == 0);
+    }
+    CHECK(index_remove(&index, name(0), name_hash(name(0)), name(0)) == 1);
+    for (i = 0; i < LIVE; i++) {
+        CHECK(find(&index, i) == (i % 2 ? name(i) : NULL));
+    }
+    index_free(&index);
+}
+
+/* A steady number of names under create/delete churn leaves tombstones
+ * behind. Clearing them must not turn into a new table on every insert.
+ */
+static void test_churn() {
+    NameIndex index = {0};
+    NameEntry *table;
+    int resizes = 0, max_cap = 0;
+    int i;
+    for (i = 0; i < LIVE; i++) {
+        insert(&index, i);
+    }
+    table = index.table;
+    for (i = 0; i < CHURN; i++) {
+        int gone = i;   // the oldest live name
+        CHECK(index_remove(&index, name(gone), name_hash(name(gone)),
+                           name(gone)) == 0);
+        insert(&index, LIVE + i);
+        if (index.table != table) {
+            resizes++;
+            table = index.table;
+        }
+        if (index.cap > max_cap) {
+            max_cap = index.cap;
+        }
+        CHECK(find(&index, gone) == NULL);
+        CHECK(find(&index, LIVE + i) == name(LIVE + i));
+    }
+    // each rebuild clears at least a quarter of the table of tombstones
+    CHECK(resizes <= CHURN / (max_cap / 4) + 8);
+    CHECK(max_cap <= 4 * LIVE);
+    for (i = CHURN; i < CHURN + LIVE; i++) {
+        CHECK(find(&index, i) == name(i));
+    }
+    index_free(&index);
+}
+
+/* Room reserved up front takes the inserts without another resize. */
+static void test_reserve() {
+    NameIndex index = {0};
+    int i;
+    index_reserve(&index, LIVE);
+    NameEntry *table = index.table;
+    for (i = 0; i < LIVE; i++) {
+        insert(&index, i);
+    }
+    CHECK(index.table == table);
+    for (i = 0; i < LIVE; i++) {
+        CHECK(find(&index, i) == name(i));
+    }
+    index_free(&index);
+}
+
+int main() {
+    test_basic();
+    test_churn();
+    test_reserve();
+    return check_result("hash_index_test");
+}
@@ -0,0 +1,56 @@
+#include "intern.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the string is kept behind its count and hash, which are found from it
+struct interned {
+    long users;
+    unsigned int hash;
+    char text[];
+};
+
+static struct interned *header(const char *s) {
+    return (struct interned *)(s - offsetof(struct interned, text));
+}
+
+const char *intern(StringTable *table, const char *s) {
+    unsigned int hash = name_hash(s);
+    struct interned *copy = index_find(&table->index, s, hash);
+    if (copy == NULL) {
+        size_t size = sizeof(struct interned) + strlen(s) + 1;
+        if ((copy = malloc(size)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        copy->users = 0;
+        copy->hash = hash;
+        strcpy(copy->text, s);
+        index_insert(&table->index, copy->text, hash, copy);
+        table->strings++;
+        table->bytes += size;
+    }
+    copy->users++;
+    return copy->text;
+}
+
+const char *intern_find(StringTable *table, const char *s) {
+    struct interned *copy = index_find(&table->index, s, name_hash(s));
+    return copy == NULL ? NULL : copy->text;
+}
+
+unsigned int intern_hash(const char *s) {
+    return header(s)->hash;
+}
+
+void intern_release(StringTable *table, const char *s) {
+    struct interned *copy = header(s);
+    if (--copy->users > 0) {
+        return;
+    }
+    index_remove(&table->index, copy->text, copy->hash, copy);
+    table->strings--;
+    table->bytes -= sizeof(struct interned) + strlen(copy->text) + 1;
+    free(copy);
+}
@@ -0,0 +1,41 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "hash_index.h"
+
+/* Strings stored once however many records use them, like a slot label
+ * or a participant name that comes up in poll after poll. intern hands
+ * out the one shared copy of a string and counts another user of it, and
+ * intern_release drops a user, freeing the copy along with its last one.
+ * Two strings interned in the same table are equal exactly when their
+ * pointers are, so records holding them compare by pointer.
+ *
+ * A table is not locked; each shard keeps its own in its PollList.
+ * A zero-initialized StringTable is empty.
+ */
+typedef struct string_table {
+   NameIndex index;        // each string's copy, by the copy's text
+   long strings;           // distinct strings held
+   unsigned long bytes;    // memory held by the copies
+} StringTable;
+
+/* Return the table's copy of s, making it if s is new, and count one
+ * more user of it.
+ */
+const char *intern(StringTable *table, const char *s);
+
+/* Return the table's copy of s without counting a user, or NULL if no
+ * one is using s.
+ */
+const char *intern_find(StringTable *table, const char *s);
+
+/* Return name_hash of s, an interned string, without computing it.
+ */
+unsigned int intern_hash(const char *s);
+
+/* Drop one user of s, an interned string, freeing it if that was the
+ * last one.
+ */
+void intern_release(StringTable *table, const char *s);
+
+#endif
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include "intern.h"
+#include "lists.h"
+#include "check.h"
+
+static void test_refcount() {
+    StringTable table = {0};
+    char name[] = "alice";
+    const char *a = intern(&table, name);
+    CHECK(a != name && strcmp(a, "alice") == 0);
+    CHECK(intern(&table, "alice") == a);
+    CHECK(intern_hash(a) == name_hash("alice"));
+    const char *b = intern(&table, "bob");
+    CHECK(b != a);
+    CHECK(table.strings == 2 && table.bytes > 0);
+
+    // the copy stays until its last user lets go
+    intern_release(&table, a);
+    CHECK(intern_find(&table, "alice") == a);
+    CHECK(table.strings == 2);
+    intern_release(&table, a);
+    CHECK(intern_find(&table, "alice") == NULL);
+    CHECK(table.strings == 1);
+    intern_release(&table, b);
+    CHECK(intern_find(&table, "bob") == NULL);
+    CHECK(table.strings == 0 && table.bytes == 0);
+
+    // and a string that comes back is interned anew
+    a = intern(&table, "alice");
+    CHECK(intern_find(&table, "alice") == a && table.strings == 1);
+    intern_release(&table, a);
+    index_free(&table.index);
+}
+
+static void test_polls() {
+    PollList polls = {0};
+    char *labels[] = {"mon", "tue"};
+    char *more_labels[] = {"tue", "wed"};
+    create_poll("lunch", labels, 2, &polls);
+    create_poll("dinner", more_labels, 2, &polls);
+    Poll *lunch = find_poll("lunch", &polls);
+    Poll *dinner = find_poll("dinner", &polls);
+    // the label both polls have is held once
+    CHECK(lunch->slot_labels[1] == dinner->slot_labels[0]);
+    CHECK(polls.strings.strings == 3);
+
+    // so is a name voting in both
+    CHECK(add_participant("alice", "lunch", &polls, "10") == 0);
+    CHECK(add_participant("alice", "dinner", &polls, "01") == 0);
+    CHECK(find_part("alice", lunch)->name == find_part("alice", dinner)->name);
+    CHECK(polls.strings.strings == 4);
+
+    // each poll deleted drops its users of the strings
+    CHECK(delete_poll("lunch", &polls) == 0);
+    CHECK(intern_find(&polls.strings, "alice") != NULL);
+    CHECK(intern_find(&polls.strings, "tue") != NULL);
+    CHECK(intern_find(&polls.strings, "mon") == NULL);
+    CHECK(polls.strings.strings == 3);
+    CHECK(delete_poll("dinner", &polls) == 0);
+    CHECK(intern_find(&polls.strings, "alice") == NULL);
+    CHECK(intern_find(&polls.strings, "tue") == NULL);
+    CHECK(polls.strings.strings == 0 && polls.strings.bytes == 0);
+}
+
+int main() {
+    test_refcount();
+    test_polls();
+    return check_result("intern_test");
+}
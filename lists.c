@@ -2,8 +2,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include "tally.h"
 int asprintf(char **strp, const char *fmt, ...);
-void free_memory(Poll *poll);
+void free_memory(Poll *poll, PollList *polls);
+
+// numbers polls in creation order; shared by every PollList so polls kept
+// in separate lists can still be listed in the order they were made
+static atomic_ulong next_poll_seq = 1;
+static void grow_columns(Poll *poll, int words);
+static void set_availability(Poll *poll, Participant *part, char *avail);
+static void unlink_same_name(Participant *part, PollList *polls);
 
 /* a wrapper function for malloc so we don't have to do this each time. */
 void *Malloc(int size) {
@@ -16,167 +25,341 @@ void *Malloc(int size) {
 }
 
 /* Create a poll with this name and num_slots. 
- * Insert it into the list of polls whose head is pointed to by *head_ptr_add
+ * Append it to polls.
  * Return 0 if successful, 1 if a poll by this name already exists in this list.
  */
 int create_poll(char *name, char **slot_labels, int num_slots, 
-                Poll **head_ptr_add) {
+                PollList *polls) {
+    return create_poll_at(name, slot_labels, num_slots, new_poll_seq(), polls);
+}
+
+unsigned long new_poll_seq() {
+    return atomic_fetch_add(&next_poll_seq, 1);
+}
+
+/* As create_poll, but placed in polls by seq. Polls asked for in order
+ * can arrive here out of order when they came from different threads, so
+ * walk back from the tail to the poll's place; it is rarely far.
+ */
+int create_poll_at(char *name, char **slot_labels, int num_slots,
+                   unsigned long seq, PollList *polls) {
 
     // can't have duplicate named polls so first check if this poll exists
-    if (find_poll(name, *head_ptr_add) != NULL) {
+    if (find_poll(name, polls) != NULL) {
         return 1;
     }
-    Poll *new_poll = Malloc(sizeof(struct poll));
+    Poll *new_poll = slab_alloc(&polls->poll_slab, sizeof(struct poll));
     new_poll->num_slots = num_slots;
 
     // copy name in and ensure it is a string
     strncpy(new_poll->name, name, 31);
     new_poll->name[31] = '\0';
+    new_poll->hash = name_hash(new_poll->name);
+    new_poll->seq = seq;
     new_poll->participants = NULL; //CHANGE??
-    // create the array of slot_labels and malloc space for each label
-    new_poll->slot_labels = Malloc(sizeof(char *) * num_slots);
+    new_poll->num_participants = 0;
+    new_poll->subscribers = NULL;
+    new_poll->notify_pending = 0;
+    new_poll->next_pending = NULL;
+    new_poll->version = 0;
+    new_poll->watch = NULL;
+    new_poll->columns = NULL;
+    new_poll->col_words = 0;
+    memset(&new_poll->part_index, 0, sizeof(NameIndex));
+    // everything else the poll owns comes from its arena
+    memset(&new_poll->arena, 0, sizeof(Arena));
+    new_poll->slot_counts = arena_calloc(&new_poll->arena,
+                                         sizeof(int) * num_slots);
+    new_poll->slot_labels = arena_alloc(&new_poll->arena,
+                                        sizeof(char *) * num_slots);
+    new_poll->strings = &polls->strings;
     int i;
     for (i=0; i < num_slots; i++) {
-        new_poll->slot_labels[i] = Malloc(strlen(slot_labels[i])+1);
-        strcpy(new_poll->slot_labels[i], slot_labels[i]);
+        new_poll->slot_labels[i] = intern(&polls->strings, slot_labels[i]);
     }
 
-    // put new poll at tail of list so its next is NULL explicitly
-    new_poll->next = NULL;
-    // if this is first item to add it goes at front
-    if (*head_ptr_add == NULL) {
-        *head_ptr_add = new_poll;
+    // link it in after the last older poll so list_polls keeps creation order
+    Poll *before = polls->tail;
+    while (before != NULL && before->seq > seq) {
+        before = before->prev;
+    }
+    new_poll->prev = before;
+    new_poll->next = before == NULL ? polls->head : before->next;
+    if (before == NULL) {
+        polls->head = new_poll;
     } else {
-        // traverse the list to find the tail and add our new node
-        Poll *prev = *head_ptr_add;
-        while (prev->next != NULL) {
-            prev = prev->next;
-        }
-        prev->next = new_poll;
+        before->next = new_poll;
+    }
+    if (new_poll->next == NULL) {
+        polls->tail = new_poll;
+    } else {
+        new_poll->next->prev = new_poll;
     }
+    polls->count++;
+    index_insert(&polls->index, new_poll->name, new_poll->hash, new_poll);
+    order_insert(&polls->order, new_poll->name, new_poll);
     return 0;
 }
 
 
-/* Return a pointer to the poll with this name in this list starting with head.
+/* Return a pointer to the poll with this name in polls.
   Return NULL if there is no such poll.
  */
-Poll *find_poll(char *name, Poll *head) {
-    while (head != NULL) {
-        if (!strcmp(head->name, name)) {
-            return head;
-        }
-        head = head->next;
-    }
-    // if we get this far then we didn't find a poll with this name
-    return NULL;
+Poll *find_poll(char *name, PollList *polls) {
+    return index_find(&polls->index, name, name_hash(name));
 }
 
 
 
-/* delete the poll by the name poll_name from the list at *head_ptr_add.
-   Update the head of the list as appropriate and free all dynamically 
-   allocated memory no longer used 
+/* delete the poll by the name poll_name from polls and free all
+   dynamically allocated memory no longer used 
    Return 0 if successful and 1 if poll by this name is not found in list. 
 */
-int delete_poll(char *poll_name, Poll **head_ptr_add) {
+int delete_poll(char *poll_name, PollList *polls) {
 
     Poll *poll_to_delete; 
-    if ((poll_to_delete = find_poll(poll_name, *head_ptr_add)) == NULL) {
+    if ((poll_to_delete = find_poll(poll_name, polls)) == NULL) {
         return 1;
     }
-    // need to find pointer to previous poll or to know if first
-    Poll *prev = *head_ptr_add;
-    // head must point to at least one poll or this function would have
-    // already returned after unsuccessfully finding the poll
-    if (!strcmp(prev->name, poll_name)) {
-        // poll to delete is at the head of the list so go around it
-        *head_ptr_add = prev->next;
+    index_remove(&polls->index, poll_to_delete->name, poll_to_delete->hash,
+                 poll_to_delete);
+    order_remove(&polls->order, poll_to_delete->name);
+    // unlink it from the creation-order list
+    if (poll_to_delete->prev == NULL) {
+        polls->head = poll_to_delete->next;
     } else {
-        while (prev->next != NULL) {
-            if (!strcmp(prev->next->name, poll_name)) {
-                break;
-            }
-            prev = prev->next;
-        }
+        poll_to_delete->prev->next = poll_to_delete->next;
+    }
+    if (poll_to_delete->next == NULL) {
+        polls->tail = poll_to_delete->prev;
+    } else {
+        poll_to_delete->next->prev = poll_to_delete->prev;
+    }
+    polls->count--;
+    Participant *part;
+    for (part = poll_to_delete->participants; part != NULL; part = part->next) {
+        unlink_same_name(part, polls);
     }
-    // now we have a pointer to poll_to_delete and to prev
-    prev->next = poll_to_delete->next;
     // free the memory in poll_to_delete
-    free_memory(poll_to_delete);
+    free_memory(poll_to_delete, polls);
     return 0;
 }
 
-/* do all the freeing for a single poll */
-void free_memory(Poll *poll) {
-    // clean up participants
-    Participant *cur = poll->participants;
-    Participant *next;
-    while (cur != NULL) {
-        if (cur->comment != NULL) {
-            free(cur->comment);
-        }
-        if (cur->availability != NULL) {
-            free(cur->availability);
+/* Take part out of the chain of participants sharing its name, moving the
+ * users index entry along if part was the one indexed.
+ */
+static void unlink_same_name(Participant *part, PollList *polls) {
+    if (part->prev_same_name != NULL) {
+        part->prev_same_name->next_same_name = part->next_same_name;
+    } else {
+        index_remove(&polls->users, part->name, part->hash, part);
+        if (part->next_same_name != NULL) {
+            index_insert(&polls->users, part->next_same_name->name,
+                         part->hash, part->next_same_name);
         }
-        next = cur->next;
-        free(cur);
-        cur = next;
     }
+    if (part->next_same_name != NULL) {
+        part->next_same_name->prev_same_name = part->prev_same_name;
+    }
+}
 
-    // clean up slot labels
+/* do all the freeing for a single poll: its participants, comments,
+ * labels and columns all go with its arena, and the record itself back to
+ * the slab of the list it was in. The interned strings lose a user each.
+ */
+void free_memory(Poll *poll, PollList *polls) {
+    Participant *part;
     int i;
-    for (i=0; i < poll->num_slots; i++) {
-        free(poll->slot_labels[i]);
+    for (part = poll->participants; part != NULL; part = part->next) {
+        intern_release(&polls->strings, part->name);
     }
-    free(poll->slot_labels);
-    free(poll);
+    for (i = 0; i < poll->num_slots; i++) {
+        intern_release(&polls->strings, poll->slot_labels[i]);
+    }
+    index_free(&poll->part_index);
+    arena_release(&poll->arena);
+    slab_free(&polls->poll_slab, poll);
 }
     
+/* Make the poll's columns words long, room for 64 rows a word. */
+static void grow_columns(Poll *poll, int words) {
+    size_t bytes = sizeof(uint64_t) * words * poll->num_slots;
+    uint64_t *columns = arena_alloc_piece(&poll->arena, bytes);
+    memset(columns, 0, bytes);
+    int i;
+    for (i = 0; i < poll->num_slots; i++) {
+        memcpy(columns + (size_t)i * words,
+               poll->columns + (size_t)i * poll->col_words,
+               sizeof(uint64_t) * poll->col_words);
+    }
+    if (poll->columns != NULL) {
+        arena_free_piece(&poll->arena, poll->columns,
+                   sizeof(uint64_t) * poll->col_words * poll->num_slots);
+    }
+    poll->columns = columns;
+    poll->col_words = words;
+}
+
+/* Mark part as available or not for slot i, in both its own bits and its
+ * row of the poll's columns, and apply any change to the slot count.
+ */
+static void set_slot(Poll *poll, Participant *part, int i, int available) {
+    uint64_t row_bit = (uint64_t)1 << (part->row % 64);
+    uint64_t *col = poll->columns + (size_t)i * poll->col_words + part->row / 64;
+    uint64_t slot_bit = (uint64_t)1 << (i % 64);
+    int was_set = (part->availability[i / 64] & slot_bit) != 0;
+    if (available) {
+        part->availability[i / 64] |= slot_bit;
+        *col |= row_bit;
+        poll->slot_counts[i] += !was_set;
+    } else {
+        part->availability[i / 64] &= ~slot_bit;
+        *col &= ~row_bit;
+        poll->slot_counts[i] -= was_set;
+    }
+}
+
+/* Return 0 if avail is an availability string for poll, 3 if it is the
+ * wrong length, or 4 if it holds anything but '0' and '1'.
+ */
+static int check_availability(Poll *poll, char *avail) {
+    if (strlen(avail) != poll->num_slots) {
+        return 3;
+    }
+    if (strspn(avail, "01") != poll->num_slots) {
+        return 4;
+    }
+    return 0;
+}
+
+/* Store the availability string avail for part. It has already been
+ * checked by check_availability. A new participant starts with no bits
+ * set so everything it marks counts as a change.
+ */
+static void set_availability(Poll *poll, Participant *part, char *avail) {
+    int i;
+    for (i = 0; i < poll->num_slots; i++) {
+        set_slot(poll, part, i, avail[i] == '1');
+    }
+}
+
+/* Make a participant called part_name in poll with no availability yet,
+ * and link it into the poll and the per-name chains.
+ */
+static Participant *new_participant(Poll *poll, PollList *polls,
+                                    char *part_name) {
+    // create the participant to add, with its availability bits at the end
+    Participant *new_part = arena_alloc(&poll->arena,
+            sizeof(struct participant) +
+            sizeof(uint64_t) * AVAIL_WORDS(poll->num_slots));
+    // names are cut to fit MAX_NAME, then shared with the other polls
+    char name[MAX_NAME];
+    strncpy(name, part_name, MAX_NAME - 1);
+    name[MAX_NAME - 1] = '\0';
+    new_part->name = intern(&polls->strings, name);
+    new_part->hash = intern_hash(new_part->name);
+
+    // set comment to NULL so we we can know if we need to free 
+    // allocated memory when we delete the participant
+    new_part->comment = NULL;
+
+    // give it the next row in the poll's columns
+    new_part->row = poll->num_participants;
+    if (new_part->row == poll->col_words * 64) {
+        grow_columns(poll, poll->col_words ? poll->col_words * 2 : 1);
+    }
+    memset(new_part->availability, 0,
+           sizeof(uint64_t) * AVAIL_WORDS(poll->num_slots));
+
+    // insert this participant at the head of the participant list for this poll
+    new_part->next = poll->participants;
+    poll->participants = new_part;
+    poll->num_participants++;
+    new_part->poll = poll;
+
+    // chain it to the other records with this name, just behind the one
+    // in the users index so that entry does not have to change
+    Participant *same = index_find(&polls->users, new_part->name,
+                                   new_part->hash);
+    new_part->prev_same_name = same;
+    if (same == NULL) {
+        new_part->next_same_name = NULL;
+        index_insert(&polls->users, new_part->name, new_part->hash, new_part);
+    } else {
+        new_part->next_same_name = same->next_same_name;
+        if (same->next_same_name != NULL) {
+            same->next_same_name->prev_same_name = new_part;
+        }
+        same->next_same_name = new_part;
+    }
+
+    // index the participants once the poll is big enough for the list
+    // walk to hurt, and keep the index up to date after that
+    if (poll->num_participants == PART_INDEX_THRESHOLD) {
+        Participant *cur;
+        for (cur = poll->participants; cur != NULL; cur = cur->next) {
+            index_insert(&poll->part_index, cur->name, cur->hash, cur);
+        }
+    } else if (poll->num_participants > PART_INDEX_THRESHOLD) {
+        index_insert(&poll->part_index, new_part->name, new_part->hash,
+                     new_part);
+    }
+    return new_part;
+}
+
 /* Add a participant with this part_name to the participant list for the poll
-   with this poll_name in the list at head_pt. Duplicate participant names
+   with this poll_name in polls. Duplicate participant names
    are not allowed. Set the availability of this participant to avail.
    Return: 0 on success 
       1 for poll does not exist with this name
       2 for participant by this name already in this poll
       3 for availibility string is wrong length. Particpant not added.
+      4 for availability string holding anything but 0s and 1s.
 */
-int add_participant(char *part_name, char *poll_name, Poll *head_ptr, 
+int add_participant(char *part_name, char *poll_name, PollList *polls, 
                     char *avail) {
     Poll *poll;
-    if ((poll = find_poll(poll_name, head_ptr)) == NULL) {
+    if ((poll = find_poll(poll_name, polls)) == NULL) {
         return 1;
     }
     Participant *part;
     if ((part = find_part(part_name, poll)) != NULL) {
         return 2;
     }
-    if (strlen(avail) != poll->num_slots) {
-        return 3;
+    int result = check_availability(poll, avail);
+    if (result != 0) {
+        return result;
     }
 
-
-    // create the participant to add
-    Participant *new_part = Malloc(sizeof(struct participant));
-    // copy name in and ensure it is a string
-    strncpy(new_part->name, part_name, 31);
-    new_part->name[31] = '\0';
-
-    // set comment to NULL so we we can know if we need to free 
-    // allocated memory when we delete the participant
-    new_part->comment = NULL;
-
-    // set availability for this new participant
-    new_part->availability = Malloc(poll->num_slots + 1);
-    // strcpy is safe because we checked the lengths
-    strcpy(new_part->availability, avail);
-
-    // insert this participant at the head of the participant list for this poll
-    new_part->next = poll->participants;
-    poll->participants = new_part;
+    set_availability(poll, new_participant(poll, polls, part_name), avail);
     return 0;
 }
 
+/* Add a participant called part_name to poll with the availability bits
+ * avail, as saved from another participant, and comment if it is not
+ * NULL. The poll must not already have a participant by that name. The
+ * bits go straight into the columns, leaving the counts to tally_poll.
+ */
+Participant *restore_participant(Poll *poll, PollList *polls, char *part_name,
+                                 const uint64_t *avail, char *comment) {
+    Participant *part = new_participant(poll, polls, part_name);
+    uint64_t row_bit = (uint64_t)1 << (part->row % 64);
+    uint64_t *col = poll->columns + part->row / 64;
+    int i;
+    for (i = 0; i < poll->num_slots; i++, col += poll->col_words) {
+        uint64_t slot_bit = (uint64_t)1 << (i % 64);
+        if (avail[i / 64] & slot_bit) {
+            part->availability[i / 64] |= slot_bit;
+            *col |= row_bit;
+        }
+    }
+    if (comment != NULL) {
+        part->comment = arena_alloc_piece(&poll->arena, strlen(comment) + 1);
+        strcpy(part->comment, comment);
+    }
+    return part;
+}
+
 /* Add a comment from the participant with this part_name to the poll with
    this poll_name. Return values:
       0 success
@@ -184,23 +367,27 @@ int add_participant(char *part_name, char *poll_name, Poll *head_ptr,
       2 no participant by this name for this poll
  */
 int add_comment(char *part_name, char *poll_name, char *comment, 
-                Poll *head_ptr) {
+                PollList *polls) {
     Poll *poll;
-    if ((poll = find_poll(poll_name, head_ptr)) == NULL) {
+    if ((poll = find_poll(poll_name, polls)) == NULL) {
         return 1;
     }
     Participant *part;
     if ((part = find_part(part_name, poll)) == NULL) {
         return 2;
     }
-    // set or replace comment
-    // if comment was previously set, then space needs to be freed
+    set_comment(poll, part, comment);
+    return 0;
+}
+
+void set_comment(Poll *poll, Participant *part, char *comment) {
+    // if comment was previously set, its space can be reused
     if (part->comment != NULL) {
-        free(part->comment);
+        arena_free_piece(&poll->arena, part->comment,
+                         strlen(part->comment) + 1);
     }
-    part->comment = Malloc(strlen(comment) + 1);
+    part->comment = arena_alloc_piece(&poll->arena, strlen(comment) + 1);
     strcpy(part->comment, comment);
-    return 0;
 }
 
 /* Add availabilty for the participant with this part_name to the poll with
@@ -209,33 +396,79 @@ int add_comment(char *part_name, char *poll_name, char *comment,
  *    1 no poll by this name
  *    2 no participant by this name for this poll
  *    3 avail string is incorrect size for this poll 
+ *    4 avail string holds something other than 0 and 1
  */
 int update_availability(char *part_name, char *poll_name, char *avail, 
-          Poll *head_ptr) {
+          PollList *polls) {
     Poll *poll;
-    if ((poll = find_poll(poll_name, head_ptr)) == NULL) {
+    if ((poll = find_poll(poll_name, polls)) == NULL) {
         return 1;
     }
     Participant *part;
     if ((part = find_part(part_name, poll)) == NULL) {
         return 2;
     }
-    if (strlen(avail) != poll->num_slots) {
-        return 3;
+    int result = check_availability(poll, avail);
+    if (result != 0) {
+        return result;
     }
-    /* strcpy is safe because we allocated the right amount earlier */
-    strcpy(part->availability, avail);
+    set_availability(poll, part, avail);
     return 0;
 }
 
+Participant *set_vote(Poll *poll, PollList *polls, char *part_name,
+                      char *avail, int *added) {
+    if (part_name[0] == '\0' || check_availability(poll, avail) != 0) {
+        return NULL;
+    }
+    if (strlen(part_name) >= MAX_NAME) {
+        part_name[MAX_NAME - 1] = '\0';
+    }
+    Participant *part = find_part(part_name, poll);
+    *added = part == NULL;
+    if (part == NULL) {
+        part = new_participant(poll, polls, part_name);
+    }
+    set_availability(poll, part, avail);
+    return part;
+}
+
+void reserve_participants(Poll *poll, PollList *polls, int count) {
+    int rows = poll->num_participants + count;
+    int words = poll->col_words ? poll->col_words : 1;
+    while (words * 64 < rows) {
+        words *= 2;
+    }
+    if (words > poll->col_words) {
+        grow_columns(poll, words);
+    }
+    // the poll's index holds every participant once it has any
+    if (rows >= PART_INDEX_THRESHOLD) {
+        index_reserve(&poll->part_index,
+                      poll->num_participants >= PART_INDEX_THRESHOLD ?
+                      count : rows);
+    }
+    index_reserve(&polls->users, count);
+}
+
 
 /* Return pointer to participant with this name from this poll or
    NULL if no such participant exists.
  */
 Participant *find_part(char *name, Poll *poll) {
+    // participant names are interned, so one lookup gives the only
+    // pointer a match can have, and no poll in the list has a name the
+    // table does not
+    const char *key = intern_find(poll->strings, name);
+    if (key == NULL) {
+        return NULL;
+    }
+    if (poll->num_participants >= PART_INDEX_THRESHOLD) {
+        return index_find(&poll->part_index, key, intern_hash(key));
+    }
     Participant *current = poll->participants;
     while (current != NULL) {
-        if (!strcmp(current->name, name)) {
+        if (current->name == key) {
             return current;
         }
         current = current->next;
@@ -244,97 +477,131 @@ Participant *find_part(char *name, Poll *poll) {
     return NULL;
 }
     
+/* Return a participant record with this name from some poll, or NULL.
+ * The others are chained through next_same_name.
+ */
+Participant *find_user_parts(char *name, PollList *polls) {
+    return index_find(&polls->users, name, name_hash(name));
+}
+
+/* Count the available participants for every slot, one popcount pass
+ * over each column.
+ */
+void tally_poll(Poll *poll, int *counts) {
+    int i;
+    for (i = 0; i < poll->num_slots; i++) {
+        counts[i] = popcount_words(poll->columns + (size_t)i * poll->col_words,
+                                   poll->col_words);
+    }
+}
+
+/* Append the per-slot counts for the poll by the name poll_name and the
+ * best slot to out. Return 1 if there is no such poll.
+ */
+int print_results(char *poll_name, PollList *polls, Buffer *out) {
+    Poll *poll;
+    if ((poll = find_poll(poll_name, polls)) == NULL) {
+        return 1;
+    }
+
+    int best = -1;
+    int i;
+    buf_printf(out, "%s\n", poll->name);
+    for (i = 0; i < poll->num_slots; i++) {
+        buf_printf(out, "  %s: %d\r\n", poll->slot_labels[i],
+                   poll->slot_counts[i]);
+        if (best == -1 || poll->slot_counts[i] > poll->slot_counts[best]) {
+            best = i;
+        }
+    }
+    if (best == -1 || poll->slot_counts[best] == 0) {
+        buf_puts(out, "Best time: none\n");
+    } else {
+        buf_printf(out, "Best time: %s (%d available)\n",
+                   poll->slot_labels[best], poll->slot_counts[best]);
+    }
+    return 0;
+}
+
 /* 
- *  return dynamically allocated string of poll names one per line 
+ *  append poll names one per line to out
  */
-char* print_polls(Poll *head) {
-    Poll *current = head;
-    int bytes = 0;
-    char *poll_list;
-    while (current != NULL){
-        //add 1 for newline char;
-        bytes += strlen(current -> name) + 2;
-        current = current -> next;
-    }
-    current = head;
-    poll_list = malloc(bytes + 1);
-    poll_list[0] = '\0';
-    while (current != NULL) {
-        strcat(poll_list, current ->name);
-        strcat(poll_list, "\n");
-        current = current->next;
+void print_polls(PollList *polls, Buffer *out) {
+    Poll *current;
+    for (current = polls->head; current != NULL; current = current->next) {
+        buf_puts(out, current->name);
+        buf_append(out, "\n", 1);
     }
+}
 
-    return poll_list;
+/* Seek to the later of the cursor and the first name with the prefix,
+ * then walk until the names stop matching or the page is full.
+ */
+int page_polls(PollList *polls, char *prefix, char *after, int limit,
+               Poll **page) {
+    OrderNode *node;
+    size_t prefix_len = strlen(prefix);
+    int n = 0;
+    if (strcmp(after, prefix) >= 0) {
+        node = order_after(&polls->order, after);
+    } else {
+        node = order_from(&polls->order, prefix);
+    }
+    while (node != NULL && n < limit &&
+           strncmp(node->key, prefix, prefix_len) == 0) {
+        page[n++] = node->item;
+        node = node->next[0];
+    }
+    return n;
 }
 
 
-/* For the poll by the name poll_name from the list at head_ptr,
+/* For the poll by the name poll_name in polls,
  * print the name, number of slots and each label and each participant.
  * For each participant, print name and availability.
  * Return 0 if successful and 1 if poll by this name is not found in list. 
  */
-char* print_poll_info(char *poll_name, Poll *head_ptr) {
+int print_poll_info(char *poll_name, PollList *polls, Buffer *out) {
 
     Poll *poll; 
-    int bytes = 0;
-    char* poll_info;
-    if ((poll = find_poll(poll_name, head_ptr)) == NULL) {
-        return NULL;
-    }
-    
-    bytes += strlen(poll_name) + 1;
-    int i;
-    for(i = 0; i < poll->num_slots; i ++){
-        bytes += strlen(poll->slot_labels[i]) + 1;
-        bytes += strlen("  Meeting time:\r\n");
-
-    }
-
-    Participant *curr = poll->participants;
-    while(curr != NULL){
-        bytes += strlen(curr->name);
-        bytes += poll->num_slots;
-        bytes += 2; //2 bytes for 3 spaces between name and availability 
-        bytes += 1; //1 byte for semicolin after name
-        bytes += 1; //1 byte for newline char
-        if (curr->comment != NULL) {
-            bytes += strlen("Comment: ");
-            bytes += strlen(curr->comment);
-            bytes += 1;
-        }
-
-        curr = curr -> next;
+    if ((poll = find_poll(poll_name, polls)) == NULL) {
+        return 1;
     }
 
-
-    poll_info = Malloc(bytes + 2);
-    poll_info[0] = '\0';
     // add the slot labels each on a separate line
     int label;
-    strcat(poll_info, poll_name);
-    strcat(poll_info, "\n");
+    buf_puts(out, poll_name);
+    buf_append(out, "\n", 1);
     for (label=0; label < poll->num_slots; label++) {
-        strcat(poll_info, "  Meeting time:");
-        strcat(poll_info, poll->slot_labels[label]);
-        strcat(poll_info, "\r\n");
+        buf_puts(out, "  Meeting time:");
+        buf_puts(out, poll->slot_labels[label]);
+        buf_append(out, "\r\n", 2);
     }
 
     // then each participant
-    Participant *current = poll->participants;
-    while (current != NULL) {
-        strcat(poll_info, current->name);
-        strcat(poll_info,":  ");
-        strcat(poll_info, current->availability);
-        strcat(poll_info, "\n");
-        if (current->comment != NULL) {
-            strcat(poll_info, "Comment: ");
-            strcat(poll_info, current->comment);
-            strcat(poll_info, "\n");
-        }
-        current = current->next;
+    Participant *current;
+    for (current = poll->participants; current != NULL; current = current->next) {
+        print_participant(poll, current, out);
     }
-    return poll_info;
+    return 0;
 }
 
-
+void print_participant(Poll *poll, Participant *part, Buffer *out) {
+    char avail[64];
+    int i;
+    buf_puts(out, part->name);
+    buf_append(out, ":  ", 3);
+    // a chunk of the bits at a time, so no slot count is too long
+    for (i = 0; i < poll->num_slots; i++) {
+        avail[i % 64] = (part->availability[i / 64] >> (i % 64)) & 1 ? '1' : '0';
+        if (i % 64 == 63 || i == poll->num_slots - 1) {
+            buf_append(out, avail, i % 64 + 1);
+        }
+    }
+    buf_append(out, "\n", 1);
+    if (part->comment != NULL) {
+        buf_puts(out, "Comment: ");
+        buf_puts(out, part->comment);
+        buf_append(out, "\n", 1);
+    }
+}
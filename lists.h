@@ -1,49 +1,141 @@
+#ifndef LISTS_H
+#define LISTS_H
+
+#include <stdint.h>
+#include "hash_index.h"
+#include "intern.h"
+#include "name_order.h"
+#include "buffer.h"
+#include "arena.h"
+#include "slab.h"
+
 #define MAX_NAME 32
+// polls with at least this many participants look them up through a hash
+// index instead of walking the list
+#define PART_INDEX_THRESHOLD 16
+
+// 64-bit words needed to hold one bit per slot
+#define AVAIL_WORDS(num_slots) (((num_slots) + 63) / 64)
+
+struct subscription;   // defined by the server, see poll_server.c
+struct watch;          // likewise
+
 typedef struct participant {
-   char name[MAX_NAME];
+   const char *name;    // interned in the strings of the poll's list
+   unsigned int hash;   // name_hash(name), cached for the participant index
    char *comment;
-   char *availability;
+   int row;   // this participant's bit position in its poll's columns
    struct participant *next;
+   struct poll *poll;   // the poll this participant voted in
+   // every participant record with this name, across all polls
+   struct participant *next_same_name;
+   struct participant *prev_same_name;
+   // bit i is set if available for slot i; AVAIL_WORDS(num_slots) long
+   uint64_t availability[];
 } Participant; 
 
 typedef struct poll {
    char name[MAX_NAME];
+   unsigned int hash;   // name_hash(name), cached for the poll index
+   unsigned long seq;   // creation order across every PollList
    int num_slots;
-   char **slot_labels;
+   const char **slot_labels;   // interned, like the participants' names
+   StringTable *strings;       // the table they are interned in
    struct poll *next;
-   Participant *participants;
+   struct poll *prev;
+   Participant *participants;   // newest first
+   int num_participants;
+   NameIndex part_index;   // only built once PART_INDEX_THRESHOLD is reached
+   // availability by slot: column i is col_words words holding one bit per
+   // participant row, set if that participant is available for slot i
+   uint64_t *columns;
+   int col_words;
+   int *slot_counts;   // participants available for each slot, kept current
+   // holds the labels, participants, comments, columns and counts above
+   Arena arena;
+
+   struct subscription *subscribers;   // connected clients, owned by the server
+   // also the server's: what the poll waits to tell its subscribers and
+   // watchers about, and the next poll waiting on the same shard
+   int notify_pending;
+   struct poll *next_pending;
+   unsigned long version;   // the server's count of changes to the poll
+   struct watch *watch;     // the server's, while any client watches it
 } Poll;
 
+/* The polls in creation order, plus a hash index over their names so
+ * lookups do not have to walk the list, and the same names in sorted
+ * order for paging through them. The slot labels and participant names
+ * of its polls are interned in strings. A zero-initialized PollList is
+ * an empty list.
+ */
+typedef struct poll_list {
+   Poll *head;
+   Poll *tail;
+   int count;
+   NameIndex index;
+   NameOrder order;
+   NameIndex users;   // participant name -> one of its participant records
+   Slab poll_slab;    // the Poll records of this list
+   StringTable strings;
+} PollList;
+
+/* Availability strings have one character per slot: '1' for available
+ * and '0' for not. Anything else is refused with return code 4. They
+ * are stored as bitsets.
+ */
+
 /* Add a participant with this part_name to the participant list for the poll
- * with this poll_name in the list at head_pt. Duplicate participant names
+ * with this poll_name in polls. Duplicate participant names
  * are not allowed. Set the availability of this participant to avail.
  * Return: 0 on success 
  *         1 for poll does not exist with this name
  *         2 for participant by this name already in this poll
  *         3 for availibility string is wrong length for this poll. 
  *           Particpant is not added. 
+ *         4 for availability string holding anything but 0s and 1s.
+ *           Participant is not added.
+ */
+int add_participant(char *part_name, char *poll_name, PollList *polls, char *avail);
+
+/* Add a participant called part_name to poll with availability bits
+ * avail, laid out as in Participant, and comment unless it is NULL.
+ * For reloading saved polls: nothing is checked, and the poll must not
+ * already have a participant by this name. The slot counts are left as
+ * they were; once every participant is in, tally_poll(poll,
+ * poll->slot_counts) sets them all in one pass.
  */
-int add_participant(char *part_name, char *poll_name, Poll *head_pt, char *avail);
+Participant *restore_participant(Poll *poll, PollList *polls, char *part_name,
+                                 const uint64_t *avail, char *comment);
 
 
 /* Create a poll with this name and num_slots and set the slot labels.
- * Insert it into the list of polls whose head is pointed to by *head_ptr_add
+ * Append it to polls.
  * Return 0 if successful 
  * Return 1 if a poll by this name already exists in this list.
  */
-int create_poll(char *name, char **slot_labels, int num_slots, Poll **head_ptr_add);
+int create_poll(char *name, char **slot_labels, int num_slots, PollList *polls);
+
+/* Like create_poll, but the poll takes its place in creation order from
+ * seq, a number from new_poll_seq taken when the poll was asked for.
+ */
+int create_poll_at(char *name, char **slot_labels, int num_slots,
+                   unsigned long seq, PollList *polls);
 
-/* Return a pointer to the poll with this name in
- * this list starting with head. Return NULL if no such poll exists.
+/* Return the next number in creation order. Safe from any thread.
  */
-Poll *find_poll(char *name, Poll *head); 
+unsigned long new_poll_seq();
 
-/* Delete the poll by the name poll_name from the list at *head_ptr_add.
- * Update the head of the list as appropriate and free all dynamically 
- * allocated memory no longer used.
+/* Return a pointer to the poll with this name in polls.
+ * Return NULL if no such poll exists.
+ */
+Poll *find_poll(char *name, PollList *polls); 
+
+/* Delete the poll by the name poll_name from polls and free all
+ * dynamically allocated memory no longer used.
  * Return 0 if successful and 1 if poll by this name is not found in list. 
  */
-int delete_poll(char *poll_name, Poll **head_ptr_add);
+int delete_poll(char *poll_name, PollList *polls);
 
 /* helper for delete_poll */
 //void free_memory(Poll *poll);
@@ -53,6 +145,13 @@ int delete_poll(char *poll_name, Poll **head_ptr_add);
  */
 Participant *find_part(char *name, Poll *poll); 
 
+/* Return a participant record with this name from some poll in polls, or
+ * NULL if this name has not voted in any poll. The rest of this name's
+ * records are reached through next_same_name, and each one's poll field
+ * says which poll it belongs to.
+ */
+Participant *find_user_parts(char *name, PollList *polls);
+
 
 /* Add a comment from the participant with this part_name to the poll with
  * this poll_name. Replace existing comment if one exists. 
@@ -61,8 +160,29 @@ Participant *find_part(char *name, Poll *poll);
  *    1 no poll by this name
  *    2 no participant by this name for this poll
  */
-int add_comment(char *part_name, char *poll_name, char *comment, Poll *head_pt);
+int add_comment(char *part_name, char *poll_name, char *comment, PollList *polls);
+
+
+/* Replace the comment of part, a participant in poll, with comment.
+ */
+void set_comment(Poll *poll, Participant *part, char *comment);
+
+/* Set the availability of the participant called part_name in poll,
+ * adding one with that name if there is none, and set *added if it is
+ * new. For callers that have already found the poll. A name MAX_NAME
+ * long or more is cut short in place, as names always are, so the caller
+ * sees the name that was used. Return the participant, or NULL with
+ * nothing changed if the name is empty or avail is the wrong length for
+ * this poll or holds anything but 0s and 1s.
+ */
+Participant *set_vote(Poll *poll, PollList *polls, char *part_name,
+                      char *avail, int *added);
 
+/* Make room in poll for count more participants at once: the columns
+ * and name indexes grow here rather than a step at a time as a batch of
+ * new participants comes in.
+ */
+void reserve_participants(Poll *poll, PollList *polls, int count);
 
 /* Add availabilty for the participant with this part_name to the poll with
  * this poll_name. Return values:
@@ -70,22 +190,50 @@ int add_comment(char *part_name, char *poll_name, char *comment, Poll *head_pt);
  *    1 no poll by this name
  *    2 no participant by this name for this poll
  *    3 avail string is incorrect size for this poll 
+ *    4 avail string holds something other than 0 and 1
  */
 int update_availability(char *part_name, char *poll_name, char *avail, 
-                     Poll *head_pt);
+                     PollList *polls);
 
 
 
+/* Set counts[i] to the number of participants available for slot i of
+ * this poll, for every slot. counts must have room for num_slots ints.
+ */
+void tally_poll(Poll *poll, int *counts);
+
+/* For the poll by the name poll_name in polls, append the number of
+ * participants available for each slot and the slot with the most to out.
+ * Takes time proportional to the number of slots, not participants.
+ * Return 0 if successful and 1 if poll by this name is not found in list. 
+ */
+int print_results(char *poll_name, PollList *polls, Buffer *out);
+
+/* Append part's line of poll_info to out: its name and availability,
+ * then its comment on a line of its own if it has one.
+ */
+void print_participant(Poll *poll, Participant *part, Buffer *out);
+
 /* 
- *  Print the names of the current polls one per line.
+ *  Append the names of the current polls to out one per line.
+ */
+void print_polls(PollList *polls, Buffer *out);
+
+/* Fill page with up to limit polls from polls in name order: those whose
+ * names start with prefix and sort after after, or from the first such
+ * poll if after is "". Takes time proportional to log of the number of
+ * polls plus the page. Return the number of polls put in page.
  */
-char* print_polls(Poll *head);
+int page_polls(PollList *polls, char *prefix, char *after, int limit,
+               Poll **page);
 
 
-/* For the poll by the name poll_name from the list at head_ptr,
+/* For the poll by the name poll_name in polls,
  * print the name each label and each participant.
- * For each participant, print name and availability.
+ * For each participant, print name and availability. The output is
+ * appended to out.
  * Return 0 if successful and 1 if poll by this name is not found in list. 
  */
-char* print_poll_info(char *poll_name, Poll *head);
+int print_poll_info(char *poll_name, PollList *polls, Buffer *out);
 
+#endif
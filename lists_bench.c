@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "lists.h"
+
+/* Microbenchmarks for the lists.c API. Each point of the sweep, a number
+ * of polls times a number of participants in each, is run in a child
+ * process of its own so its peak RSS is its own. Within a point the
+ * operations run in the order a server would see them: create the polls,
+ * look them up, fill them with participants, change their votes, comment,
+ * print them and delete them.
+ *
+ * Output is one JSON object per line per operation and point:
+ *   {"label":..., "op":..., "polls":P, "parts":N, "slots":S, "ops":count,
+ *    "ns_per_op":..., "allocs_per_op":..., "peak_rss_kb":...}
+ * so runs from two commits can be joined on op, polls and parts.
+ *
+ * Allocations are counted by linking with --wrap for malloc, calloc and
+ * realloc (see makefile.txt), so they cover lists.c and the modules under
+ * it but not the C library's own.
+ */
+
+// points with more participants than this in total are skipped
+#define DEFAULT_MAX_CELLS 1000000
+// repeated operations run at least this many times, for a stable time
+#define MIN_REPEATS 100000
+#define MAX_SWEEP 16
+
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size){
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size){
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size){
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+static char *label = "";
+static int num_slots = 16;
+
+/* A timed run of count operations, from mark to report. */
+static struct timespec started;
+static unsigned long allocs_at_start;
+
+static void mark(){
+    allocs_at_start = allocs;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+static void report(char *op, int polls, int parts, long count){
+    struct timespec now;
+    struct rusage usage;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &usage);
+    double ns = (now.tv_sec - started.tv_sec) * 1e9 + (now.tv_nsec - started.tv_nsec);
+    printf("{\"label\":\"%s\",\"op\":\"%s\",\"polls\":%d,\"parts\":%d,"
+           "\"slots\":%d,\"ops\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f,"
+           "\"peak_rss_kb\":%ld}\n",
+           label, op, polls, parts, num_slots, count, ns / count,
+           (double)(allocs - allocs_at_start) / count, usage.ru_maxrss);
+}
+
+/* Names made up front so building them is not timed. */
+static char **make_names(char *prefix, int n){
+    char **names = malloc(sizeof(char *) * n);
+    char buf[MAX_NAME];
+    int i;
+    if(names == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    for(i = 0; i < n; i++){
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        if((names[i] = strdup(buf)) == NULL){
+            perror("strdup");
+            exit(1);
+        }
+    }
+    return names;
+}
+
+static char *random_avail(){
+    char *avail = malloc(num_slots + 1);
+    int i;
+    if(avail == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    for(i = 0; i < num_slots; i++){
+        avail[i] = random() & 1 ? '1' : '0';
+    }
+    avail[num_slots] = '\0';
+    return avail;
+}
+
+/* How many times to repeat an operation that costs about work units. */
+static long repeats(long work){
+    long n = MIN_REPEATS / (work > 0 ? work : 1);
+    return n > 0 ? n : 1;
+}
+
+static void run_point(int num_polls, int num_parts){
+    PollList polls = {NULL};
+    char **poll_names = make_names("poll", num_polls);
+    char **part_names = make_names("user", num_parts);
+    char **labels = make_names("slot", num_slots);
+    char *avail[2] = {random_avail(), random_avail()};
+    Buffer out = {NULL};
+    long i, n;
+    int p, q;
+
+    mark();
+    for(p = 0; p < num_polls; p++){
+        create_poll(poll_names[p], labels, num_slots, &polls);
+    }
+    report("create_poll", num_polls, num_parts, num_polls);
+
+    n = num_polls > MIN_REPEATS ? num_polls : MIN_REPEATS;
+    mark();
+    for(i = 0; i < n; i++){
+        if(find_poll(poll_names[random() % num_polls], &polls) == NULL){
+            fprintf(stderr, "find_poll lost a poll\n");
+            exit(1);
+        }
+    }
+    report("find_poll", num_polls, num_parts, n);
+
+    mark();
+    for(p = 0; p < num_polls; p++){
+        for(q = 0; q < num_parts; q++){
+            add_participant(part_names[q], poll_names[p], &polls, avail[0]);
+        }
+    }
+    report("add_participant", num_polls, num_parts, (long)num_polls * num_parts);
+
+    // the calls pick their targets at random, so make the picks first
+    n = (long)num_polls * num_parts;
+    if(n < MIN_REPEATS){
+        n = MIN_REPEATS;
+    }
+    int *pick_poll = malloc(sizeof(int) * n);
+    int *pick_part = malloc(sizeof(int) * n);
+    if(pick_poll == NULL || pick_part == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    for(i = 0; i < n; i++){
+        pick_poll[i] = random() % num_polls;
+        pick_part[i] = random() % num_parts;
+    }
+
+    mark();
+    for(i = 0; i < n; i++){
+        update_availability(part_names[pick_part[i]], poll_names[pick_poll[i]],
+                            avail[i & 1], &polls);
+    }
+    report("update_availability", num_polls, num_parts, n);
+
+    mark();
+    for(i = 0; i < n; i++){
+        add_comment(part_names[pick_part[i]], poll_names[pick_poll[i]],
+                    "a comment of a typical length", &polls);
+    }
+    report("add_comment", num_polls, num_parts, n);
+
+    n = repeats(num_polls);
+    mark();
+    for(i = 0; i < n; i++){
+        print_polls(&polls, &out);
+        buf_clear(&out);
+    }
+    report("print_polls", num_polls, num_parts, n);
+
+    n = repeats(num_parts);
+    mark();
+    for(i = 0; i < n; i++){
+        print_poll_info(poll_names[pick_poll[i % num_polls]], &polls, &out);
+        buf_clear(&out);
+    }
+    report("print_poll_info", num_polls, num_parts, n);
+
+    mark();
+    for(p = 0; p < num_polls; p++){
+        delete_poll(poll_names[p], &polls);
+    }
+    report("delete_poll", num_polls, num_parts, num_polls);
+}
+
+/* Parse a list like "10,100,1000" into sweep, returning its length. */
+static int parse_sweep(char *list, int *sweep){
+    int n = 0;
+    char *item;
+    for(item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")){
+        if(n == MAX_SWEEP || (sweep[n] = atoi(item)) < 1){
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+static void usage(char *prog){
+    fprintf(stderr, "Usage: %s [-p poll counts] [-n participant counts] "
+            "[-s slots]\n       [-m max participants in total] [-l label]\n"
+            "counts are comma separated, as in -p 10,100,1000\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    int poll_sweep[MAX_SWEEP] = {10, 100, 1000, 10000};
+    int part_sweep[MAX_SWEEP] = {1, 10, 100, 1000};
+    int num_poll_sweep = 4, num_part_sweep = 4;
+    long max_cells = DEFAULT_MAX_CELLS;
+    int opt, i, j;
+
+    while((opt = getopt(argc, argv, "p:n:s:m:l:")) != -1){
+        switch(opt){
+            case 'p':
+                if((num_poll_sweep = parse_sweep(optarg, poll_sweep)) <= 0){
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+                if((num_part_sweep = parse_sweep(optarg, part_sweep)) <= 0){
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                if((num_slots = atoi(optarg)) < 1){
+                    usage(argv[0]);
+                }
+                break;
+            case 'm': max_cells = atol(optarg); break;
+            case 'l': label = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    for(i = 0; i < num_poll_sweep; i++){
+        for(j = 0; j < num_part_sweep; j++){
+            if((long)poll_sweep[i] * part_sweep[j] > max_cells){
+                fprintf(stderr, "skipping %d polls of %d participants\n",
+                        poll_sweep[i], part_sweep[j]);
+                continue;
+            }
+            fflush(stdout);
+            pid_t pid = fork();
+            if(pid == -1){
+                perror("fork");
+                exit(1);
+            }
+            if(pid == 0){
+                srandom(1);
+                run_point(poll_sweep[i], part_sweep[j]);
+                fflush(stdout);
+                _exit(0);
+            }
+            int status;
+            if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+               WEXITSTATUS(status) != 0){
+                fprintf(stderr, "%d polls of %d participants failed\n",
+                        poll_sweep[i], part_sweep[j]);
+                exit(1);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "binproto.h"
+
+// by SLAB_ number, as they appear in the slab label
+static char *slab_names[NUM_SLABS] = {"polls", "clients"};
+
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void hist_add(Histogram *h, uint64_t v) {
+    // the bucket is the number of bits v needs
+    int i = v == 0 ? 0 : 64 - __builtin_clzll(v);
+    if (i >= HIST_BUCKETS) {
+        i = HIST_BUCKETS - 1;
+    }
+    h->buckets[i]++;
+    h->count++;
+    h->sum += v;
+}
+
+void count_command(struct metrics *m, int opcode, int status, uint64_t started) {
+    if (opcode < 0 || opcode >= NUM_COMMANDS) {
+        opcode = 0;
+    }
+    if (status < 0 || status >= NUM_STATUSES) {
+        status = NUM_STATUSES - 1;
+    }
+    m->commands[opcode][status]++;
+    hist_add(&m->latency[opcode], metrics_now() - started);
+}
+
+static void hist_merge(Histogram *into, const Histogram *from) {
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+}
+
+void metrics_add(struct metrics *into, const struct metrics *from) {
+    int i, j;
+    for (i = 0; i < NUM_COMMANDS; i++) {
+        for (j = 0; j < NUM_STATUSES; j++) {
+            into->commands[i][j] += from->commands[i][j];
+        }
+        hist_merge(&into->latency[i], &from->latency[i]);
+    }
+    hist_merge(&into->fanout, &from->fanout);
+    into->coalesced += from->coalesced;
+    into->bytes_read += from->bytes_read;
+    into->bytes_written += from->bytes_written;
+    into->log_commits += from->log_commits;
+    into->notifications += from->notifications;
+    into->updates += from->updates;
+    into->resyncs += from->resyncs;
+    into->connections += from->connections;
+    into->rejected += from->rejected;
+    into->clients += from->clients;
+    into->polls += from->polls;
+    into->participants += from->participants;
+    into->poll_bytes += from->poll_bytes;
+    into->strings += from->strings;
+    into->string_bytes += from->string_bytes;
+    into->queued_bytes += from->queued_bytes;
+    for (i = 0; i < NUM_SLABS; i++) {
+        into->slab_records[i] += from->slab_records[i];
+        into->slab_capacity[i] += from->slab_capacity[i];
+    }
+    into->bytes_dropped += from->bytes_dropped;
+    into->slow_disconnects += from->slow_disconnects;
+}
+
+/* The buckets of h, cumulative as Prometheus wants them, with bucket i's
+ * bound 2^i times scale. labels go in front of le and may be empty.
+ */
+static void print_hist(Buffer *out, char *name, char *labels, const Histogram *h,
+                       double scale) {
+    unsigned long total = 0;
+    char *comma = labels[0] != '\0' ? "," : "";
+    int i;
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        total += h->buckets[i];
+        buf_printf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, comma,
+                   (double)(1UL << i) * scale, total);
+    }
+    buf_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, comma,
+               h->count);
+    if (labels[0] != '\0') {
+        buf_printf(out, "%s_sum{%s} %g\n", name, labels, h->sum * scale);
+        buf_printf(out, "%s_count{%s} %lu\n", name, labels, h->count);
+    } else {
+        buf_printf(out, "%s_sum %g\n", name, h->sum * scale);
+        buf_printf(out, "%s_count %lu\n", name, h->count);
+    }
+}
+
+static void print_one(Buffer *out, char *name, char *type, char *help,
+                      unsigned long value) {
+    buf_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name,
+               type, name, value);
+}
+
+void metrics_print(Buffer *out, const struct metrics *m, int num_workers) {
+    char labels[64];
+    int i, j;
+
+    buf_puts(out, "# HELP poll_commands_total Commands run, by command and "
+             "status (the lists.c return code, 5 for anything else).\n"
+             "# TYPE poll_commands_total counter\n");
+    for (i = 0; i < NUM_COMMANDS; i++) {
+        for (j = 0; j < NUM_STATUSES; j++) {
+            if (m->commands[i][j] > 0) {
+                buf_printf(out, "poll_commands_total{command=\"%s\",status=\"%d\"} %lu\n",
+                           bin_command_name(i), j, m->commands[i][j]);
+            }
+        }
+    }
+    buf_puts(out, "# HELP poll_command_duration_seconds Time from reading a "
+             "command to having its reply.\n"
+             "# TYPE poll_command_duration_seconds histogram\n");
+    for (i = 0; i < NUM_COMMANDS; i++) {
+        if (m->latency[i].count > 0) {
+            snprintf(labels, sizeof(labels), "command=\"%s\"", bin_command_name(i));
+            print_hist(out, "poll_command_duration_seconds", labels,
+                       &m->latency[i], 1e-6);
+        }
+    }
+    buf_puts(out, "# HELP poll_broadcast_fanout Clients following a poll "
+             "when it changed.\n# TYPE poll_broadcast_fanout histogram\n");
+    print_hist(out, "poll_broadcast_fanout", "", &m->fanout, 1);
+
+    print_one(out, "poll_activity_coalesced_total", "counter",
+              "Poll changes that went out with an earlier change's "
+              "notification.", m->coalesced);
+    print_one(out, "poll_read_bytes_total", "counter",
+              "Bytes read from clients.", m->bytes_read);
+    print_one(out, "poll_written_bytes_total", "counter",
+              "Bytes written to clients.", m->bytes_written);
+    print_one(out, "poll_log_commits_total", "counter",
+              "Writes of log records, each followed by an fdatasync.",
+              m->log_commits);
+    print_one(out, "poll_notifications_total", "counter",
+              "Notifications queued for clients.", m->notifications);
+    print_one(out, "poll_watch_updates_total", "counter",
+              "Watch updates queued for clients.", m->updates);
+    print_one(out, "poll_watch_resyncs_total", "counter",
+              "Full watch updates sent to clients that missed one.",
+              m->resyncs);
+    print_one(out, "poll_notification_dropped_bytes_total", "counter",
+              "Notification bytes slow clients missed.", m->bytes_dropped);
+    print_one(out, "poll_slow_disconnects_total", "counter",
+              "Clients dropped for reading too slowly.", m->slow_disconnects);
+    print_one(out, "poll_connections_total", "counter",
+              "Client connections accepted.", m->connections);
+    print_one(out, "poll_connections_rejected_total", "counter",
+              "Client connections turned away for being over a limit.",
+              m->rejected);
+    print_one(out, "poll_clients", "gauge", "Clients connected.", m->clients);
+    print_one(out, "poll_polls", "gauge", "Polls.", m->polls);
+    print_one(out, "poll_participants", "gauge",
+              "Participants over all polls.", m->participants);
+    print_one(out, "poll_poll_memory_bytes", "gauge",
+              "Memory held by the polls' arenas.", m->poll_bytes);
+    print_one(out, "poll_interned_strings", "gauge",
+              "Distinct slot labels and participant names held.", m->strings);
+    print_one(out, "poll_interned_memory_bytes", "gauge",
+              "Memory held by the interned strings.", m->string_bytes);
+    print_one(out, "poll_output_queued_bytes", "gauge",
+              "Output waiting to be written to clients.", m->queued_bytes);
+    print_one(out, "poll_workers", "gauge", "Worker threads.", num_workers);
+    buf_puts(out, "# HELP poll_slab_records Records in use, by pool.\n"
+             "# TYPE poll_slab_records gauge\n");
+    for (i = 0; i < NUM_SLABS; i++) {
+        buf_printf(out, "poll_slab_records{slab=\"%s\"} %ld\n", slab_names[i],
+                   m->slab_records[i]);
+    }
+    buf_puts(out, "# HELP poll_slab_capacity Records the blocks of each pool "
+             "have room for.\n# TYPE poll_slab_capacity gauge\n");
+    for (i = 0; i < NUM_SLABS; i++) {
+        buf_printf(out, "poll_slab_capacity{slab=\"%s\"} %ld\n", slab_names[i],
+                   m->slab_capacity[i]);
+    }
+
+    // the process as a whole
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    print_one(out, "process_resident_memory_bytes", "gauge",
+              "Resident memory size.", resident * sysconf(_SC_PAGESIZE));
+#ifdef __GLIBC__
+    struct mallinfo2 heap = mallinfo2();
+    print_one(out, "poll_heap_bytes", "gauge",
+              "Bytes allocated with malloc and not yet freed.", heap.uordblks + heap.hblkhd);
+#endif
+    buf_puts(out, "# EOF\n");
+}
@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "buffer.h"
+
+/* Counters for what a server worker has done. Each worker keeps its own
+ * and only it writes to them, so nothing here is shared between threads;
+ * the stats command has every worker send a copy and adds them up.
+ */
+
+// bucket i of a histogram counts values below 2^i; the last takes the rest
+#define HIST_BUCKETS 24
+
+typedef struct histogram {
+    unsigned long buckets[HIST_BUCKETS];
+    unsigned long count;
+    uint64_t sum;
+} Histogram;
+
+// commands by binary protocol opcode, with 0 for unrecognized ones
+#define NUM_COMMANDS 14
+// the lists.c return codes 0 to 4, then anything else
+#define NUM_STATUSES 6
+// the record pools, see slab.h
+#define SLAB_POLLS 0
+#define SLAB_CLIENTS 1
+#define NUM_SLABS 2
+
+struct metrics {
+    unsigned long commands[NUM_COMMANDS][NUM_STATUSES];
+    Histogram latency[NUM_COMMANDS];   // us from reading a command to its reply
+    Histogram fanout;                  // clients following each changed poll
+    unsigned long coalesced;           // changes told along with an earlier one
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long log_commits;         // log writes, each with an fdatasync
+    unsigned long notifications;
+    unsigned long updates;             // watch updates queued for clients
+    unsigned long resyncs;             // full updates sent after missed ones
+    unsigned long bytes_dropped;       // notifications missed by slow clients
+    unsigned long slow_disconnects;
+    unsigned long connections;         // accepted since startup
+    unsigned long rejected;            // turned away by admission control
+    long clients;                      // connected now
+
+    // the rest is filled in when the metrics are collected
+    long polls;
+    long participants;
+    unsigned long poll_bytes;          // arena memory held by the polls
+    long strings;                      // interned labels and names
+    unsigned long string_bytes;        // memory held by them
+    unsigned long queued_bytes;        // output waiting in client queues
+    long slab_records[NUM_SLABS];      // records in use in each pool
+    long slab_capacity[NUM_SLABS];     // records its blocks have room for
+};
+
+/* Return a monotonic time in microseconds.
+ */
+uint64_t metrics_now();
+
+/* Count the value v in h.
+ */
+void hist_add(Histogram *h, uint64_t v);
+
+/* Add the command with this opcode and status, begun at started
+ * (from metrics_now), to m.
+ */
+void count_command(struct metrics *m, int opcode, int status, uint64_t started);
+
+/* Add everything in from to into.
+ */
+void metrics_add(struct metrics *into, const struct metrics *from);
+
+/* Append m, the total over num_workers workers, to out in the Prometheus
+ * text format, along with the memory used by the process as a whole.
+ */
+void metrics_print(Buffer *out, const struct metrics *m, int num_workers);
+
+#endif
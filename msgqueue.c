@@ -0,0 +1,52 @@
+#include "msgqueue.h"
+#include <stddef.h>
+
+/* This is the intrusive queue by Dmitry Vyukov: producers swing head to
+ * their node and then link the old head to it; the consumer follows next
+ * pointers from tail. The stub node keeps the queue from ever being
+ * completely empty, so producers and the consumer never touch the same
+ * node's fields at the same time.
+ */
+
+void mq_init(MsgQueue *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+void mq_push(MsgQueue *q, MQNode *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    MQNode *prev = atomic_exchange_explicit(&q->head, node,
+                                            memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+MQNode *mq_pop(MsgQueue *q) {
+    MQNode *tail = q->tail;
+    MQNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    // tail is the last node, unless a producer is half way through a push
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+    // put the stub back behind tail so tail can be handed out
+    mq_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef MSGQUEUE_H
+#define MSGQUEUE_H
+
+#include <stdatomic.h>
+
+/* A lock-free multi-producer single-consumer queue of intrusive nodes.
+ * Any thread may push; only the owning thread may pop. Pushing is a
+ * single atomic exchange, so producers never wait on each other or on the
+ * consumer. Messages from one producer come out in the order it pushed
+ * them.
+ */
+typedef struct mq_node {
+   _Atomic(struct mq_node *) next;
+} MQNode;
+
+typedef struct msg_queue {
+   _Atomic(MQNode *) head;   // most recently pushed node
+   MQNode *tail;             // next node to pop, owned by the consumer
+   MQNode stub;
+} MsgQueue;
+
+/* Set up an empty queue.
+ */
+void mq_init(MsgQueue *q);
+
+/* Add node to the queue. Safe to call from any thread.
+ */
+void mq_push(MsgQueue *q, MQNode *node);
+
+/* Remove and return the oldest node, or NULL if there is none. A push
+ * that has not finished yet may be missed; the producer wakes the
+ * consumer again after pushing, so it will be seen on the next call.
+ */
+MQNode *mq_pop(MsgQueue *q);
+
+#endif
@@ -0,0 +1,118 @@
+#include "name_order.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Pick a height for a new node: one level, plus one more for each pair
+ * of random bits that comes up zero. xorshift, seeded on first use.
+ */
+static int random_height(NameOrder *order) {
+    if (order->seed == 0) {
+        order->seed = 2463534242u;
+    }
+    unsigned int x = order->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    order->seed = x;
+
+    int height = 1;
+    while (height < ORDER_MAX_LEVEL && (x & 3) == 0) {
+        height++;
+        x >>= 2;
+    }
+    return height;
+}
+
+/* Walk down to key, leaving in links[l] the next array (a node's, or the
+ * head's) whose entry for level l is the last link on that level before
+ * key. With after set a node equal to key counts as before it.
+ */
+static void find_links(NameOrder *order, const char *key, int after,
+                       OrderNode ***links) {
+    OrderNode **next = order->head;
+    int l;
+    for (l = order->levels - 1; l >= 0; l--) {
+        while (next[l] != NULL) {
+            int cmp = strcmp(next[l]->key, key);
+            if (cmp > 0 || (cmp == 0 && !after)) {
+                break;
+            }
+            next = next[l]->next;
+        }
+        links[l] = next;
+    }
+}
+
+void order_insert(NameOrder *order, const char *key, void *item) {
+    OrderNode **links[ORDER_MAX_LEVEL];
+    int height = random_height(order);
+    OrderNode *node = malloc(sizeof(OrderNode) + sizeof(OrderNode *) * height);
+    if (node == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    node->key = key;
+    node->item = item;
+    node->height = height;
+
+    find_links(order, key, 0, links);
+    // levels the list did not reach yet start at the head
+    while (order->levels < height) {
+        links[order->levels++] = order->head;
+    }
+    int l;
+    for (l = 0; l < height; l++) {
+        node->next[l] = links[l][l];
+        links[l][l] = node;
+    }
+}
+
+int order_remove(NameOrder *order, const char *key) {
+    OrderNode **links[ORDER_MAX_LEVEL];
+    if (order->levels == 0) {
+        return 1;
+    }
+    find_links(order, key, 0, links);
+    OrderNode *node = links[0][0];
+    if (node == NULL || strcmp(node->key, key) != 0) {
+        return 1;
+    }
+    int l;
+    for (l = 0; l < node->height; l++) {
+        links[l][l] = node->next[l];
+    }
+    while (order->levels > 0 && order->head[order->levels - 1] == NULL) {
+        order->levels--;
+    }
+    free(node);
+    return 0;
+}
+
+OrderNode *order_from(NameOrder *order, const char *key) {
+    OrderNode **links[ORDER_MAX_LEVEL];
+    if (order->levels == 0) {
+        return NULL;
+    }
+    find_links(order, key, 0, links);
+    return links[0][0];
+}
+
+OrderNode *order_after(NameOrder *order, const char *key) {
+    OrderNode **links[ORDER_MAX_LEVEL];
+    if (order->levels == 0) {
+        return NULL;
+    }
+    find_links(order, key, 1, links);
+    return links[0][0];
+}
+
+void order_free(NameOrder *order) {
+    OrderNode *node = order->head[0];
+    while (node != NULL) {
+        OrderNode *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    memset(order, 0, sizeof(NameOrder));
+}
@@ -0,0 +1,48 @@
+#ifndef NAME_ORDER_H
+#define NAME_ORDER_H
+
+/* A skip list keeping names in strcmp order, beside a hash index over the
+ * same records, for walking them in order from any point. As with the
+ * hash index the records and their names are not owned; each node keeps
+ * a pointer to the name stored inside its record.
+ *
+ * A node is on level 0 and, with probability 1/4 for each level above,
+ * on the levels over it, so a seek takes O(log n) steps. A
+ * zero-initialized NameOrder is empty.
+ */
+#define ORDER_MAX_LEVEL 16
+
+typedef struct order_node {
+   const char *key;
+   void *item;
+   int height;                  // levels this node is on
+   struct order_node *next[];   // next node on each of them
+} OrderNode;
+
+typedef struct name_order {
+   OrderNode *head[ORDER_MAX_LEVEL];   // first node on each level
+   int levels;                         // levels holding any nodes
+   unsigned int seed;                  // for picking node heights
+} NameOrder;
+
+/* Add item under key. key must stay valid while the item is in the
+ * order and must not already be in it.
+ */
+void order_insert(NameOrder *order, const char *key, void *item);
+
+/* Remove the node for key. Return 0 on success, 1 if not found.
+ */
+int order_remove(NameOrder *order, const char *key);
+
+/* Return the first node whose key sorts at or after key (order_from) or
+ * strictly after it (order_after), or NULL if there is none. The nodes
+ * from there on are reached through next[0].
+ */
+OrderNode *order_from(NameOrder *order, const char *key);
+OrderNode *order_after(NameOrder *order, const char *key);
+
+/* Free the nodes and leave the order empty. Items are not touched.
+ */
+void order_free(NameOrder *order);
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lists.h"
+#include "name_order.h"
+#include "check.h"
+
+#define NAMES 2000
+
+static char names[NAMES][16];
+static int in_order[NAMES];   // whether names[i] is in the order
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+// the first name in the order at or after key (or after it), by brute force
+static char *expect(const char *key, int after) {
+    char *best = NULL;
+    int i;
+    for (i = 0; i < NAMES; i++) {
+        int cmp = strcmp(names[i], key);
+        if (in_order[i] && (cmp > 0 || (cmp == 0 && !after)) &&
+            (best == NULL || strcmp(names[i], best) < 0)) {
+            best = names[i];
+        }
+    }
+    return best;
+}
+
+static char *key_of(OrderNode *node) {
+    return node ? (char *)node->key : NULL;
+}
+
+// the order holds exactly the names marked in_order, sorted
+static void check_walk(NameOrder *order) {
+    char *sorted[NAMES];
+    int n = 0, i;
+    for (i = 0; i < NAMES; i++) {
+        if (in_order[i]) {
+            sorted[n++] = names[i];
+        }
+    }
+    qsort(sorted, n, sizeof(char *), by_name);
+    OrderNode *node = order->head[0];
+    for (i = 0; i < n && node != NULL; i++, node = node->next[0]) {
+        CHECK(node->key == sorted[i]);
+        CHECK(node->item == sorted[i]);
+    }
+    CHECK(i == n && node == NULL);
+}
+
+static void test_seek() {
+    NameOrder order = {0};
+    int i;
+    // distinct names, inserted out of order
+    for (i = 0; i < NAMES; i++) {
+        snprintf(names[i], sizeof(names[i]), "n%d", i * 7919 % 10007 * 2);
+        order_insert(&order, names[i], names[i]);
+        in_order[i] = 1;
+    }
+    check_walk(&order);
+
+    // removing half, every other one, leaves the rest in order
+    for (i = 0; i < NAMES; i += 2) {
+        CHECK(order_remove(&order, names[i]) == 0);
+        in_order[i] = 0;
+    }
+    CHECK(order_remove(&order, names[0]) == 1);
+    check_walk(&order);
+
+    // keys on, between, before and past the names left
+    for (i = 0; i < NAMES; i++) {
+        char key[20];
+        CHECK(key_of(order_from(&order, names[i])) == expect(names[i], 0));
+        CHECK(key_of(order_after(&order, names[i])) == expect(names[i], 1));
+        snprintf(key, sizeof(key), "%s5", names[i]);
+        CHECK(key_of(order_from(&order, key)) == expect(key, 0));
+    }
+    CHECK(key_of(order_from(&order, "")) == expect("", 0));
+    CHECK(order_from(&order, "o") == NULL);
+    CHECK(order_after(&order, "o") == NULL);
+
+    // emptied, it has no levels left to walk
+    for (i = 0; i < NAMES; i++) {
+        if (in_order[i]) {
+            CHECK(order_remove(&order, names[i]) == 0);
+            in_order[i] = 0;
+        }
+    }
+    CHECK(order.levels == 0 && order.head[0] == NULL);
+    CHECK(order_from(&order, "") == NULL);
+    CHECK(order_remove(&order, "n0") == 1);
+    order_free(&order);
+}
+
+// the names of a page of polls, with a space after each
+static char *page(PollList *polls, char *prefix, char *after, int limit) {
+    static char text[256];
+    Poll *found[16];
+    int n = page_polls(polls, prefix, after, limit, found), i;
+    text[0] = '\0';
+    for (i = 0; i < n; i++) {
+        strcat(text, found[i]->name);
+        strcat(text, " ");
+    }
+    return text;
+}
+
+static void test_paging() {
+    PollList polls = {0};
+    char *labels[] = {"x"};
+    char *poll_names[] = {"b", "ab", "a", "abd", "ac", "abc", "aa"};
+    int i;
+    for (i = 0; i < 7; i++) {
+        create_poll(poll_names[i], labels, 1, &polls);
+    }
+    CHECK(strcmp(page(&polls, "", "", 16), "a aa ab abc abd ac b ") == 0);
+    CHECK(strcmp(page(&polls, "ab", "", 16), "ab abc abd ") == 0);
+    // a cursor on the prefix itself starts after it
+    CHECK(strcmp(page(&polls, "ab", "ab", 16), "abc abd ") == 0);
+    // a cursor before the prefix starts at the prefix
+    CHECK(strcmp(page(&polls, "ab", "aa", 16), "ab abc abd ") == 0);
+    // a cursor past the prefix's names finds none
+    CHECK(strcmp(page(&polls, "ab", "abz", 16), "") == 0);
+    CHECK(strcmp(page(&polls, "zz", "", 16), "") == 0);
+
+    // page by two, carrying on from the last name each time
+    CHECK(strcmp(page(&polls, "a", "", 2), "a aa ") == 0);
+    CHECK(strcmp(page(&polls, "a", "aa", 2), "ab abc ") == 0);
+    CHECK(strcmp(page(&polls, "a", "abc", 2), "abd ac ") == 0);
+    CHECK(strcmp(page(&polls, "a", "ac", 2), "") == 0);
+
+    // a deleted poll leaves the pages it was on
+    CHECK(delete_poll("abc", &polls) == 0);
+    CHECK(strcmp(page(&polls, "ab", "", 16), "ab abd ") == 0);
+    CHECK(strcmp(page(&polls, "ab", "abc", 16), "abd ") == 0);
+    while (polls.head != NULL) {
+        delete_poll(polls.head->name, &polls);
+    }
+    CHECK(polls.order.levels == 0);
+}
+
+int main() {
+    test_seek();
+    test_paging();
+    return check_result("name_order_test");
+}
@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "binproto.h"
+#include "buffer.h"
+
+/* Load generator for poll_server. Opens many connections, gives each a
+ * username and drives a weighted mix of commands at the server, then
+ * reports throughput and latency percentiles.
+ *
+ * It talks the binary protocol, where every command gets exactly one
+ * reply, so a command's latency is the time from writing it to reading
+ * its reply. Each connection keeps up to -q commands outstanding.
+ *
+ * The time a notification takes to arrive is measured on probe polls.
+ * Every connection votes in one of them before the run starts, and so
+ * follows it. During the run a separate prober connection votes in each
+ * probe poll in turn, one vote at a time, and every notification for a
+ * probe poll is timed from that vote. A probe is done when every follower
+ * has its notification, or after PROBE_TIMEOUT, and then the next starts.
+ */
+
+#define READ_SIZE (64 * 1024)
+#define MAX_DEPTH 64
+#define MAX_POLLS 10000
+#define MAX_SLOTS 1024
+#define PROBE_TIMEOUT 1000000000L   // ns
+#define MAX_EVENTS 256
+
+enum op {OP_CREATE, OP_VOTE, OP_COMMENT, OP_INFO, OP_LIST, OP_RESULTS,
+         NUM_OPS};
+
+static struct {
+    char *name;
+    int weight;   // share of the mix, out of the sum of all weights
+} ops[NUM_OPS] = {
+    {"create_poll", 5},
+    {"vote", 50},
+    {"comment", 10},
+    {"poll_info", 15},
+    {"list_polls", 5},
+    {"results", 15},
+};
+
+/* Latencies in ns, sorted once the run is over. */
+typedef struct samples {
+    uint64_t *v;
+    size_t n;
+    size_t cap;
+} Samples;
+
+struct request {
+    int op;
+    int poll;   // index of the bench poll it names, or -1
+    uint64_t sent;
+};
+
+enum state {GREETING, HELLO, SUBSCRIBING, RUNNING, CLOSED};
+
+struct conn {
+    int fd;
+    int id;
+    enum state state;
+    char *in;
+    long in_len;
+    long in_cap;
+    Buffer out;
+    int writing;   // waiting for room to write, so EPOLLOUT is on
+    struct request pending[MAX_DEPTH];   // oldest at head
+    int head;
+    int count;
+    int created;   // polls this connection has created
+};
+
+struct probe {
+    uint64_t sent;       // when the prober's vote went out, 0 if none yet
+    int followers;       // connections known to follow this poll
+    int notified;        // notifications for the vote in flight
+};
+
+static char *host = "127.0.0.1";
+static int port = PORT;
+static int num_conns = 1000;
+static int depth = 1;
+static double duration = 10;
+static int num_polls = 100;
+static int num_probes = 10;
+static int num_slots = 8;
+
+static struct conn *conns;
+static struct conn prober;
+static struct conn setup;   // creates the polls before the run
+static int setup_replies;
+static struct probe *probes;
+static int next_probe;
+static int epollfd;
+static int running;   // commands are being counted
+static int connections_lost;
+
+static Samples op_latency[NUM_OPS];
+static Samples all_latency;
+static Samples notify_latency;
+static Samples fanout_latency;
+static unsigned long statuses[NUM_OPS][3];   // ok, other status, bad request
+static unsigned long bench_notifies;
+static unsigned long probe_timeouts;
+static unsigned long bytes_in;
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void add_sample(Samples *s, uint64_t v){
+    if(s->n == s->cap){
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        if((s->v = realloc(s->v, s->cap * sizeof(uint64_t))) == NULL){
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = v;
+}
+
+static int compare_samples(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The q quantile of s in microseconds; s must be sorted. */
+static double quantile(Samples *s, double q){
+    if(s->n == 0){
+        return 0;
+    }
+    return s->v[(size_t)(q * (s->n - 1))] / 1000.0;
+}
+
+static void print_latency(char *label, Samples *s){
+    qsort(s->v, s->n, sizeof(uint64_t), compare_samples);
+    printf("%-12s %10zu %9.1f %9.1f %9.1f %9.1f\n", label, s->n,
+           quantile(s, 0.5), quantile(s, 0.99), quantile(s, 0.999),
+           quantile(s, 1));
+}
+
+/* Parse a mix like "vote=60,poll_info=20" over the default weights. An
+ * operation left out keeps its weight, so "create_poll=0" drops one.
+ */
+static int parse_mix(char *mix){
+    char *item;
+    for(item = strtok(mix, ","); item != NULL; item = strtok(NULL, ",")){
+        char *eq = strchr(item, '=');
+        int i;
+        if(eq == NULL){
+            return -1;
+        }
+        *eq = '\0';
+        for(i = 0; i < NUM_OPS && strcmp(ops[i].name, item) != 0; i++);
+        if(i == NUM_OPS){
+            return -1;
+        }
+        ops[i].weight = atoi(eq + 1);
+    }
+    return 0;
+}
+
+static int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Connect and send the username line asking for the binary protocol. */
+static void open_conn(struct conn *c, int id, char *name){
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+
+    memset(c, 0, sizeof(struct conn));
+    c->id = id;
+    if((c->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1){
+        perror("socket");
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &addr.sin_addr) != 1){
+        fprintf(stderr, "bad address %s\n", host);
+        exit(1);
+    }
+    if(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(set_nonblocking(c->fd) == -1){
+        perror("fcntl");
+        exit(1);
+    }
+    c->in_cap = READ_SIZE;
+    if((c->in = malloc(c->in_cap)) == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    char line[MAX_NAME + 2];
+    snprintf(line, sizeof(line), "%c%s\n", BIN_HANDSHAKE, name);
+    buf_puts(&c->out, line);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1){
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+static void close_conn(struct conn *c){
+    if(c->state == CLOSED){
+        return;
+    }
+    close(c->fd);
+    c->state = CLOSED;
+    connections_lost++;
+}
+
+/* Write what the connection has queued, watching for room if the socket
+ * will not take it all.
+ */
+static void flush_conn(struct conn *c){
+    struct iovec iov[16];
+
+    while(c->state != CLOSED && c->out.len > 0){
+        int n = buf_iov(&c->out, iov, 16);
+        ssize_t written = writev(c->fd, iov, n);
+        if(written == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            if(errno != EINTR){
+                close_conn(c);
+            }
+            continue;
+        }
+        buf_consume(&c->out, written);
+    }
+    int want = c->state != CLOSED && c->out.len > 0;
+    if(want != c->writing){
+        struct epoll_event ev;
+        ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->writing = want;
+    }
+}
+
+static void bench_poll_name(char *buf, size_t size, int i){
+    snprintf(buf, size, "bp%d", i);
+}
+
+static void probe_poll_name(char *buf, size_t size, int i){
+    snprintf(buf, size, "pp%d", i);
+}
+
+/* A random availability for every slot of a bench poll. */
+static void random_vote(char *poll_name){
+    uint64_t bits[(MAX_SLOTS + 63) / 64];
+    int i;
+    for(i = 0; i < (num_slots + 63) / 64; i++){
+        bits[i] = (uint64_t)random() << 32 ^ random();
+    }
+    if(num_slots % 64 != 0){
+        bits[num_slots / 64] &= ((uint64_t)1 << (num_slots % 64)) - 1;
+    }
+    bin_begin(BIN_VOTE);
+    bin_str(poll_name);
+    bin_bitmap(bits, num_slots);
+}
+
+static void send_request(struct conn *c, int op, int poll){
+    char name[MAX_NAME];
+    int i;
+
+    switch(op){
+        case OP_CREATE:
+            snprintf(name, sizeof(name), "bc%d_%d", c->id, c->created++);
+            bin_begin(BIN_CREATE_POLL);
+            bin_str(name);
+            bin_u16(2);
+            bin_str("early");
+            bin_str("late");
+            break;
+        case OP_VOTE:
+            bench_poll_name(name, sizeof(name), poll);
+            random_vote(name);
+            break;
+        case OP_COMMENT:
+            bench_poll_name(name, sizeof(name), poll);
+            bin_begin(BIN_COMMENT);
+            bin_str(name);
+            bin_str("sent by poll_bench");
+            break;
+        case OP_INFO:
+        case OP_RESULTS:
+            bench_poll_name(name, sizeof(name), poll);
+            bin_begin(op == OP_INFO ? BIN_POLL_INFO : BIN_RESULTS);
+            bin_str(name);
+            break;
+        case OP_LIST:
+            bin_begin(BIN_LIST_POLLS);
+            break;
+    }
+    bin_end(&c->out);
+    i = (c->head + c->count++) % MAX_DEPTH;
+    c->pending[i].op = op;
+    c->pending[i].poll = poll;
+    c->pending[i].sent = now_ns();
+}
+
+/* Keep the connection's pipeline full with commands from the mix. */
+static void fill_pipeline(struct conn *c){
+    static int total_weight = -1;
+    int i;
+
+    if(total_weight == -1){
+        total_weight = 0;
+        for(i = 0; i < NUM_OPS; i++){
+            total_weight += ops[i].weight;
+        }
+    }
+    if(c == &prober || c == &setup){
+        return;
+    }
+    while(c->state == RUNNING && c->count < depth){
+        int pick = random() % total_weight;
+        for(i = 0; pick >= ops[i].weight; i++){
+            pick -= ops[i].weight;
+        }
+        send_request(c, i, random() % num_polls);
+    }
+}
+
+/* Vote in the next probe poll, if the last probe is over. */
+static void next_probe_vote(uint64_t now){
+    struct probe *p = &probes[next_probe];
+    char name[MAX_NAME];
+
+    if(!running || prober.state != RUNNING || prober.count > 0){
+        return;
+    }
+    if(p->sent != 0){
+        // the prober follows the poll too, once it has voted
+        if(p->notified < p->followers + 1 && now - p->sent < PROBE_TIMEOUT){
+            return;
+        }
+        if(p->notified < p->followers + 1){
+            probe_timeouts++;
+        }
+        next_probe = (next_probe + 1) % num_probes;
+        p = &probes[next_probe];
+    }
+    probe_poll_name(name, sizeof(name), next_probe);
+    random_vote(name);
+    bin_end(&prober.out);
+    prober.pending[prober.head].op = OP_VOTE;
+    prober.pending[prober.head].poll = next_probe;
+    prober.count = 1;
+    p->sent = prober.pending[prober.head].sent = now;
+    p->notified = 0;
+    flush_conn(&prober);
+}
+
+static void handle_notify(struct conn *c, char *poll_name, uint64_t now){
+    if(strncmp(poll_name, "pp", 2) != 0){
+        bench_notifies++;
+        return;
+    }
+    struct probe *p = &probes[atoi(poll_name + 2) % num_probes];
+    if(p->sent == 0 || !running){
+        return;
+    }
+    add_sample(&notify_latency, now - p->sent);
+    if(++p->notified == p->followers + 1){
+        add_sample(&fanout_latency, now - p->sent);
+    }
+}
+
+static void handle_reply(struct conn *c, int opcode, int status, uint64_t now){
+    if(c == &setup){
+        setup_replies++;
+        return;
+    }
+    if(c->count == 0){
+        fprintf(stderr, "reply with nothing outstanding\n");
+        close_conn(c);
+        return;
+    }
+    struct request *r = &c->pending[c->head];
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->count--;
+
+    if(c->state == SUBSCRIBING){
+        // the vote that makes this connection follow its probe poll
+        if(status == BIN_OK){
+            probes[r->poll].followers++;
+        }
+        c->state = RUNNING;
+        return;
+    }
+    if(c == &prober){
+        return;
+    }
+    if(running){
+        add_sample(&op_latency[r->op], now - r->sent);
+        add_sample(&all_latency, now - r->sent);
+        statuses[r->op][status == BIN_OK ? 0 : status == BIN_BAD_REQUEST ? 2 : 1]++;
+    }
+}
+
+/* Handle every whole frame read from the connection. */
+static void parse_input(struct conn *c){
+    long at = 0;
+    uint64_t now = now_ns();
+
+    if(c->state == GREETING){
+        // the text prompt sent to every client before its username
+        char *newline = memchr(c->in, '\n', c->in_len);
+        if(newline == NULL){
+            return;
+        }
+        at = newline - c->in + 1;
+        c->state = HELLO;
+    }
+    while(c->state != CLOSED){
+        long size = bin_frame_size(c->in + at, c->in_len - at, 1L << 30);
+        if(size <= 0){
+            break;
+        }
+        unsigned char *f = (unsigned char *)c->in + at + BIN_HEADER;
+        long len = size - BIN_HEADER;
+        if(f[0] == BIN_HELLO && c->state == HELLO){
+            c->state = SUBSCRIBING;
+            if(c != &prober && c != &setup){
+                char name[MAX_NAME];
+                int i = c->id % num_probes;
+                probe_poll_name(name, sizeof(name), i);
+                random_vote(name);
+                bin_end(&c->out);
+                c->pending[c->head].op = OP_VOTE;
+                c->pending[c->head].poll = i;
+                c->count = 1;
+            } else {
+                c->state = RUNNING;
+            }
+        } else if(f[0] == BIN_REPLY && len >= 3){
+            handle_reply(c, f[1], f[2], now);
+        } else if(f[0] == BIN_NOTIFY && len >= 3){
+            int n = f[1] << 8 | f[2];
+            char name[MAX_NAME];
+            if(n >= MAX_NAME || n > len - 3){
+                n = 0;
+            }
+            memcpy(name, f + 3, n);
+            name[n] = '\0';
+            handle_notify(c, name, now);
+        }
+        at += size;
+    }
+    memmove(c->in, c->in + at, c->in_len - at);
+    c->in_len -= at;
+    // make room for a frame bigger than the buffer
+    if(c->in_len >= BIN_HEADER){
+        long size = bin_frame_size(c->in, c->in_len, 1L << 30);
+        if(size == 0){
+            unsigned char *h = (unsigned char *)c->in;
+            size = ((long)h[0] << 24 | h[1] << 16 | h[2] << 8 | h[3]) + BIN_HEADER;
+            if(size > c->in_cap){
+                c->in_cap = size;
+                if((c->in = realloc(c->in, c->in_cap)) == NULL){
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+static void read_conn(struct conn *c){
+    while(c->state != CLOSED){
+        if(c->in_len == c->in_cap){
+            c->in_cap *= 2;
+            if((c->in = realloc(c->in, c->in_cap)) == NULL){
+                perror("realloc");
+                exit(1);
+            }
+        }
+        ssize_t got = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if(got == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return;
+            }
+            if(errno != EINTR){
+                close_conn(c);
+            }
+            continue;
+        }
+        if(got == 0){
+            close_conn(c);
+            return;
+        }
+        bytes_in += got;
+        c->in_len += got;
+        parse_input(c);
+    }
+}
+
+/* Create the bench and probe polls, if an earlier run has not, over a
+ * connection of their own.
+ */
+static void create_polls(){
+    char name[MAX_NAME];
+    char label[16];
+    int i, j;
+
+    open_conn(&setup, -1, "poll_bench");
+    for(i = 0; i < num_polls + num_probes; i++){
+        if(i < num_polls){
+            bench_poll_name(name, sizeof(name), i);
+        } else {
+            probe_poll_name(name, sizeof(name), i - num_polls);
+        }
+        bin_begin(BIN_CREATE_POLL);
+        bin_str(name);
+        bin_u16(num_slots);
+        for(j = 0; j < num_slots; j++){
+            snprintf(label, sizeof(label), "slot%d", j);
+            bin_str(label);
+        }
+        bin_end(&setup.out);
+    }
+    while(setup_replies < num_polls + num_probes && setup.state != CLOSED){
+        struct epoll_event ev;
+        flush_conn(&setup);
+        if(epoll_wait(epollfd, &ev, 1, 1000) == 1){
+            read_conn(&setup);
+        }
+    }
+    if(setup.state == CLOSED){
+        fprintf(stderr, "lost the connection while creating polls\n");
+        exit(1);
+    }
+    close(setup.fd);
+    free(setup.in);
+    buf_clear(&setup.out);
+}
+
+static void usage(char *prog){
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] "
+            "[-d seconds] [-q depth]\n"
+            "       [-n polls] [-s slots] [-b probe polls] "
+            "[-m op=weight,...]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    struct epoll_event events[MAX_EVENTS];
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "h:p:c:d:q:n:s:b:m:")) != -1){
+        switch(opt){
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': num_conns = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'n': num_polls = atoi(optarg); break;
+            case 's': num_slots = atoi(optarg); break;
+            case 'b': num_probes = atoi(optarg); break;
+            case 'm':
+                if(parse_mix(optarg) == -1){
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if(num_conns < 1 || depth < 1 || depth > MAX_DEPTH || num_polls < 1 ||
+       num_polls > MAX_POLLS || num_probes < 1 || num_probes > MAX_POLLS ||
+       num_slots < 1 || num_slots > MAX_SLOTS || duration <= 0){
+        usage(argv[0]);
+    }
+    int total_weight = 0;
+    for(i = 0; i < NUM_OPS; i++){
+        total_weight += ops[i].weight;
+    }
+    if(total_weight <= 0){
+        usage(argv[0]);
+    }
+
+    // a descriptor per connection, and then some
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    srandom(getpid());
+    if((epollfd = epoll_create1(0)) == -1){
+        perror("epoll_create1");
+        exit(1);
+    }
+    if((probes = calloc(num_probes, sizeof(struct probe))) == NULL ||
+       (conns = calloc(num_conns, sizeof(struct conn))) == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    create_polls();
+
+    char name[MAX_NAME];
+    for(i = 0; i < num_conns; i++){
+        snprintf(name, sizeof(name), "bench%d", i);
+        open_conn(&conns[i], i, name);
+        flush_conn(&conns[i]);
+    }
+    open_conn(&prober, num_conns, "bench_prober");
+    flush_conn(&prober);
+
+    // wait for every connection to follow its probe poll, then run
+    uint64_t start = 0, end = 0;
+    int subscribed = 0;
+    uint64_t deadline = now_ns() + 30 * 1000000000L;
+    while(1){
+        uint64_t now = now_ns();
+        if(!running){
+            for(subscribed = 0, i = 0; i < num_conns; i++){
+                subscribed += conns[i].state == RUNNING || conns[i].state == CLOSED;
+            }
+            if(subscribed == num_conns && prober.state == RUNNING){
+                running = 1;
+                start = now;
+                end = start + (uint64_t)(duration * 1e9);
+                bytes_in = 0;
+                for(i = 0; i < num_conns; i++){
+                    fill_pipeline(&conns[i]);
+                    flush_conn(&conns[i]);
+                }
+            } else if(now > deadline){
+                fprintf(stderr, "only %d of %d connections got going\n",
+                        subscribed, num_conns);
+                exit(1);
+            }
+        } else if(now >= end){
+            break;
+        }
+        next_probe_vote(now);
+
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, 10);
+        for(i = 0; i < n; i++){
+            struct conn *c = events[i].data.ptr;
+            if(events[i].events & EPOLLOUT){
+                flush_conn(c);
+            }
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                read_conn(c);
+                fill_pipeline(c);
+                flush_conn(c);
+            }
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    unsigned long total = 0, failed = 0, bad = 0;
+    for(i = 0; i < NUM_OPS; i++){
+        total += statuses[i][0] + statuses[i][1] + statuses[i][2];
+        failed += statuses[i][1];
+        bad += statuses[i][2];
+    }
+    printf("%d connections, depth %d, %.1f s, %d bench polls of %d slots\n",
+           num_conns, depth, elapsed, num_polls, num_slots);
+    printf("%lu commands, %.0f/s, %.1f MB/s read\n", total, total / elapsed,
+           bytes_in / elapsed / 1e6);
+    printf("%lu refused by the server, %lu malformed, %d connections lost\n",
+           failed, bad, connections_lost);
+    printf("\n%-12s %10s %9s %9s %9s %9s   (latency in us)\n", "",
+           "count", "p50", "p99", "p999", "max");
+    for(i = 0; i < NUM_OPS; i++){
+        if(op_latency[i].n > 0){
+            print_latency(ops[i].name, &op_latency[i]);
+        }
+    }
+    print_latency("all", &all_latency);
+    print_latency("notify", &notify_latency);
+    print_latency("fan-out", &fanout_latency);
+    printf("\n%lu notifications for bench polls, %lu probes timed out\n",
+           bench_notifies, probe_timeouts);
+    return 0;
+}
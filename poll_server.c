@@ -1,3 +1,4 @@
+#define _GNU_SOURCE   // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -7,91 +8,902 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <ctype.h>
+#include <limits.h>
 #include <errno.h>
-#include "lists.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/uio.h>
+#ifdef USE_SELECT
+#include <sys/select.h>
+#else
+#include <sys/epoll.h>
+#endif
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include "server.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "binproto.h"
+#include "tally.h"
 
 #define DELIM " \n"
 #ifndef PORT
 #define PORT 11447
 #endif
-#define MAXNAME 32
-#define MAXINPUT 256
-#define MAXCLIENT 5
-#define INPUT_ARG_MAX_NUM 12
-static int listenfd;
-
-struct client{
-    int fd;
-    struct in_addr ipaddr;
-    struct client *next;
-    char name[MAXNAME];
-    char input[MAXINPUT];
-    int inbuf;
-    int room;
-    char *after;
-} *top = NULL;
-//create the heads of the empty data structure
-Poll *poll_list = NULL;
-
-static void addclient(int fd, struct in_addr addr);
+// default queue of connections waiting to be accepted
+#define LISTEN_BACKLOG 1024
+// connections taken from a listening socket per wakeup, so a burst of
+// them cannot hold up commands for long; the rest wait for the next one
+#define ACCEPT_BATCH 64
+#define IP_BUCKETS 1024
+#define MAXEVENTS 64
+#define MAXIOV 64
+// default output queue size past which a client counts as slow
+#define OUTQ_HIGH_WATER (1024 * 1024)
+
+// output queue limits and what to do with a client that passes them
+static unsigned long outq_high_water = OUTQ_HIGH_WATER;
+static int disconnect_slow = 0;
+
+// write-ahead log of poll changes, or -1 when running without one
+static int wal_fd = -1;
+
+// where snapshots go, how often worker 0 takes one, and whether one is
+// being written right now
+static char *snapshot_path = NULL;
+static int snapshot_interval = 0;
+static time_t next_snapshot;
+static atomic_int snapshot_running;
+// every worker waits here while a snapshot is forked
+static pthread_barrier_t quiesce_barrier;
+
+// admission control: the listen backlog, and how many clients may be
+// connected at once in all and from any one address, 0 for no limit
+static int listen_backlog = LISTEN_BACKLOG;
+static int max_clients = 0;
+static int max_per_ip = 0;
+static atomic_int total_clients;
+
+// clients connected from each address, kept only when max_per_ip is set
+struct ip_count {
+    struct in_addr addr;
+    int count;
+    struct ip_count *next;
+};
+static struct ip_count *ip_counts[IP_BUCKETS];
+// shared by every worker, since one address's connections land on all
+static pthread_mutex_t ip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// at most how often, in ms, followers hear of activity on a poll; with 0
+// they hear once per loop iteration however many changes it made
+static int notify_interval = 0;
+
+// loopback-only port for the stats command, and worker 0's socket on it
+static int admin_port = 0;
+static int adminfd = -1;
+
+// one worker per shard; workers[0] runs on the main thread
+struct worker *workers;
+int num_workers = 1;
+__thread struct worker *self;
+
+static struct client *addclient(int fd, struct in_addr addr);
 static void removeclient(int fd);
+static void reap_clients();
 static void bindandlisten();
-static char *read_client_input(struct client *p);
-static int execute_poll_commands(char *input, struct client *p);
-static int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr, struct client *p);
-static char announcement[] = "There has been activity in this poll\r\n";
+static int open_listener(in_addr_t addr, int port, int shared);
+static void newconnection(int listenfd, int admin);
+static void client_readable(struct client *p);
+static int write_client(struct client *p, char *buf, int len);
+static int write_client_buf(struct client *p, Buffer *b);
+static int check_slow(struct client *p);
+static void output_queued(struct client *p);
+static void flush_client(struct client *p);
+static void flush_clients();
+static void commit_log();
+static int start_snapshot();
+static void check_snapshot();
+static int loop_timeout();
+static void announce_activity();
+static int set_nonblocking(int fd);
+static char *read_client_input(struct client *p, long *len);
+static int execute_poll_commands(char *input, long len, struct client *p);
+static char announcement[] = "There has been new activity on poll %s\n";
 static char confirmation[] = "Go ahead and enter poll command\r\n";
-static int num_clients();
 
 void error(char *msg){
     fprintf(stderr, "Error: %s\n", msg);
 }
 
-int main(){
-    struct client *p;
-    extern void bindandlisten(), newconnection();
-    
-    bindandlisten();
+
+#ifdef USE_SELECT
+/* select() fallback: rebuild the fd_set from the client list each wakeup.
+ * Kept so it can be benchmarked against the epoll loop below.
+ */
+static void event_loop(){
+    struct client *p, *next;
     
     while(1){
         fd_set fdlist;
-        int maxfd = listenfd;
+        int maxfd = self->listenfd > self->wakefd ? self->listenfd : self->wakefd;
         FD_ZERO(&fdlist);
-        FD_SET(listenfd, &fdlist);
+        FD_SET(self->listenfd, &fdlist);
+        FD_SET(self->wakefd, &fdlist);
+        if(self->id == 0 && adminfd != -1){
+            FD_SET(adminfd, &fdlist);
+            if(adminfd > maxfd){
+                maxfd = adminfd;
+            }
+        }
+        fd_set writelist;
+        FD_ZERO(&writelist);
         //set the largest fd
-        for(p = top; p; p = p->next){
-            FD_SET(p->fd, &fdlist);
+        for(p = self->top; p; p = p->next){
+            if(!p->paused){
+                FD_SET(p->fd, &fdlist);
+            }
+            if(p->out.len > 0){
+                FD_SET(p->fd, &writelist);
+            }
             if(p->fd > maxfd){
                 maxfd = p->fd;
             }
         }
         
-        if (select(maxfd + 1, &fdlist, NULL, NULL, NULL) < 0){
+        int timeout = loop_timeout();
+        struct timeval tv = {timeout / 1000, (timeout % 1000) * 1000};
+        if (select(maxfd + 1, &fdlist, &writelist, NULL,
+                   timeout == -1 ? NULL : &tv) < 0){
+            if(errno == EINTR){
+                continue;
+            }
             perror("select");
             exit(1);
         }
+        check_snapshot();
         
-        for(p = top; p; p = p->next){
-            
-            if(FD_ISSET(p->fd, &fdlist)){
-                
-                char *client_input = read_client_input(p);
-                if(client_input != NULL){
-                    printf("input from %s\n", p->name);
-                    execute_poll_commands(client_input, p);
-                }
+        if (FD_ISSET(self->wakefd, &fdlist)){
+            handle_inbox();
+        }
+        for(p = self->top; p; p = next){
+            next = p->next;
+            // output queued this iteration waits for the commit below
+            if(p->fd != -1 && FD_ISSET(p->fd, &writelist) && !p->flush_pending){
+                flush_client(p);
+            }
+            if(p->fd != -1 && FD_ISSET(p->fd, &fdlist)){
+                client_readable(p);
             }
         }
-        if (FD_ISSET(listenfd, &fdlist)){
-            newconnection();
+        if (FD_ISSET(self->listenfd, &fdlist)){
+            newconnection(self->listenfd, 0);
+        }
+        if (self->id == 0 && adminfd != -1 && FD_ISSET(adminfd, &fdlist)){
+            newconnection(adminfd, 1);
+        }
+        announce_activity();
+        commit_log();
+        flush_clients();
+        flush_outbox();
+        reap_clients();
+    }
+}
+#else
+/* epoll loop: sockets are registered edge-triggered once when they are
+ * added, and each event carries its client pointer, so a wakeup only costs
+ * the sockets that are actually ready.
+ */
+static void event_loop(){
+    struct epoll_event events[MAXEVENTS];
+    struct epoll_event ev;
+    int i, n;
+    
+    if((self->epollfd = epoll_create1(0)) == -1){
+        perror("epoll_create1");
+        exit(1);
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;   // NULL marks the listening socket
+    if(epoll_ctl(self->epollfd, EPOLL_CTL_ADD, self->listenfd, &ev) == -1){
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.data.ptr = &self->wakefd;   // and this the inbox wakeup
+    if(epoll_ctl(self->epollfd, EPOLL_CTL_ADD, self->wakefd, &ev) == -1){
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.data.ptr = &adminfd;   // and this the admin port, on worker 0
+    if(self->id == 0 && adminfd != -1 &&
+       epoll_ctl(self->epollfd, EPOLL_CTL_ADD, adminfd, &ev) == -1){
+        perror("epoll_ctl");
+        exit(1);
+    }
+    
+    while(1){
+        if((n = epoll_wait(self->epollfd, events, MAXEVENTS, loop_timeout())) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        check_snapshot();
+        for(i = 0; i < n; i++){
+            struct client *p = events[i].data.ptr;
+            if(p == NULL){
+                newconnection(self->listenfd, 0);
+                continue;
+            }
+            if(events[i].data.ptr == &adminfd){
+                newconnection(adminfd, 1);
+                continue;
+            }
+            if(events[i].data.ptr == &self->wakefd){
+                handle_inbox();
+                continue;
+            }
+            // only a queue left over from an earlier, committed iteration;
+            // output queued this iteration waits for the commit below
+            if(p->fd != -1 && (events[i].events & EPOLLOUT) &&
+               p->out.len > 0 && !p->flush_pending){
+                flush_client(p);
+            }
+            if(p->fd != -1 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))){
+                client_readable(p);
+            }
+        }
+        announce_activity();
+        commit_log();
+        flush_clients();
+        flush_outbox();
+        reap_clients();
+    }
+}
+#endif
+
+static void *worker_main(void *arg){
+    self = arg;
+    event_loop();
+    return NULL;
+}
+
+/* Where replayed log records go: the shard that owns the poll. */
+static PollList *shard_polls(char *poll_name){
+    return &workers[shard_of(poll_name)].polls;
+}
+
+/* Open the log, creating it if need be, and rebuild the polls from its
+ * records from byte offset from on.
+ */
+static void open_log(char *path, uint64_t from){
+    struct timespec start, end;
+    long records;
+    
+    if((wal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1){
+        perror(path);
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if((records = wal_replay(wal_fd, from, shard_polls)) == -1){
+        perror(path);
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("replayed %ld log records in %.3f s", records, secs);
+    if(records > 0 && secs > 0){
+        printf(" (%.0f records/s)", records / secs);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/* How long the event loop may sleep, in ms: forever, unless a snapshot
+ * child needs reaping or worker 0 has a periodic snapshot coming up.
+ */
+static int loop_timeout(){
+    int timeout = -1;
+    if(self->snapshot_pid != 0){
+        timeout = 10;
+    } else if(self->id == 0 && snapshot_interval > 0){
+        time_t now = time(NULL);
+        timeout = now >= next_snapshot ? 0 : (next_snapshot - now) * 1000;
+    }
+    // wake up in time to announce activity held back for the tick
+    if(self->pending != NULL){
+        uint64_t now = metrics_now();
+        int wait = now >= self->next_notify ? 0
+                   : (self->next_notify - now + 999) / 1000;
+        if(timeout == -1 || wait < timeout){
+            timeout = wait;
+        }
+    }
+    return timeout;
+}
+
+/* Announce activity on polls, unless the last announcement was less than
+ * notify_interval ago. The first change after a quiet spell goes out
+ * straight away and later ones wait for the tick.
+ */
+static void announce_activity(){
+    if(self->pending == NULL){
+        return;
+    }
+    if(notify_interval > 0){
+        uint64_t now = metrics_now();
+        if(now < self->next_notify){
+            return;
+        }
+        self->next_notify = now + (uint64_t)notify_interval * 1000;
+    }
+    notify_pending();
+}
+
+/* Reap a finished snapshot child, and start the periodic snapshot when
+ * it is due.
+ */
+static void check_snapshot(){
+    int status;
+    if(self->snapshot_pid != 0 &&
+       waitpid(self->snapshot_pid, &status, WNOHANG) == self->snapshot_pid){
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - self->snapshot_start.tv_sec) +
+                      (end.tv_nsec - self->snapshot_start.tv_nsec) / 1e9;
+        if(WIFEXITED(status) && WEXITSTATUS(status) == 0){
+            printf("snapshot written in %.3f s\n", secs);
+        } else {
+            fprintf(stderr, "snapshot failed after %.3f s\n", secs);
         }
+        fflush(stdout);
+        self->snapshot_pid = 0;
+        atomic_store(&snapshot_running, 0);
     }
+    if(self->id == 0 && snapshot_interval > 0 && time(NULL) >= next_snapshot){
+        start_snapshot();
+        next_snapshot = time(NULL) + snapshot_interval;
+    }
+}
+
+/* Called by a worker told a snapshot is being taken: get its log records
+ * out, then stay put while the snapshot's worker forks.
+ */
+void quiesce(){
+    commit_log();
+    pthread_barrier_wait(&quiesce_barrier);
+    pthread_barrier_wait(&quiesce_barrier);
+}
+
+/* Fork a child that writes every poll to the snapshot file. The workers
+ * all stop at a barrier between commands for the fork, so the child's
+ * copy of the polls is consistent; after that copy-on-write lets them
+ * carry on while it writes. Return -1 if no snapshot can be started.
+ */
+static int start_snapshot(){
+    int expected = 0;
+    int i;
     
+    if(snapshot_path == NULL ||
+       !atomic_compare_exchange_strong(&snapshot_running, &expected, 1)){
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &self->snapshot_start);
+    for(i = 0; i < num_workers; i++){
+        if(i != self->id){
+            send_message(i, new_message(MSG_QUIESCE));
+        }
+    }
+    flush_outbox();
+    commit_log();
+    if(num_workers > 1){
+        pthread_barrier_wait(&quiesce_barrier);
+    }
+    // every change up to here is both in the log and in the snapshot
+    uint64_t log_offset = 0;
+    if(wal_fd != -1){
+        log_offset = lseek(wal_fd, 0, SEEK_END);
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        PollList *shards[num_workers];
+        for(i = 0; i < num_workers; i++){
+            shards[i] = &workers[i].polls;
+        }
+        if(snapshot_write(snapshot_path, shards, num_workers, log_offset) == -1){
+            perror(snapshot_path);
+            _exit(1);
+        }
+        _exit(0);
+    }
+    if(num_workers > 1){
+        pthread_barrier_wait(&quiesce_barrier);
+    }
+    if(pid == -1){
+        perror("fork");
+        atomic_store(&snapshot_running, 0);
+        return -1;
+    }
+    struct timespec resumed;
+    clock_gettime(CLOCK_MONOTONIC, &resumed);
+    printf("snapshot started, workers paused for %.3f ms\n",
+           (resumed.tv_sec - self->snapshot_start.tv_sec) * 1e3 +
+           (resumed.tv_nsec - self->snapshot_start.tv_nsec) / 1e6);
+    fflush(stdout);
+    self->snapshot_pid = pid;
     return 0;
 }
 
+/* Load the snapshot, if there is one, and return how much of the log it
+ * already covers.
+ */
+static uint64_t load_snapshot(){
+    struct timespec start, end;
+    uint64_t log_offset = 0;
+    long polls;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if((polls = snapshot_load(snapshot_path, shard_polls, &log_offset)) == -1){
+        if(errno == EINVAL){
+            // the log still holds everything the snapshot did
+            fprintf(stderr, "%s is damaged; replaying the whole log instead\n",
+                    snapshot_path);
+        } else if(errno != ENOENT){
+            perror(snapshot_path);
+            exit(1);
+        }
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("loaded %ld polls from snapshot in %.3f s\n", polls,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    fflush(stdout);
+    return log_offset;
+}
+
+static void usage(char *prog){
+    fprintf(stderr, "usage: %s [-q max_queued_bytes] [-d] [-t threads] [-l log]\n"
+                    "       [-s snapshot [-i seconds]] [-a admin_port] [-b backlog]\n"
+                    "       [-c max_clients] [-p max_per_address] [-n ms]\n", prog);
+    fprintf(stderr, "  -q  output queued for a client before it counts as slow\n");
+    fprintf(stderr, "  -d  disconnect slow clients instead of pausing them\n");
+    fprintf(stderr, "  -t  worker threads, each owning a shard of the polls\n");
+    fprintf(stderr, "  -l  keep polls in this log file so they survive a restart\n");
+    fprintf(stderr, "  -s  load polls from this snapshot and write it on `snapshot`\n");
+    fprintf(stderr, "  -i  also write the snapshot this often\n");
+    fprintf(stderr, "  -a  answer `stats` and `snapshot` on this port, from this machine only\n");
+    fprintf(stderr, "  -b  connections the kernel may queue for accepting\n");
+    fprintf(stderr, "  -c  turn clients away past this many connected\n");
+    fprintf(stderr, "  -p  turn clients away past this many from one address\n");
+    fprintf(stderr, "  -n  tell followers of a poll's activity at most this often\n");
+    exit(1);
+}
+
+int main(int argc, char **argv){
+    int opt, i;
+    char *log_path = NULL;
+    while((opt = getopt(argc, argv, "q:dt:l:s:i:a:b:c:p:n:")) != -1){
+        switch(opt){
+            case 'q':
+                outq_high_water = strtoul(optarg, NULL, 10);
+                if(outq_high_water == 0){
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                disconnect_slow = 1;
+                break;
+            case 't':
+                num_workers = atoi(optarg);
+                if(num_workers < 1){
+                    usage(argv[0]);
+                }
+                break;
+            case 'l':
+                log_path = optarg;
+                break;
+            case 's':
+                snapshot_path = optarg;
+                break;
+            case 'i':
+                snapshot_interval = atoi(optarg);
+                if(snapshot_interval < 1){
+                    usage(argv[0]);
+                }
+                break;
+            case 'a':
+                admin_port = atoi(optarg);
+                if(admin_port < 1 || admin_port > 65535){
+                    usage(argv[0]);
+                }
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                if(listen_backlog < 1){
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                max_clients = atoi(optarg);
+                if(max_clients < 1){
+                    usage(argv[0]);
+                }
+                break;
+            case 'p':
+                max_per_ip = atoi(optarg);
+                if(max_per_ip < 1){
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+                notify_interval = atoi(optarg);
+                if(notify_interval < 0){
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    // a client closing its end must not kill the server mid-write
+    signal(SIGPIPE, SIG_IGN);
+    
+    if((workers = calloc(num_workers, sizeof(struct worker))) == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    for(i = 0; i < num_workers; i++){
+        struct worker *w = &workers[i];
+        w->id = i;
+        mq_init(&w->inbox);
+        if((w->wakefd = eventfd(0, EFD_NONBLOCK)) == -1){
+            perror("eventfd");
+            exit(1);
+        }
+        w->outbox = calloc(num_workers, sizeof(struct message *));
+        w->outbox_tail = calloc(num_workers, sizeof(struct message *));
+        if(w->outbox == NULL || w->outbox_tail == NULL){
+            perror("calloc");
+            exit(1);
+        }
+    }
+    if(snapshot_interval > 0 && snapshot_path == NULL){
+        usage(argv[0]);
+    }
+    tally_init();
+    uint64_t log_from = 0;
+    if(snapshot_path != NULL){
+        log_from = load_snapshot();
+        next_snapshot = time(NULL) + snapshot_interval;
+    }
+    if(log_path != NULL){
+        open_log(log_path, log_from);
+    }
+    if(num_workers > 1){
+        pthread_barrier_init(&quiesce_barrier, NULL, num_workers);
+    }
+    for(i = 0; i < num_workers; i++){
+        // every worker listens on the port and the kernel spreads
+        // connections between them
+        self = &workers[i];
+        bindandlisten();
+    }
+    if(admin_port != 0){
+        adminfd = open_listener(htonl(INADDR_LOOPBACK), admin_port, 0);
+    }
+    for(i = 1; i < num_workers; i++){
+        if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0){
+            fprintf(stderr, "could not start worker %d\n", i);
+            exit(1);
+        }
+    }
+    worker_main(&workers[0]);
+    return 0;
+}
+
+/* Read everything available on a ready client and run each command.
+ * Sockets are non-blocking, so this stops once read() reports EAGAIN,
+ * which edge-triggered epoll requires. Replies pile up on the client's
+ * queue and go out together in one writev at the end of the iteration.
+ */
+static void client_readable(struct client *p){
+    p->drained = 0;
+    p->reading = 1;
+    while(p->fd != -1 && !p->paused){
+        long len;
+        char *client_input = read_client_input(p, &len);
+        if(client_input != NULL){
+            printf("input from %s\n", p->name);
+            execute_poll_commands(client_input, len, p);
+        } else if(p->drained){
+            break;
+        }
+    }
+    p->reading = 0;
+    // a command may have dropped the client while its input was in use
+    if(p->fd == -1){
+        free(p->input);
+        p->input = NULL;
+    }
+}
+
+static int set_nonblocking(int fd){
+    int flags;
+    if((flags = fcntl(fd, F_GETFL, 0)) == -1){
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Return the client h names if it is still connected to this worker. */
+struct client *find_client(struct handle *h){
+    struct client *p;
+    if(h->worker != self->id || h->fd < 0 || h->fd >= self->fdtab_size){
+        return NULL;
+    }
+    p = self->fdtab[h->fd];
+    if(p == NULL || p->id != h->id){
+        return NULL;
+    }
+    return p;
+}
+
+/* Queue buf as a reply to the client. It goes out when the queue is
+ * flushed at the end of this loop iteration, or later once the socket is
+ * writable again. A client whose queue passes the high-water mark stops
+ * being read from until it catches up, or is dropped if disconnect_slow
+ * is set. Return -1 if the client is gone.
+ */
+static int write_client(struct client *p, char *buf, int len){
+    if(check_slow(p) == -1){
+        return -1;
+    }
+    buf_append(&p->out, buf, len);
+    output_queued(p);
+    return 0;
+}
+
+/* Like write_client, but hand over a whole response built in b. Its
+ * chunks are moved onto the client's queue rather than copied, and b is
+ * left empty either way.
+ */
+static int write_client_buf(struct client *p, Buffer *b){
+    if(check_slow(p) == -1){
+        buf_clear(b);
+        return -1;
+    }
+    buf_splice(&p->out, b);
+    output_queued(p);
+    return 0;
+}
+
+/* Hand over the output of the client's command number seq. Replies go
+ * out in the order the commands were read, so one that arrives ahead of
+ * an earlier command's reply is held until that one has been sent. Watch
+ * updates that came in meanwhile follow once nothing is held.
+ */
+void deliver_reply(struct client *p, unsigned long seq, Buffer *out){
+    struct held_reply *h, **hp;
+    
+    if(p->fd == -1){
+        buf_clear(out);
+        return;
+    }
+    if(seq != p->next_reply_seq){
+        if((h = malloc(sizeof(struct held_reply))) == NULL){
+            perror("malloc");
+            exit(1);
+        }
+        h->seq = seq;
+        memset(&h->out, 0, sizeof(h->out));
+        buf_splice(&h->out, out);
+        for(hp = &p->held; *hp != NULL && (*hp)->seq < seq; hp = &(*hp)->next);
+        h->next = *hp;
+        *hp = h;
+        return;
+    }
+    write_client_buf(p, out);
+    p->next_reply_seq++;
+    while(p->fd != -1 && p->held != NULL && p->held->seq == p->next_reply_seq){
+        h = p->held;
+        p->held = h->next;
+        write_client_buf(p, &h->out);
+        free(h);
+        p->next_reply_seq++;
+    }
+    if(p->fd != -1 && p->held == NULL && p->held_updates.len > 0){
+        write_client_buf(p, &p->held_updates);
+    }
+}
+
+/* Return -1 if the client is gone, or is dropped here for being slow. */
+static int check_slow(struct client *p){
+    if(p->fd == -1){
+        return -1;
+    }
+    if(disconnect_slow && p->out.len > outq_high_water){
+        fprintf(stderr, "client %s is too slow, disconnecting\n", p->name);
+        self->metrics.slow_disconnects++;
+        removeclient(p->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Bookkeeping after output has been added to the client's queue. */
+static void output_queued(struct client *p){
+    if(p->out.len > p->out_peak){
+        p->out_peak = p->out.len;
+    }
+    if(p->out.len > outq_high_water){
+        p->paused = 1;
+    }
+    if(!p->flush_pending){
+        p->flush_pending = 1;
+        p->next_flush = self->flush_list;
+        self->flush_list = p;
+    }
+}
+
+/* Queue a notification of activity on the poll called poll_name, which
+ * the client did not ask for. Unlike a reply this cannot be held back by
+ * not reading from the client, so a slow client just misses it.
+ */
+int notify_client(struct client *p, char *poll_name){
+    if(p->fd == -1){
+        return -1;
+    }
+    Buffer notice = {NULL};
+    if(p->binary){
+        bin_notify(&notice, poll_name);
+    } else {
+        buf_printf(&notice, announcement, poll_name);
+    }
+    if(!disconnect_slow && p->out.len > outq_high_water){
+        p->bytes_dropped += notice.len;
+        self->metrics.bytes_dropped += notice.len;
+        buf_clear(&notice);
+        return 0;
+    }
+    self->metrics.notifications++;
+    return write_client_buf(p, &notice);
+}
+
+/* Queue the len bytes of a watch update. While a reply is held the
+ * update waits behind it, since that reply may be the watch that starts
+ * the poll over. A slow client misses it like a notification, but once it
+ * has caught up it is sent the whole of every poll it watches, so it can
+ * carry on from there.
+ */
+int update_client(struct client *p, char *update, size_t len){
+    if(p->fd == -1){
+        return -1;
+    }
+    if(!disconnect_slow &&
+       p->out.len + p->held_updates.len > outq_high_water){
+        p->bytes_dropped += len;
+        self->metrics.bytes_dropped += len;
+        p->missed_updates = 1;
+        return 0;
+    }
+    self->metrics.updates++;
+    if(p->held != NULL){
+        buf_append(&p->held_updates, update, len);
+        return 0;
+    }
+    Buffer b = {NULL};
+    buf_append(&b, update, len);
+    return write_client_buf(p, &b);
+}
+
+/* Copy this worker's metrics into m, with the gauges filled in. */
+void collect_metrics(struct metrics *m){
+    Poll *poll;
+    struct client *p;
+    
+    *m = self->metrics;
+    m->polls = self->polls.count;
+    m->strings = self->polls.strings.strings;
+    m->string_bytes = self->polls.strings.bytes;
+    m->slab_records[SLAB_POLLS] = self->polls.poll_slab.in_use;
+    m->slab_capacity[SLAB_POLLS] = self->polls.poll_slab.capacity;
+    m->slab_records[SLAB_CLIENTS] = self->client_slab.in_use;
+    m->slab_capacity[SLAB_CLIENTS] = self->client_slab.capacity;
+    for(poll = self->polls.head; poll != NULL; poll = poll->next){
+        m->participants += poll->num_participants;
+        m->poll_bytes += poll->arena.bytes;
+    }
+    for(p = self->top; p != NULL; p = p->next){
+        m->queued_bytes += p->out.len;
+    }
+}
+
+/* Write out this worker's log records. Nothing a change caused, reply
+ * or notification, may leave before its record is on disk.
+ */
+static void commit_log(){
+    if(wal_fd == -1 || self->wal.len == 0){
+        return;
+    }
+    self->metrics.log_commits++;
+    if(wal_commit(wal_fd, &self->wal) == -1){
+        perror("write -- log");
+        exit(1);
+    }
+}
+
+/* Write as much of the client's queue as the socket will take. The log
+ * records behind the queue must already be committed.
+ */
+static void flush_client(struct client *p){
+    struct iovec iov[MAXIOV];
+    int n;
+    ssize_t written;
+    
+    while(p->fd != -1 && p->out.len > 0){
+        n = buf_iov(&p->out, iov, MAXIOV);
+        if((written = writev(p->fd, iov, n)) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                perror("write fail");
+                removeclient(p->fd);
+            }
+            // otherwise wait for the socket to become writable
+            return;
+        }
+        buf_consume(&p->out, written);
+        self->metrics.bytes_written += written;
+    }
+    // removed, here or earlier in this iteration, but still on the list
+    if(p->fd == -1){
+        return;
+    }
+    // caught up far enough to take commands again
+    if(p->paused && p->out.len <= outq_high_water / 2){
+        p->paused = 0;
+        if(p->missed_updates){
+            p->missed_updates = 0;
+            announce_resync(p);
+        }
+        // edge-triggered epoll will not report input that arrived while
+        // paused, so go and read it now
+        client_readable(p);
+        // what those commands queued may be flushed straight after this,
+        // so their records go out first
+        commit_log();
+    }
+}
+
+/* Flush every client that had output queued during this iteration. */
+static void flush_clients(){
+    while(self->flush_list != NULL){
+        struct client *p = self->flush_list;
+        self->flush_list = p->next_flush;
+        p->flush_pending = 0;
+        flush_client(p);
+    }
+}
+
+/* Open this worker's listening socket. With several workers each has its
+ * own socket on the port, and SO_REUSEPORT has the kernel share incoming
+ * connections between them.
+ */
 void bindandlisten(){
+    self->listenfd = open_listener(INADDR_ANY, PORT, num_workers > 1);
+}
+
+/* Return a non-blocking socket listening on addr and port, which other
+ * sockets may share if shared is set.
+ */
+static int open_listener(in_addr_t addr, int port, int shared){
     struct sockaddr_in r;
+    int listenfd;
     
     if((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
         perror("socket");
@@ -103,365 +915,864 @@ void bindandlisten(){
     if(status == -1) {
         perror("setsockopt -- REUSEADDR");
     }
+    if(shared &&
+       setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1){
+        perror("setsockopt -- REUSEPORT");
+        exit(1);
+    }
     
     memset(&r, '\0', sizeof(r));
     r.sin_family = AF_INET;
-    r.sin_addr.s_addr = INADDR_ANY;
-    r.sin_port = htons(PORT);
+    r.sin_addr.s_addr = addr;
+    r.sin_port = htons(port);
     
     if (bind(listenfd, (struct sockaddr *)&r, sizeof(r))){
         perror("bind");
     }
     
-    if(listen(listenfd, MAXCLIENT)){
+    if(listen(listenfd, listen_backlog)){
         perror("listen");
     }
-    
+    if(set_nonblocking(listenfd) == -1){
+        perror("fcntl -- O_NONBLOCK");
+    }
+    return listenfd;
 }
+/* Count a new client from addr against the limits. Return NULL if it
+ * may stay, or the message to turn it away with.
+ */
+static char *admit(struct in_addr addr){
+    if(max_clients > 0 && atomic_fetch_add(&total_clients, 1) >= max_clients){
+        atomic_fetch_sub(&total_clients, 1);
+        return "The server is full, try again later\r\n";
+    }
+    if(max_per_ip > 0){
+        struct ip_count *c;
+        char *refusal = NULL;
+        pthread_mutex_lock(&ip_lock);
+        struct ip_count **bucket = &ip_counts[addr.s_addr % IP_BUCKETS];
+        for(c = *bucket; c != NULL && c->addr.s_addr != addr.s_addr; c = c->next);
+        if(c == NULL){
+            if((c = calloc(1, sizeof(struct ip_count))) == NULL){
+                perror("calloc");
+                exit(1);
+            }
+            c->addr = addr;
+            c->next = *bucket;
+            *bucket = c;
+        }
+        if(c->count >= max_per_ip){
+            refusal = "Too many connections from your address\r\n";
+        } else {
+            c->count++;
+        }
+        pthread_mutex_unlock(&ip_lock);
+        if(refusal != NULL){
+            if(max_clients > 0){
+                atomic_fetch_sub(&total_clients, 1);
+            }
+            return refusal;
+        }
+    }
+    return NULL;
+}
+
+/* Undo admit for a client from addr that has gone. */
+static void release(struct in_addr addr){
+    if(max_clients > 0){
+        atomic_fetch_sub(&total_clients, 1);
+    }
+    if(max_per_ip > 0){
+        struct ip_count *c, **cp;
+        pthread_mutex_lock(&ip_lock);
+        for(cp = &ip_counts[addr.s_addr % IP_BUCKETS];
+            (c = *cp) != NULL && c->addr.s_addr != addr.s_addr; cp = &c->next);
+        if(c != NULL && --c->count == 0){
+            *cp = c->next;
+            free(c);
+        }
+        pthread_mutex_unlock(&ip_lock);
+    }
+}
+
 //code from example server
-//setup a connection from client
-void newconnection(){
-    int fd;
+//setup connections from clients, or from admins on the admin port. Takes
+//up to ACCEPT_BATCH of them; the listening sockets are level-triggered, so
+//any left over wake the loop again.
+static void newconnection(int listenfd, int admin){
+    int fd, i;
     struct sockaddr_in r;
-    socklen_t socklen = sizeof(r);
+    socklen_t socklen;
     char buf[30];
     
-    if((fd = accept(listenfd, (struct sockaddr *)&r, &socklen)) < 0){
-        perror("accept");
-    } else {
-        printf("connection from %s\n", inet_ntoa(r.sin_addr));
-        addclient(fd, r.sin_addr);
-        struct client *p;
-        for(p = top; p; p = p->next){
-            if(p->fd == fd){
-                break;
+    for(i = 0; i < ACCEPT_BATCH; i++){
+        socklen = sizeof(r);
+        if((fd = accept4(listenfd, (struct sockaddr *)&r, &socklen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                perror("accept");
             }
+            return;
         }
-        sprintf(buf, "What is your username?\r\n");
-        if(write(p->fd, buf, strlen(buf)) == -1){
-            perror("write fail");
-            removeclient(p->fd);
+#ifdef USE_SELECT
+        if(fd >= FD_SETSIZE){
+            fprintf(stderr, "fd %d is beyond FD_SETSIZE, dropping connection\n", fd);
+            close(fd);
+            continue;
+        }
+#endif
+        if(admin){
+            // admins have no username and only get the admin commands
+            struct client *p = addclient(fd, r.sin_addr);
+            p->admin = 1;
+            strcpy(p->name, "admin");
+            continue;
         }
+        char *refusal = admit(r.sin_addr);
+        if(refusal != NULL){
+            // one try at telling it why; the socket is new, so it has room
+            if(write(fd, refusal, strlen(refusal)) == -1){
+                // it will just see the connection close
+            }
+            close(fd);
+            self->metrics.rejected++;
+            continue;
+        }
+        printf("connection from %s\n", inet_ntoa(r.sin_addr));
+        struct client *p = addclient(fd, r.sin_addr);
+        self->metrics.connections++;
+        self->metrics.clients++;
+        sprintf(buf, "What is your username?\r\n");
+        write_client(p, buf, strlen(buf));
     }
 }
 
-static void addclient(int fd, struct in_addr addr){
-    struct client *p = malloc(sizeof(struct client));
-    
-    if(!p){
-        fprintf(stderr, "Out of memory!\n");
-        exit(1);
-    }
+static struct client *addclient(int fd, struct in_addr addr){
+    struct client *p = slab_alloc(&self->client_slab, sizeof(struct client));
     
     printf("Adding client %s\n", inet_ntoa(addr));
     fflush(stdout);
     
     p->fd = fd;
+    p->id = ++self->next_client_id;
     p->ipaddr = addr;
-    p->inbuf = 0;
-    p->room = sizeof(p->input);
-    p->after = p->input;
-    memset(p->input, '\0', sizeof(p->input));
-    p->next = top;
-    top = p;
+    p->name[0] = '\0';
+    p->binary = 0;
+    p->admin = 0;
+    if((p->input = malloc(INPUT_SIZE)) == NULL){
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    p->in_size = INPUT_SIZE;
+    p->in_start = 0;
+    p->in_end = 0;
+    p->in_scan = 0;
+    p->reading = 0;
+    p->drained = 0;
+    memset(&p->out, 0, sizeof(p->out));
+    p->paused = 0;
+    p->flush_pending = 0;
+    p->next_flush = NULL;
+    p->next_dead = NULL;
+    p->out_peak = 0;
+    p->bytes_dropped = 0;
+    p->missed_updates = 0;
+    p->next_cmd_seq = 0;
+    p->next_reply_seq = 0;
+    p->held = NULL;
+    memset(&p->held_updates, 0, sizeof(p->held_updates));
+    p->prev = NULL;
+    p->next = self->top;
+    if(self->top != NULL){
+        self->top->prev = p;
+    }
+    self->top = p;
+    
+    // grow the fd table so this fd has a slot
+    if(fd >= self->fdtab_size){
+        int new_size = self->fdtab_size ? self->fdtab_size : 64;
+        while(new_size <= fd){
+            new_size *= 2;
+        }
+        struct client **new_tab = realloc(self->fdtab, sizeof(struct client *) * new_size);
+        if(new_tab == NULL){
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        memset(new_tab + self->fdtab_size, 0,
+               sizeof(struct client *) * (new_size - self->fdtab_size));
+        self->fdtab = new_tab;
+        self->fdtab_size = new_size;
+    }
+    self->fdtab[fd] = p;
+    
+#ifndef USE_SELECT
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = p;
+    if(epoll_ctl(self->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1){
+        perror("epoll_ctl");
+    }
+#endif
+    return p;
 }
 
 static void removeclient(int fd){
+    struct client *client_to_delete = NULL;
     
-    struct client *prev_head = NULL;
-    struct client *client_to_delete;
-    struct client *client_to_delete_next;
-    struct client *client_iter = top;
-    //find the client to delete's next client
-    struct client *iter = top;
-    while(iter != NULL){
-        if(iter->fd == fd){
-            client_to_delete = iter;
-            client_to_delete_next = iter ->next;
-            break;
-        }
-        iter = iter->next;
+    if(fd >= 0 && fd < self->fdtab_size){
+        client_to_delete = self->fdtab[fd];
+    }
+    if(client_to_delete == NULL){
+        fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n", fd);
+        fflush(stderr);
+        return;
+    }
+    self->fdtab[fd] = NULL;
+    // every shard holds a session for a named client; tell them it's gone
+    if(strlen(client_to_delete->name) != 0 && !client_to_delete->admin){
+        announce_unbind(client_to_delete);
     }
+    if(!client_to_delete->admin){
+        self->metrics.clients--;
+        release(client_to_delete->ipaddr);
+    }
+    // closing the fd also drops it from the epoll set
     if(close(client_to_delete->fd) == -1){
         perror("closing client file descriptor");
         exit(1);
     }
-    
-    while(client_iter->next != NULL){
-        if((client_iter->next)->fd == fd){
-            prev_head = client_iter;
-            break;
-        }
-        client_iter = client_iter -> next;
+    // mark it dead so callers still holding the pointer stop using it
+    client_to_delete->fd = -1;
+    if(!client_to_delete->reading){
+        free(client_to_delete->input);
+        client_to_delete->input = NULL;
+    }
+    buf_clear(&client_to_delete->out);
+    while(client_to_delete->held != NULL){
+        struct held_reply *h = client_to_delete->held;
+        client_to_delete->held = h->next;
+        buf_clear(&h->out);
+        free(h);
     }
+    buf_clear(&client_to_delete->held_updates);
     
-    if(prev_head != NULL){
-        prev_head->next = client_to_delete_next;
-        printf("removing client %s we now have %d clients\n", client_to_delete->name, num_clients());
+    if(client_to_delete->prev != NULL){
+        client_to_delete->prev->next = client_to_delete->next;
+    } else {
+        self->top = client_to_delete->next;
+    }
+    if(client_to_delete->next != NULL){
+        client_to_delete->next->prev = client_to_delete->prev;
+    }
+    // the loop may still hold it, in an event or on the flush list, so it
+    // waits for reap_clients before the record is reused
+    client_to_delete->next_dead = self->dead;
+    self->dead = client_to_delete;
+    printf("removing client %s we now have %ld clients\n", client_to_delete->name,
+           self->metrics.clients);
+    if(client_to_delete->bytes_dropped > 0){
+        printf("client %s missed %lu bytes of notifications (queue peaked at %lu)\n",
+               client_to_delete->name, client_to_delete->bytes_dropped,
+               client_to_delete->out_peak);
+    }
+}
+
+/* Give the clients removed during this iteration back to the slab. */
+static void reap_clients(){
+    while(self->dead != NULL){
+        struct client *p = self->dead;
+        self->dead = p->next_dead;
+        free(p->input);
+        slab_free(&self->client_slab, p);
+    }
+}
+
+/* Make room at the end of the client's input for another read. Used up
+ * bytes are dropped by moving the unfinished line to the front, and the
+ * buffer only grows when that line fills all of it. Return -1, having
+ * dropped the client, if the line is longer than MAXLINE.
+ */
+static int input_room(struct client *p){
+    if(p->in_end < p->in_size){
+        return 0;
+    }
+    if(p->in_start > 0){
+        memmove(p->input, p->input + p->in_start, p->in_end - p->in_start);
+        p->in_end -= p->in_start;
+        p->in_scan -= p->in_start;
+        p->in_start = 0;
+        return 0;
+    }
+    if(p->in_size >= MAXLINE){
+        fprintf(stderr, "line from %s is too long, dropping client\n", p->name);
+        removeclient(p->fd);
+        return -1;
     }
+    char *bigger = realloc(p->input, p->in_size * 2);
+    if(bigger == NULL){
+        perror("realloc");
+        exit(1);
+    }
+    p->input = bigger;
+    p->in_size *= 2;
+    return 0;
+}
+
+/* Take the next complete command out of what has been read from the
+ * client, setting *len, or return NULL if there is none yet. A text
+ * command is a line, '\0' terminated in place of its newline; a binary
+ * one is a whole frame, header and all. A frame longer than MAXLINE drops
+ * the client.
+ */
+static char *next_command(struct client *p, long *len){
+    char *line = p->input + p->in_start;
     
-    else if(prev_head == NULL){
-        top = client_to_delete->next;
-        printf("removing client %s we now have %d clients\n", client_to_delete->name, num_clients());
+    if(p->binary){
+        *len = bin_frame_size(line, p->in_end - p->in_start, MAXLINE);
+        if(*len == -1){
+            fprintf(stderr, "frame from %s is too long, dropping client\n",
+                    p->name);
+            removeclient(p->fd);
+            return NULL;
+        }
+        if(*len == 0){
+            return NULL;
+        }
+        p->in_start = p->in_scan = p->in_start + *len;
+        return line;
     }
     
-    else {
-        fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n", fd);
-        fflush(stderr);
+    char *newline = memchr(p->input + p->in_scan, '\n', p->in_end - p->in_scan);
+    if(newline == NULL){
+        p->in_scan = p->in_end;
+        return NULL;
     }
+    *newline = '\0';
+    *len = newline - line;
+    p->in_start = p->in_scan = newline - p->input + 1;
+    return line;
 }
 
-static void broadcast(char *s, int size, Poll *poll){
-    //broadcast to all participants in the same poll to notify activity
-    struct client *p;
-    for(p = top; p; p = p->next){
-        if(find_part(p->name, poll) != NULL){
-            if(write(p->fd,s,size) == -1){
-                perror("write fail");
+/* Return the next complete command from the client, as next_command
+ * does. The command stays valid until the next call. Commands already
+ * buffered are handed out first, so a client that pipelines several in
+ * one packet gets them all run on this wakeup; the socket is only read
+ * once the buffer holds no complete command. The first line a client
+ * sends is its username, and starting it with BIN_HANDSHAKE switches the
+ * client to the binary protocol. Sets p->drained once the socket has no
+ * more data, and removes the client on EOF or error.
+ */
+char *read_client_input(struct client *p, long *len){
+    
+    char *line;
+    int got;
+    
+    if((line = next_command(p, len)) == NULL){
+        if(p->fd == -1){
+            return NULL;
+        }
+        // everything read has been used, so start again at the front
+        if(p->in_start == p->in_end){
+            p->in_start = p->in_end = p->in_scan = 0;
+        }
+        if(input_room(p) == -1){
+            return NULL;
+        }
+        if((got = read(p->fd, p->input + p->in_end, p->in_size - p->in_end)) == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                p->drained = 1;
+            } else if(errno != EINTR){
+                perror("read");
                 removeclient(p->fd);
             }
+            return NULL;
+        }
+        if(got == 0){
+            removeclient(p->fd);
+            return NULL;
+        }
+        self->metrics.bytes_read += got;
+        // only the new bytes can hold the newline
+        p->in_end += got;
+        if((line = next_command(p, len)) == NULL){
+            return NULL;
         }
     }
+    
+    if (!p->admin && strlen(p->name) == 0){
+        int binary = line[0] == BIN_HANDSHAKE;
+        // an empty line is no username, so keep waiting for one
+        if(line[binary] == '\0'){
+            return NULL;
+        }
+        p->binary = binary;
+        strncat(p->name, line + binary, MAXNAME - 1);
+        announce_bind(p);
+        if(p->binary){
+            Buffer out = {NULL};
+            bin_hello(&out);
+            write_client_buf(p, &out);
+        } else {
+            write_client(p, confirmation, strlen(confirmation));
+        }
+        return NULL;
+    }
+    return line;
 }
 
-int find_network_newline(char *buf, int inbuf){
+/* Put count words back together as one string with a space between each.
+ * The words follow each other in the input, so each slides down behind
+ * the one before.
+ */
+static char *join_words(char **words, int count) {
+    char *joined = words[0];
+    char *end = joined + strlen(joined);
     int i;
-    for(i = 0; i < inbuf; i++){
-        if(buf[i] == '\n'){
-            return i;
+    for (i = 1; i < count; i++) {
+        size_t len = strlen(words[i]);
+        *end++ = ' ';
+        if (end != words[i]) {
+            memmove(end, words[i], len);
         }
+        end += len;
     }
-    return -1;
+    *end = '\0';
+    return joined;
 }
 
-
-char *read_client_input(struct client *p){
-    
-    char *input = malloc(MAXINPUT);
-    int len;
-    input[0] = '\0';
-    int where;
+/* Apply the records of a vote_many (vote set) or comment_many to the poll
+ * named in cmd_argv[1]. From cmd_argv[2] on, a text command's records are
+ * separated by ";" words: a vote is a participant's name, availability
+ * string and any comment words, and a comment is a name and the comment's
+ * words. A binary one's records are as bin_decode lays them out, each
+ * every one of its fields with no separator, and an empty comment leaves
+ * a vote's comment be. The poll is found once, room for new participants
+ * is made before any are added, and its followers hear of the batch once,
+ * as for any other changes in this loop iteration. The reply counts the
+ * records applied and marks the ones that were not. Return the status, 1
+ * if there is no such poll.
+ */
+static int run_batch(int vote, int cmd_argc, char **cmd_argv, PollList *polls,
+                     int binary, Buffer *out) {
+    int opcode = vote ? BIN_VOTE_MANY : BIN_COMMENT_MANY;
+    int fields = vote ? 3 : 2;      // words in a binary record
+    uint64_t failed[AVAIL_WORDS(INPUT_ARG_MAX_NUM)];
+    int records = 1, applied = 0;
+    int start, end, i;
     
-    if (strlen(p->name) != 0 ){
-        if((len = read(p->fd, p->after, p->room)) == -1){
-            perror("read");
-            removeclient(p->fd);
-            return NULL;
+    Poll *poll = find_poll(cmd_argv[1], polls);
+    if (poll == NULL) {
+        if (binary) {
+            bin_status(out, opcode, 1);
+        } else {
+            buf_puts(out, vote ? "Poll by this name does not exist.\n"
+                               : "There is no poll with this name.\n");
         }
-        p->inbuf += len;
-        where = find_network_newline(p->input, p->inbuf);
-        
-        if(where >= 0){
-            
-            input[where] = '\n';
-            input[where+1] = '\0';
-            strcat(input, p->input);
-            
-            p->inbuf -= where + 2;
-            if(p->inbuf > 0){
-                memmove(p->input, &((p->input)[where + 2]), p->inbuf);
-            } else {
-                memset(p->input, '\0', sizeof(p->input));
-                p->inbuf = 0;
-            }
-            p->after = &((p->input)[p->inbuf]);
-            return input;
+        return 1;
+    }
+    if (binary) {
+        records = (cmd_argc - 2) / fields;
+    } else {
+        for (i = 2; i < cmd_argc - 1; i++) {
+            records += strcmp(cmd_argv[i], ";") == 0;
         }
-        
-        p->room = sizeof(p->input) - (p->inbuf);
-        p->after = &((p->input)[p->inbuf]);
-        return NULL;
     }
-    else{
-        if((len = read(p->fd, p->after, p->room)) == -1){
-            perror("read");
-            removeclient(p->fd);
-            return NULL;
+    if (vote) {
+        // as if every record were a new participant
+        reserve_participants(poll, polls, records);
+    }
+    memset(failed, 0, sizeof(failed));
+    records = 0;
+    for (start = 2; start < cmd_argc; start = binary ? end : end + 1) {
+        if (binary) {
+            end = start + fields;
+            if (end > cmd_argc) {
+                break;
+            }
+        } else {
+            for (end = start; end < cmd_argc && strcmp(cmd_argv[end], ";") != 0;
+                 end++);
         }
-        p->inbuf += len;
-        
-        where = find_network_newline(p->input, p->inbuf);
-        
-        if(where >= 0){
-            p->input[where] = '\0';
-            strncat(p->name, p->input, MAXNAME - 1);
-            p->inbuf -= where + 1;
-            if(p->inbuf > 0){
-                memmove(p->input, &((p->input)[where + 1]), p->inbuf);
-            } else {
-                memset(p->input, '\0', sizeof(p->input));
-                p->inbuf = 0;
+        char **record = &cmd_argv[start];
+        char *part_name = record[0];
+        int words = end - start;
+        char *comment = NULL;
+        Participant *part = NULL;
+        int added = 0;
+        if (binary) {
+            comment = record[fields - 1];
+            if (vote && *comment == '\0') {
+                comment = NULL;
             }
-            p->room = sizeof(p->input) - (p->inbuf);
-            p->after = &((p->input)[p->inbuf]);
-            
-            if(write(p->fd, confirmation, strlen(confirmation)) == -1){
-                perror("write fail");
-                removeclient(p->fd);
+        } else if (words > fields - 1) {
+            // any words after the availability or name are the comment
+            comment = join_words(&record[fields - 1], words - (fields - 1));
+        }
+        if (words >= 2 && vote) {
+            // set_vote cuts a long name short, for the log as well
+            part = set_vote(poll, polls, part_name, record[1], &added);
+            if (part != NULL && wal_fd != -1) {
+                wal_vote(&self->wal, poll->name, part_name, record[1]);
             }
-            return NULL;
+            if (part != NULL && added) {
+                subscribe_name(part_name, poll);
+            }
+        } else if (words >= 2) {
+            part = find_part(part_name, poll);
         }
-        
-        p->room = sizeof(p->input) - (p->inbuf);
-        p->after = &((p->input)[p->inbuf]);
-        return NULL;
+        if (part != NULL && comment != NULL) {
+            set_comment(poll, part, comment);
+            if (wal_fd != -1) {
+                wal_comment(&self->wal, poll->name, part_name, comment);
+            }
+        }
+        if (part != NULL) {
+            mark_changed(poll, part);
+            applied++;
+        } else {
+            failed[records / 64] |= (uint64_t)1 << (records % 64);
+        }
+        records++;
     }
+    if (vote && applied > 0) {
+        mark_active(poll);
+    }
+    
+    if (binary) {
+        bin_batch(out, opcode, applied, failed, records);
+    } else {
+        buf_printf(out, "%d of %d records applied\n", applied, records);
+        if (applied < records) {
+            buf_puts(out, "Failed records: ");
+            for (i = 0; i < records; i++) {
+                buf_puts(out, (failed[i / 64] >> (i % 64)) & 1 ? "1" : "0");
+            }
+            buf_puts(out, "\n");
+        }
+    }
+    return 0;
 }
 
-//process the tokenized user args and execute poll commands
-int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr, struct client *p) {
+/* Run one command against polls, the shard of the polls that hold
+ * cmd_argv[1], on behalf of the client called name. Anything to send back
+ * is added to out. Runs on the worker that owns the poll, which need not
+ * be the one holding the client. stamp is the new poll's place in
+ * creation order for create_poll, taken when the command was read. A
+ * binary client gets a BIN_REPLY frame for every command instead of the
+ * text, which is only written when there is something to say. Return the
+ * lists.c result, as the binary status, or BIN_BAD_REQUEST.
+ */
+int process_args(int cmd_argc, char **cmd_argv, PollList *polls, char *name,
+                 struct handle *client, unsigned long stamp, int binary,
+                 Buffer *out) {
+    int status = 0;
     
-    // some commands need the poll_list head and others
-    // require the address of that head
-    Poll *poll_list = *poll_list_ptr;
     if (cmd_argc <= 0) {
         return 0;
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
-        removeclient(p->fd);
-        
-    } else if (strcmp(cmd_argv[0], "list_polls") == 0 && cmd_argc == 1) {
-        char *buf = print_polls(poll_list);
-        //printf("%s", buf);
-        if(write(p->fd, buf, strlen(buf)) ==-1){
-            perror("write fail");
-            removeclient(p->fd);
-        }
-        free(buf);
-        
     } else if (strcmp(cmd_argv[0], "create_poll") == 0 && cmd_argc >= 3) {
         int label_count = cmd_argc - 2;
-        int result = create_poll(cmd_argv[1], &cmd_argv[2], label_count,
-        poll_list_ptr);
-        if (result == 1) {
-            if(write(p->fd, "Poll by this name already exists\n", strlen("Poll by this name already exists\n")) == -1){
-                perror("write fail");
-                removeclient(p->fd);
-            }
+        int result = create_poll_at(cmd_argv[1], &cmd_argv[2], label_count,
+        stamp, polls);
+        if (binary) {
+            bin_status(out, BIN_CREATE_POLL, result);
+        } else if (result == 1) {
+            buf_puts(out, "Poll by this name already exists\n");
+        }
+        if (result == 0 && wal_fd != -1) {
+            wal_create(&self->wal, cmd_argv[1], &cmd_argv[2], label_count);
         }
+        status = result;
         
     } else if (strcmp(cmd_argv[0], "vote") == 0 && cmd_argc == 3) {
-        char *participant_name = p->name; // name for clarity of code below
+        char *participant_name = name; // name for clarity of code below
         char *poll_name = cmd_argv[1];        // better name for clarity of code below
         
         // try to add participant to this poll
-        int return_code = add_participant(participant_name, poll_name, poll_list, cmd_argv[2]);
-        if (return_code == 1) {
-            if(write(p->fd, "Poll by this name does not exist.\n", strlen("Poll by this name does not exist.\n")) ==-1){
-                perror("write fail");
-                removeclient(p->fd);
-            }
+        int return_code = add_participant(participant_name, poll_name, polls, cmd_argv[2]);
+        if (return_code == 0) {
+            // a new participant, so clients using this name now follow the poll
+            subscribe_name(participant_name, find_poll(poll_name, polls));
         } else if (return_code == 2) {
             // this poll already has this client participating so don't add
             // instead just update the vote
-            return_code = update_availability(participant_name, poll_name, cmd_argv[2], poll_list);
+            return_code = update_availability(participant_name, poll_name, cmd_argv[2], polls);
         }
         // this could apply in either case
-        if (return_code == 3) {
-            if(write(p->fd, "Availability string is wrong size for this poll.\n", strlen("Availability string is wrong size for this poll.\n")) == -1){
-                perror("write fail");
-                removeclient(p->fd);
-            }
+        if (binary) {
+            bin_status(out, BIN_VOTE, return_code);
+        } else if (return_code == 1) {
+            buf_puts(out, "Poll by this name does not exist.\n");
+        } else if (return_code == 3) {
+            buf_puts(out, "Availability string is wrong size for this poll.\n");
+        } else if (return_code == 4) {
+            buf_puts(out, "Availability string must be only 0s and 1s.\n");
         }
         if(return_code == 0){
-            char buf[strlen(announcement) + MAXNAME];
-            sprintf(buf, "There has been new activity on poll %s\n", poll_name);
-            broadcast(buf, strlen(buf), find_poll(poll_name, poll_list));
+            Poll *poll = find_poll(poll_name, polls);
+            if(wal_fd != -1){
+                wal_vote(&self->wal, poll->name, participant_name, cmd_argv[2]);
+            }
+            mark_active(poll);
+            mark_changed(poll, find_part(participant_name, poll));
         }
+        status = return_code;
         
     } else if (strcmp(cmd_argv[0], "comment") == 0 && cmd_argc >= 3) {
-        // first determine how long a string we need
-        int space_needed = 0;
-        int i;
-        for (i=3; i<cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
-        }
-        // allocate the space
-        char *comment = malloc(space_needed);
-        if (comment == NULL) {
-            perror("malloc");
-            exit(1);
-        }
-        // copy in the bits to make a single string
-        strcpy(comment, cmd_argv[2]);
-        for (i=3; i<cmd_argc; i++) {
-            strcat(comment, " ");
-            strcat(comment, cmd_argv[i]);
-        }
-        
-        int return_code = add_comment(p->name, cmd_argv[1], comment,
-        poll_list);
-        // comment was only used as parameter so we are finished with it now
-        free(comment);
-        if (return_code == 1) {
-            if(write(p->fd, "There is no poll with this name.\n", strlen("There is no poll with this name.\n")) == -1){
-                perror("write fail");
-                removeclient(p->fd);
+        char *comment = join_words(&cmd_argv[2], cmd_argc - 2);
+        int return_code = add_comment(name, cmd_argv[1], comment,
+        polls);
+        if (return_code == 0) {
+            Poll *poll = find_poll(cmd_argv[1], polls);
+            if (wal_fd != -1) {
+                wal_comment(&self->wal, cmd_argv[1], name, comment);
             }
+            mark_changed(poll, find_part(name, poll));
+        }
+        if (binary) {
+            bin_status(out, BIN_COMMENT, return_code);
+        } else if (return_code == 1) {
+            buf_puts(out, "There is no poll with this name.\n");
         } else if (return_code == 2) {
-            if(write(p->fd, "You can't comment on a poll until you vote on it\n", strlen("You can't comment on a poll until you vote on it\n")) == -1){
-                perror("write fail");
-                removeclient(p->fd);
-            }
+            buf_puts(out, "You can't comment on a poll until you vote on it\n");
         }
+        status = return_code;
+        
+    } else if ((strcmp(cmd_argv[0], "vote_many") == 0 ||
+                strcmp(cmd_argv[0], "comment_many") == 0) && cmd_argc >= 3) {
+        status = run_batch(cmd_argv[0][0] == 'v', cmd_argc, cmd_argv, polls,
+                           binary, out);
         
     } else if (strcmp(cmd_argv[0], "delete_poll") == 0 && cmd_argc == 2) {
-        if (delete_poll(cmd_argv[1], poll_list_ptr) == 1) {
-            if(write(p->fd, "No poll by this name exists.\n", strlen("No poll by this name exists.\n")) == -1){
-                perror("write fail");
-                removeclient(p->fd);
+        Poll *poll = find_poll(cmd_argv[1], polls);
+        if (poll != NULL) {
+            drop_subscribers(poll);
+        }
+        int result = delete_poll(cmd_argv[1], polls);
+        if (binary) {
+            bin_status(out, BIN_DELETE_POLL, result);
+        } else if (result == 1) {
+            buf_puts(out, "No poll by this name exists.\n");
+        }
+        if (result == 0 && wal_fd != -1) {
+            wal_delete(&self->wal, cmd_argv[1]);
+        }
+        status = result;
+        
+    } else if (strcmp(cmd_argv[0], "results") == 0 && cmd_argc == 2) {
+        if (binary) {
+            Poll *poll = find_poll(cmd_argv[1], polls);
+            if (poll == NULL) {
+                bin_status(out, BIN_RESULTS, status = 1);
+            } else {
+                bin_results(out, poll);
             }
+        } else if((status = print_results(cmd_argv[1], polls, out)) == 1){
+            buf_puts(out, "No poll by this name exists\n");
         }
         
     } else if (strcmp(cmd_argv[0], "poll_info") == 0 && cmd_argc == 2) {
-        char *buf = print_poll_info(cmd_argv[1], poll_list);
-        if(buf == NULL){
-            if(write(p->fd, "No poll by this name exists\n", strlen("No poll by this name exists\n")) == -1){
-                perror("write fail");
-                removeclient(p->fd);
+        if (binary) {
+            Poll *poll = find_poll(cmd_argv[1], polls);
+            if (poll == NULL) {
+                bin_status(out, BIN_POLL_INFO, status = 1);
+            } else {
+                bin_poll_info(out, poll);
             }
+        } else if((status = print_poll_info(cmd_argv[1], polls, out)) == 1){
+            buf_puts(out, "No poll by this name exists\n");
         }
-        if(buf != NULL){
-            if(write(p->fd, buf, strlen(buf)) == -1){
-                perror("write fail");
-                removeclient(p->fd);
-            }
-            free(buf);
+        
+    } else if (strcmp(cmd_argv[0], "watch") == 0 && cmd_argc == 2) {
+        // the poll itself comes as the first update, so success says no more
+        Poll *poll = find_poll(cmd_argv[1], polls);
+        status = poll == NULL ? 1 : watch_poll(client, name, poll, binary, out);
+        if (binary) {
+            bin_status(out, BIN_WATCH, status);
+        } else if (status == 1) {
+            buf_puts(out, "No poll by this name exists\n");
+        } else if (status == 2) {
+            buf_puts(out, "Your session was not found, so you can't watch polls\n");
+        }
+        
+    } else if (strcmp(cmd_argv[0], "unwatch") == 0 && cmd_argc == 2) {
+        Poll *poll = find_poll(cmd_argv[1], polls);
+        status = poll == NULL ? 1 : unwatch_poll(client, name, poll);
+        if (binary) {
+            bin_status(out, BIN_UNWATCH, status);
+        } else if (status == 1) {
+            buf_puts(out, "No poll by this name exists\n");
+        } else if (status == 2) {
+            buf_puts(out, "You are not watching this poll\n");
         }
     }
     else {
-        if(write(p->fd, "Incorrect syntax\n", strlen("Incorrect syntax\n")) == -1){
-            perror("write fail");
-            removeclient(p->fd);
+        buf_puts(out, "Incorrect syntax\n");
+        status = BIN_BAD_REQUEST;
+    }
+    return status;
+}
+
+/* Commands that name a poll in cmd_argv[1] and so run on its shard. */
+static int poll_command(char *cmd){
+    static char *commands[] = {"create_poll", "vote", "comment",
+                               "delete_poll", "results", "poll_info",
+                               "watch", "unwatch", "vote_many",
+                               "comment_many"};
+    int i;
+    for(i = 0; i < (int)(sizeof(commands) / sizeof(commands[0])); i++){
+        if(strcmp(cmd, commands[i]) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Split line into words in place, ending each with a '\0' and pointing
+ * cmd_argv at it. Return the number of words, or INPUT_ARG_MAX_NUM + 1 if
+ * there are more than cmd_argv can hold.
+ */
+static int split_args(char *line, char **cmd_argv){
+    int cmd_argc = 0;
+    char *next = line;
+    
+    while(1){
+        next += strspn(next, DELIM);
+        if(*next == '\0'){
+            return cmd_argc;
+        }
+        if(cmd_argc == INPUT_ARG_MAX_NUM){
+            return INPUT_ARG_MAX_NUM + 1;
+        }
+        cmd_argv[cmd_argc++] = next;
+        next += strcspn(next, DELIM);
+        if(*next != '\0'){
+            *next++ = '\0';
+        }
+    }
+}
+
+/* Read list_polls [prefix] [after cursor] [limit N] into query. The
+ * prefix, if there is one, is the odd word out in front of the pairs.
+ * With no arguments at all the list is unpaged. Return 0, or -1 if the
+ * arguments are not of that form.
+ */
+static int parse_list_query(int cmd_argc, char **cmd_argv,
+                            struct list_query *query){
+    int i = 1;
+    memset(query, 0, sizeof(struct list_query));
+    query->paged = cmd_argc > 1;
+    if(cmd_argc % 2 == 0){
+        if(strlen(cmd_argv[1]) >= MAX_NAME){
+            return -1;
+        }
+        strcpy(query->prefix, cmd_argv[1]);
+        i++;
+    }
+    for(; i < cmd_argc; i += 2){
+        if(strcmp(cmd_argv[i], "after") == 0 &&
+           strlen(cmd_argv[i + 1]) < MAX_NAME){
+            strcpy(query->after, cmd_argv[i + 1]);
+        } else if(strcmp(cmd_argv[i], "limit") == 0){
+            char *end;
+            query->limit = strtol(cmd_argv[i + 1], &end, 10);
+            if(*end != '\0' || query->limit < 1 || query->limit > INT_MAX){
+                return -1;
+            }
+        } else {
+            return -1;
         }
     }
     return 0;
 }
 
-//tokenize user input to process later for poll commands
-int execute_poll_commands(char *input, struct client *p){
+/* The commands of the admin port. snapshot is one of them since every
+ * call forks the whole server.
+ */
+static void admin_command(int cmd_argc, char **cmd_argv, struct client *p,
+                          unsigned long seq, uint64_t started){
+    Buffer out = {NULL};
+    if(strcmp(cmd_argv[0], "stats") == 0 && cmd_argc == 1){
+        start_stats(p, seq, started);
+    } else if(strcmp(cmd_argv[0], "snapshot") == 0 && cmd_argc == 1){
+        if(start_snapshot() == 0){
+            buf_puts(&out, "Snapshot started\n");
+        } else if(snapshot_path == NULL){
+            buf_puts(&out, "Snapshots are not enabled\n");
+        } else {
+            buf_puts(&out, "A snapshot could not be started\n");
+        }
+        deliver_reply(p, seq, &out);
+    } else if(strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1){
+        removeclient(p->fd);
+    } else {
+        buf_puts(&out, "Admin commands are stats, snapshot and quit\n");
+        deliver_reply(p, seq, &out);
+    }
+}
+
+//tokenize user input, or decode a binary frame of len bytes, and run
+//it on the shard that owns the poll
+int execute_poll_commands(char *input, long len, struct client *p){
     char *cmd_argv[INPUT_ARG_MAX_NUM];
     int cmd_argc;
+    int opcode = 0;
+    struct list_query query;
+    uint64_t started = metrics_now();
     
-    char *next_token = strtok(input, DELIM);
-    cmd_argc = 0;
-    
-    while(next_token != NULL){
-        cmd_argv[cmd_argc] = next_token;
-        cmd_argc ++;
-        next_token = strtok(NULL, DELIM);
+    if(p->binary){
+        cmd_argc = bin_decode(input, len, &opcode, cmd_argv, INPUT_ARG_MAX_NUM);
+    } else {
+        cmd_argc = split_args(input, cmd_argv);
+        if(cmd_argc > 0){
+            opcode = bin_opcode(cmd_argv[0]);
+        }
+    }
+    if(cmd_argc == 0){
+        return 0;
     }
     
-    process_args(cmd_argc, cmd_argv, &poll_list, p);
-    free(input);
+    unsigned long seq = p->next_cmd_seq++;
+    if(p->admin && cmd_argc > 0 && cmd_argc <= INPUT_ARG_MAX_NUM){
+        admin_command(cmd_argc, cmd_argv, p, seq, started);
+    } else if(cmd_argc == -1 || cmd_argc > INPUT_ARG_MAX_NUM){
+        Buffer out = {NULL};
+        if(p->binary){
+            bin_status(&out, opcode, BIN_BAD_REQUEST);
+        } else {
+            buf_puts(&out, "Too many arguments\n");
+        }
+        count_command(&self->metrics, opcode, BIN_BAD_REQUEST, started);
+        deliver_reply(p, seq, &out);
+    } else if(strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1){
+        count_command(&self->metrics, opcode, 0, started);
+        removeclient(p->fd);
+    } else if(strcmp(cmd_argv[0], "list_polls") == 0 &&
+              parse_list_query(cmd_argc, cmd_argv, &query) == 0){
+        start_list(p, seq, started, &query);
+    } else {
+        // number polls as they are asked for, so a client's polls list in
+        // the order it created them whichever shards they land on
+        unsigned long stamp = 0;
+        if(strcmp(cmd_argv[0], "create_poll") == 0){
+            stamp = new_poll_seq();
+        }
+        if(cmd_argc >= 2 && poll_command(cmd_argv[0]) &&
+           shard_of(cmd_argv[1]) != self->id){
+            forward_command(p, seq, opcode, stamp, started,
+                            shard_of(cmd_argv[1]), cmd_argc, cmd_argv);
+        } else {
+            Buffer out = {NULL};
+            struct handle h = {self->id, p->fd, p->id};
+            int status = process_args(cmd_argc, cmd_argv, &self->polls, p->name,
+                                      &h, stamp, p->binary, &out);
+            count_command(&self->metrics, opcode, status, started);
+            deliver_reply(p, seq, &out);
+        }
+    }
     return 0;
 }
-
-int num_clients(){
-    struct client *p = top;
-    int count = 0;
-    while(p != NULL){
-        count += 1;
-        p = p->next;
-    }
-    return count;
-}
\ No newline at end of file
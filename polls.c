@@ -15,16 +15,27 @@ void error(char *msg) {
     fprintf(stderr, "Error: %s\n", msg);
 }
 
+/*
+ * Write everything in b to stdout and empty it.
+ */
+void print_buffer(Buffer *b) {
+    struct iovec iov[16];
+    int i, n;
+    while (b->len > 0) {
+        n = buf_iov(b, iov, 16);
+        for (i = 0; i < n; i++) {
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+            buf_consume(b, iov[i].iov_len);
+        }
+    }
+}
+
 /* 
  * Read and process poll commands
  * Return:  -1 for quit command
  *          0 otherwise
  */
-int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr) {
-
-    // some commands need the poll_list head and others
-    // require the address of that head
-    Poll *poll_list = *poll_list_ptr; 
+int process_args(int cmd_argc, char **cmd_argv, PollList *polls) {
 
     if (cmd_argc <= 0) {
         return 0;
@@ -32,14 +43,14 @@ int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr) {
         return -1;
         
     } else if (strcmp(cmd_argv[0], "list_polls") == 0 && cmd_argc == 1) {
-        char *buf = print_polls(poll_list);
-        printf("%s", buf);
-        free(buf);
+        Buffer out = {NULL};
+        print_polls(polls, &out);
+        print_buffer(&out);
         
     } else if (strcmp(cmd_argv[0], "create_poll") == 0 && cmd_argc >= 3) {
         int label_count = cmd_argc - 2;
         int result = create_poll(cmd_argv[1], &cmd_argv[2], label_count,
-                     poll_list_ptr);
+                     polls);
         if (result == 1) {
             error("Poll by this name already exists");
         }
@@ -49,21 +60,23 @@ int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr) {
         char *poll_name = cmd_argv[2];        // better name for clarity of code below
 
         // try to add participant to this poll  
-        int return_code = add_participant(participant_name, poll_name, poll_list, cmd_argv[3]);
+        int return_code = add_participant(participant_name, poll_name, polls, cmd_argv[3]);
         if (return_code == 1) {
             error("Poll by this name does not exist.");
         } else if (return_code == 2) {
             // this poll already has this client participating so don't add
             // instead just update the vote
-            return_code = update_availability(participant_name, poll_name, cmd_argv[3], poll_list); 
+            return_code = update_availability(participant_name, poll_name, cmd_argv[3], polls); 
         }
         // this could apply in either case
         if (return_code == 3) {
             error("Availability string is wrong size for this poll.");
+        } else if (return_code == 4) {
+            error("Availability string must be only 0s and 1s.");
         }
 
     } else if (strcmp(cmd_argv[0], "add_participant") == 0 && cmd_argc == 4) {
-        int return_code = add_participant(cmd_argv[1], cmd_argv[2], poll_list, 
+        int return_code = add_participant(cmd_argv[1], cmd_argv[2], polls, 
                                           cmd_argv[3]);
         if (return_code == 1) {
            error("Poll by this name does not exist.");
@@ -71,6 +84,8 @@ int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr) {
            error("This Poll already has a participant by this name.");
         } else if (return_code == 3) {
            error("Availability string is wrong size for this poll.");
+        } else if (return_code == 4) {
+           error("Availability string must be only 0s and 1s.");
         }
       
     } else if (strcmp(cmd_argv[0], "add_comment") == 0 && cmd_argc >= 4) {
@@ -94,7 +109,7 @@ int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr) {
         }
         
         int return_code = add_comment(cmd_argv[1], cmd_argv[2], comment, 
-                                      poll_list);
+                                      polls);
         // comment was only used as parameter so we are finished with it now
         free(comment);
 
@@ -105,19 +120,25 @@ int process_args(int cmd_argc, char **cmd_argv, Poll **poll_list_ptr) {
         }
 
     } else if (strcmp(cmd_argv[0], "delete_poll") == 0 && cmd_argc == 2) {
-        if (delete_poll(cmd_argv[1], poll_list_ptr) == 1) {
+        if (delete_poll(cmd_argv[1], polls) == 1) {
             error("No poll by this name exists.");
         }
 
+    } else if (strcmp(cmd_argv[0], "results") == 0 && cmd_argc == 2) {
+        Buffer out = {NULL};
+        if (print_results(cmd_argv[1], polls, &out) == 1) {
+            printf("No poll by this name exists\n");
+        } else {
+            print_buffer(&out);
+        }
+
     } else if (strcmp(cmd_argv[0], "poll_info") == 0 && cmd_argc == 2) {
-        char *buf = print_poll_info(cmd_argv[1], poll_list);
-        if(buf == NULL){
+        Buffer out = {NULL};
+        if (print_poll_info(cmd_argv[1], polls, &out) == 1) {
             printf("No poll by this name exists\n");
+        } else {
+            print_buffer(&out);
         }
-        if(buf != NULL){
-            printf("%s", buf);
-            free(buf);
-        }     
     }
      else {
         error("Incorrect syntax");
@@ -135,8 +156,9 @@ int main(int argc, char* argv[]) {
     char *cmd_argv[INPUT_ARG_MAX_NUM];
     int cmd_argc;
 
-    // Create the heads of the empty data structure
-    Poll *poll_list= NULL;
+    // Create the empty data structure
+    PollList poll_list;
+    memset(&poll_list, 0, sizeof(poll_list));
 
     if (batch_mode) {
         input_stream = fopen(argv[1], "r");
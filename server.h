@@ -0,0 +1,266 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include "lists.h"
+#include "buffer.h"
+#include "msgqueue.h"
+#include "metrics.h"
+
+/* Shared between the modules of poll_server. The server runs one worker
+ * thread per shard of the poll namespace; a poll lives on the worker
+ * picked by the hash of its name. Each worker accepts its own clients and
+ * runs its own event loop. Commands for a poll on another shard are sent
+ * there as messages and the reply comes back the same way.
+ */
+
+#define MAXNAME 32
+#define INPUT_SIZE 4096        // a client's first input buffer
+#define MAXLINE (64 * 1024)    // longest line a client may send
+#define INPUT_ARG_MAX_NUM 1024 // words in one command, so long comments fit
+
+/* Names a client to any worker: the worker that owns it, its fd there,
+ * and its id so a reused fd is not mistaken for the client that had it.
+ */
+struct handle {
+    int worker;
+    int fd;
+    unsigned long id;
+};
+
+/* A reply that came back before the reply to an earlier command. */
+struct held_reply {
+    unsigned long seq;
+    Buffer out;
+    struct held_reply *next;
+};
+
+struct client{
+    int fd;
+    unsigned long id;
+    struct in_addr ipaddr;
+    struct client *next;
+    struct client *prev;
+    char name[MAXNAME];
+    int binary;    // asked for the binary protocol, see binproto.h
+    int admin;     // came in on the admin port
+    // bytes read but not yet used are input[in_start..in_end); commands
+    // are split up where they lie, so the buffer only moves or grows when
+    // a line runs into its end
+    char *input;
+    int in_size;
+    int in_start;
+    int in_end;
+    int in_scan;   // no newline in input[in_start..in_scan); text only
+    int reading;   // input is in use, so removeclient must leave it
+    int drained;   // set once read() reports EAGAIN for this wakeup
+    Buffer out;             // replies and notifications not yet written
+    int paused;             // stopped reading because out is too full
+    int flush_pending;      // on the flush list for this loop iteration
+    struct client *next_flush;
+    struct client *next_dead;  // on the worker's dead list once removed
+    unsigned long out_peak;      // deepest out has been
+    unsigned long bytes_dropped; // notifications dropped while slow
+    int missed_updates;     // dropped a watch update since last caught up
+    // commands are numbered as they are read and replies are sent in that
+    // order, even when a command for another shard answers late
+    unsigned long next_cmd_seq;
+    unsigned long next_reply_seq;
+    struct held_reply *held;
+    Buffer held_updates;    // watch updates waiting for the held replies
+};
+
+/* A named client as one shard sees it. Every shard keeps a session for
+ * every connected client that has given its name, so it can subscribe
+ * the client to that shard's polls.
+ */
+struct session {
+    struct handle client;
+    char name[MAXNAME];
+    unsigned int hash;
+    // other sessions using the same name on this shard
+    struct session *next_same_name;
+    struct session *prev_same_name;
+    struct subscription *subs;   // this shard's polls the client follows
+};
+
+/* A session's interest in a poll. It sits on both the poll's subscriber
+ * list (or for a watch, the watch's list) and the session's own list so
+ * either side can drop it in O(1).
+ */
+struct subscription {
+    struct session *session;
+    Poll *poll;
+    int watch;    // sent the poll's changes rather than told of activity
+    int binary;   // for a watch, send them in the binary protocol
+    struct subscription *poll_next;
+    struct subscription *poll_prev;
+    struct subscription *session_next;
+    struct subscription *session_prev;
+};
+
+/* What a shard keeps for a poll while clients watch it: who they are,
+ * and what has changed since the last update went out.
+ */
+struct watch {
+    struct subscription *watchers;
+    unsigned long sent;        // poll version of the last update sent
+    Participant **changed;     // participants changed since, each once
+    int num_changed;
+    int changed_cap;
+    uint64_t *changed_rows;    // bit per participant row, set if in changed
+    int rows_words;
+    int *counts;               // slot counts as of the last update
+};
+
+// bits of Poll.notify_pending
+#define PENDING_ACTIVITY 1   // subscribers are to be told of activity
+#define PENDING_UPDATE 2     // watchers are to be sent the changes
+
+enum msg_type {
+    MSG_BIND,         // client has given its name
+    MSG_UNBIND,       // client has gone
+    MSG_COMMAND,      // run a command for a poll on this shard
+    MSG_REPLY,        // output of a forwarded command
+    MSG_NOTIFY,       // tell these clients of this worker about a poll
+    MSG_LIST,         // list this shard's polls matching a list_query
+    MSG_LIST_REPLY,   // one shard's part of a list
+    MSG_QUIESCE,      // stop at the barrier while a snapshot is forked
+    MSG_STATS,        // send a copy of this worker's metrics
+    MSG_STATS_REPLY,  // one worker's metrics
+    MSG_UPDATE,       // send these clients of this worker a watch update
+    MSG_RESYNC        // send a client full updates for all it watches here
+};
+
+/* What a list_polls asks for. Without paged it is every poll in creation
+ * order; with it, the polls in name order whose names start with prefix
+ * and sort after after, at most limit of them if limit is not 0.
+ */
+struct list_query {
+    int paged;
+    char prefix[MAX_NAME];
+    char after[MAX_NAME];
+    long limit;
+};
+
+/* One poll as reported by a shard for list_polls. */
+struct list_entry {
+    unsigned long seq;
+    char name[MAX_NAME];
+};
+
+struct message {
+    MQNode node;             // must stay first, see handle_inbox
+    struct message *next;    // outbox chain
+    int type;
+    int from;                // worker that sent it
+    struct handle client;
+    unsigned long seq;       // which of the client's commands this is for
+    unsigned long stamp;     // MSG_COMMAND: creation order for create_poll
+    int op;                  // MSG_COMMAND and REPLY: the command's opcode
+    int status;              // MSG_REPLY: what the command returned
+    uint64_t started;        // MSG_COMMAND and REPLY: when it was read
+    char name[MAXNAME];      // client name for MSG_BIND, UNBIND and COMMAND
+    int binary;              // MSG_COMMAND: reply in the binary protocol
+    int argc;                // MSG_COMMAND: argc strings packed in data
+    char *data;              // command args, poll name, update, list
+                             // entries or metrics
+    size_t len;              // bytes of data, or entries for a list reply
+    Buffer out;              // MSG_REPLY output
+    struct handle *targets;  // MSG_NOTIFY and UPDATE recipients
+    int num_targets;
+};
+
+/* A list_polls or stats waiting for the other shards' parts. */
+struct gather {
+    unsigned long request;
+    struct handle client;
+    unsigned long seq;
+    uint64_t started;             // when the command was read
+    int waiting;                  // shards yet to answer
+    struct list_query query;      // for list_polls, what to list
+    struct list_entry **parts;    // each shard's entries, in list order
+    long *counts;
+    struct metrics *metrics;      // for stats, the total so far
+    struct gather *next;
+};
+
+struct worker {
+    int id;
+    pthread_t thread;
+    int wakefd;          // eventfd others poke after queuing to inbox
+    MsgQueue inbox;
+    PollList polls;      // this worker's shard of the polls
+
+    // everything below is only touched by the worker's own thread
+    int listenfd;
+    int epollfd;
+    struct client *top;
+    // removed clients, given back to the slab at the end of the iteration
+    // once nothing still holds them
+    struct client *dead;
+    Slab client_slab;
+    // clients indexed by fd so an event can be mapped to its client
+    struct client **fdtab;
+    int fdtab_size;
+    unsigned long next_client_id;
+    // clients with queued output, flushed at the end of each iteration
+    struct client *flush_list;
+    NameIndex sessions;  // sessions by name, chained through next_same_name
+    // messages for each worker, handed over at the end of each iteration
+    struct message **outbox;
+    struct message **outbox_tail;
+    struct gather *gathers;
+    unsigned long next_request;
+    Buffer wal;          // log records waiting for the end of the iteration
+    Poll *pending;       // polls with activity to announce, see mark_active
+    uint64_t next_notify;   // when they may next be announced, if ticking
+    pid_t snapshot_pid;  // child writing a snapshot this worker started
+    struct timespec snapshot_start;
+    struct metrics metrics;
+};
+
+extern struct worker *workers;
+extern int num_workers;
+extern __thread struct worker *self;
+
+/* poll_server.c */
+struct client *find_client(struct handle *h);
+int notify_client(struct client *p, char *poll_name);
+int update_client(struct client *p, char *update, size_t len);
+void collect_metrics(struct metrics *m);
+void deliver_reply(struct client *p, unsigned long seq, Buffer *out);
+void quiesce();
+int process_args(int cmd_argc, char **cmd_argv, PollList *polls, char *name,
+                 struct handle *client, unsigned long stamp, int binary,
+                 Buffer *out);
+
+/* shard.c */
+int shard_of(char *poll_name);
+struct message *new_message(int type);
+void free_message(struct message *m);
+void send_message(int dest, struct message *m);
+void flush_outbox();
+void handle_inbox();
+void announce_bind(struct client *p);
+void announce_unbind(struct client *p);
+void forward_command(struct client *p, unsigned long seq, int op,
+                     unsigned long stamp, uint64_t started, int dest,
+                     int cmd_argc, char **cmd_argv);
+void start_list(struct client *p, unsigned long seq, uint64_t started,
+                struct list_query *query);
+void start_stats(struct client *p, unsigned long seq, uint64_t started);
+void subscribe_name(char *name, Poll *poll);
+void drop_subscribers(Poll *poll);
+void mark_active(Poll *poll);
+void mark_changed(Poll *poll, Participant *part);
+void notify_pending();
+int watch_poll(struct handle *client, char *name, Poll *poll, int binary,
+               Buffer *out);
+int unwatch_poll(struct handle *client, char *name, Poll *poll);
+void announce_resync(struct client *p);
+
+#endif
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "binproto.h"
+#include "check.h"
+
+/* Runs ./poll_server on PORT and talks to it over sockets, for what only
+ * shows from outside: what a client is sent and when the log is synced.
+ */
+
+#ifndef PORT
+#define PORT 11447
+#endif
+#define ADMIN_PORT (PORT + 1)
+#define VOTERS 16
+#define WAIT_MS 5000
+
+static pid_t server;
+static char log_path[] = "/tmp/server_test_log.XXXXXX";
+
+static void start_server() {
+    char admin[8];
+    int fd = mkstemp(log_path);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    snprintf(admin, sizeof(admin), "%d", ADMIN_PORT);
+    if ((server = fork()) == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (server == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl("./poll_server", "poll_server", "-l", log_path, "-a", admin,
+              (char *)NULL);
+        perror("./poll_server");
+        _exit(1);
+    }
+}
+
+static void stop_server() {
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    unlink(log_path);
+}
+
+// a connection to port, retried while the server starts up
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    int tries;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (tries = 0; tries < WAIT_MS / 10; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) {
+            perror("socket");
+            exit(1);
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    fprintf(stderr, "could not connect to port %d\n", port);
+    stop_server();
+    exit(1);
+}
+
+// read exactly len bytes, or fail the test if they do not come
+static void read_exact(int fd, char *buf, long len) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    long got = 0;
+    while (got < len) {
+        ssize_t n;
+        if (poll(&pfd, 1, WAIT_MS) != 1 || (n = read(fd, buf + got, len - got)) <= 0) {
+            fprintf(stderr, "server_test: expected %ld bytes, got %ld\n", len, got);
+            stop_server();
+            exit(1);
+        }
+        got += n;
+    }
+}
+
+// read up to and including a '\n', '\0' terminated in buf
+static void read_line(int fd, char *buf, long size) {
+    long len = 0;
+    do {
+        read_exact(fd, buf + len, 1);
+    } while (buf[len++] != '\n' && len < size - 1);
+    buf[len] = '\0';
+}
+
+static void send_all(int fd, const char *buf, long len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            perror("write");
+            stop_server();
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// send the frame built since bin_begin
+static void send_frame(int fd) {
+    Buffer out = {0};
+    struct iovec iov[16];
+    bin_end(&out);
+    while (out.len > 0) {
+        int i, n = buf_iov(&out, iov, 16);
+        for (i = 0; i < n; i++) {
+            send_all(fd, iov[i].iov_base, iov[i].iov_len);
+            buf_consume(&out, iov[i].iov_len);
+        }
+    }
+}
+
+// the next frame from fd into buf, returning its size with the header
+static long read_frame(int fd, char *buf, long size) {
+    unsigned char *len = (unsigned char *)buf;
+    read_exact(fd, buf, BIN_HEADER);
+    long total = ((long)len[0] << 24 | len[1] << 16 | len[2] << 8 | len[3]) +
+                 BIN_HEADER;
+    if (total > size) {
+        fprintf(stderr, "server_test: frame of %ld bytes\n", total);
+        stop_server();
+        exit(1);
+    }
+    read_exact(fd, buf + BIN_HEADER, total - BIN_HEADER);
+    return total;
+}
+
+// a binary client called name, past the prompt and the hello
+static int binary_client(char *name) {
+    char line[256];
+    int fd = connect_to(PORT);
+    read_line(fd, line, sizeof(line));
+    snprintf(line, sizeof(line), "%c%s\n", BIN_HANDSHAKE, name);
+    send_all(fd, line, strlen(line));
+    CHECK(read_frame(fd, line, sizeof(line)) == BIN_HEADER + 2);
+    CHECK((unsigned char)line[BIN_HEADER] == BIN_HELLO);
+    return fd;
+}
+
+// the status of the BIN_REPLY to opcode that is next on fd
+static int reply_status(int fd, int opcode) {
+    char frame[256];
+    long size = read_frame(fd, frame, sizeof(frame));
+    CHECK(size >= BIN_HEADER + 3);
+    CHECK((unsigned char)frame[BIN_HEADER] == BIN_REPLY);
+    CHECK(frame[BIN_HEADER + 1] == opcode);
+    return (unsigned char)frame[BIN_HEADER + 2];
+}
+
+// the value of the metric called name, from a stats command on admin
+static long metric(int admin, char *name) {
+    char stats[64 * 1024];
+    long len = 0;
+    send_all(admin, "stats\n", 6);
+    do {
+        if (len == sizeof(stats) - 1) {
+            break;
+        }
+        read_exact(admin, stats + len, 1);
+        stats[++len] = '\0';
+    } while (len < 6 || strcmp(stats + len - 6, "# EOF\n") != 0);
+    // the sample's line, not the # HELP and # TYPE lines naming it
+    char sample[128];
+    snprintf(sample, sizeof(sample), "\n%s ", name);
+    char *line = strstr(stats, sample);
+    CHECK(line != NULL);
+    return line != NULL ? atol(line + strlen(sample)) : -1;
+}
+
+static void send_create_poll(int fd, char *name) {
+    bin_begin(BIN_CREATE_POLL);
+    bin_str(name);
+    bin_u16(2);
+    bin_str("noon");
+    bin_str("one");
+    send_frame(fd);
+    CHECK(reply_status(fd, BIN_CREATE_POLL) == BIN_OK);
+}
+
+static void send_vote(int fd, char *poll_name) {
+    uint64_t avail = 1;
+    bin_begin(BIN_VOTE);
+    bin_str(poll_name);
+    bin_bitmap(&avail, 2);
+    send_frame(fd);
+}
+
+/* Votes that all arrive while the server waits are one group commit:
+ * their records go out with a single fdatasync, not one per client.
+ */
+static void test_group_commit(int admin) {
+    int voters[VOTERS];
+    char name[16];
+    int i, status;
+
+    for (i = 0; i < VOTERS; i++) {
+        snprintf(name, sizeof(name), "voter%d", i);
+        voters[i] = binary_client(name);
+    }
+    send_create_poll(voters[0], "lunch");
+    long before = metric(admin, "poll_log_commits_total");
+
+    // stopped, the server sees every vote ready on one wakeup
+    kill(server, SIGSTOP);
+    waitpid(server, &status, WUNTRACED);
+    for (i = 0; i < VOTERS; i++) {
+        send_vote(voters[i], "lunch");
+    }
+    kill(server, SIGCONT);
+    for (i = 0; i < VOTERS; i++) {
+        CHECK(reply_status(voters[i], BIN_VOTE) == BIN_OK);
+    }
+    CHECK(metric(admin, "poll_log_commits_total") == before + 1);
+    for (i = 0; i < VOTERS; i++) {
+        bin_begin(BIN_QUIT);
+        send_frame(voters[i]);
+        close(voters[i]);
+    }
+}
+
+/* A binary client asking about a poll that does not exist gets a
+ * BIN_REPLY frame and nothing else, which would break its framing.
+ */
+static void test_missing_poll() {
+    static const char reply[] = {0, 0, 0, 3, (char)BIN_REPLY, BIN_VOTE, 1};
+    char got[sizeof(reply)];
+    int fd = binary_client("nobody");
+
+    send_vote(fd, "nosuch");
+    read_exact(fd, got, sizeof(got));
+    CHECK(memcmp(got, reply, sizeof(reply)) == 0);
+    // and the next reply is where it should be
+    bin_begin(BIN_RESULTS);
+    bin_str("nosuch");
+    send_frame(fd);
+    CHECK(reply_status(fd, BIN_RESULTS) == 1);
+    bin_begin(BIN_QUIT);
+    send_frame(fd);
+    close(fd);
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+    start_server();
+    int admin = connect_to(ADMIN_PORT);
+    test_group_commit(admin);
+    test_missing_poll();
+    close(admin);
+    stop_server();
+    return check_result("server_test");
+}
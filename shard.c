@@ -0,0 +1,1030 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "server.h"
+#include "binproto.h"
+
+static void handle_message(struct message *m);
+static void bind_session(struct handle *h, char *name);
+static void resync_session(struct handle *h, char *name);
+static void unbind_session(struct handle *h, char *name);
+static void finish_gather(struct gather *g);
+static void free_watch(Poll *poll);
+static void send_update(Poll *poll, struct subscription *only, int kind,
+                        unsigned long from, Participant **parts,
+                        int num_parts, int *counts);
+
+static void *Calloc(size_t n, size_t size){
+    void *result = calloc(n, size);
+    if(result == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    return result;
+}
+
+/* Return the worker that owns the poll with this name. Poll names are
+ * stored cut down to MAX_NAME - 1 chars, so only those chars count.
+ */
+int shard_of(char *poll_name){
+    char key[MAX_NAME];
+    if(num_workers == 1){
+        return 0;
+    }
+    strncpy(key, poll_name, MAX_NAME - 1);
+    key[MAX_NAME - 1] = '\0';
+    return name_hash(key) % num_workers;
+}
+
+struct message *new_message(int type){
+    struct message *m = Calloc(1, sizeof(struct message));
+    m->type = type;
+    return m;
+}
+
+void free_message(struct message *m){
+    buf_clear(&m->out);
+    free(m->data);
+    free(m->targets);
+    free(m);
+}
+
+/* Send m to worker dest. Messages for other workers are held until the
+ * end of this loop iteration and then handed over together; a message
+ * for this worker is handled straight away.
+ */
+void send_message(int dest, struct message *m){
+    m->from = self->id;
+    if(dest == self->id){
+        handle_message(m);
+        return;
+    }
+    m->next = NULL;
+    if(self->outbox[dest] == NULL){
+        self->outbox[dest] = m;
+    } else {
+        self->outbox_tail[dest]->next = m;
+    }
+    self->outbox_tail[dest] = m;
+}
+
+/* Queue everything held for other workers and wake each of them once. */
+void flush_outbox(){
+    int dest;
+    for(dest = 0; dest < num_workers; dest++){
+        struct message *m = self->outbox[dest];
+        if(m == NULL){
+            continue;
+        }
+        while(m != NULL){
+            struct message *next = m->next;
+            mq_push(&workers[dest].inbox, &m->node);
+            m = next;
+        }
+        self->outbox[dest] = NULL;
+        self->outbox_tail[dest] = NULL;
+        uint64_t one = 1;
+        if(write(workers[dest].wakefd, &one, sizeof(one)) == -1){
+            perror("write -- eventfd");
+        }
+    }
+}
+
+/* Handle everything other workers have queued for this one. */
+void handle_inbox(){
+    uint64_t count;
+    MQNode *node;
+    // reset the wakeup before draining so a later push wakes us again
+    if(read(self->wakefd, &count, sizeof(count)) == -1){
+        // nothing pending is fine; the queue is checked regardless
+    }
+    while((node = mq_pop(&self->inbox)) != NULL){
+        handle_message((struct message *)node);
+    }
+}
+
+/* Tell every shard that p has given its name. */
+void announce_bind(struct client *p){
+    int i;
+    for(i = 0; i < num_workers; i++){
+        struct message *m = new_message(MSG_BIND);
+        m->client.worker = self->id;
+        m->client.fd = p->fd;
+        m->client.id = p->id;
+        strcpy(m->name, p->name);
+        send_message(i, m);
+    }
+}
+
+/* Tell every shard that p is going away. */
+void announce_unbind(struct client *p){
+    int i;
+    for(i = 0; i < num_workers; i++){
+        struct message *m = new_message(MSG_UNBIND);
+        m->client.worker = self->id;
+        m->client.fd = p->fd;
+        m->client.id = p->id;
+        strcpy(m->name, p->name);
+        send_message(i, m);
+    }
+}
+
+/* Have worker dest run this command for p. Its output comes back in a
+ * MSG_REPLY tagged with seq.
+ */
+void forward_command(struct client *p, unsigned long seq, int op,
+                     unsigned long stamp, uint64_t started, int dest,
+                     int cmd_argc, char **cmd_argv){
+    struct message *m = new_message(MSG_COMMAND);
+    size_t len = 0;
+    int i;
+    
+    m->client.worker = self->id;
+    m->client.fd = p->fd;
+    m->client.id = p->id;
+    m->seq = seq;
+    m->op = op;
+    m->stamp = stamp;
+    m->started = started;
+    m->binary = p->binary;
+    strcpy(m->name, p->name);
+    // pack the arguments one after another, each with its '\0'
+    for(i = 0; i < cmd_argc; i++){
+        len += strlen(cmd_argv[i]) + 1;
+    }
+    m->data = malloc(len);
+    if(m->data == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    m->len = 0;
+    for(i = 0; i < cmd_argc; i++){
+        strcpy(m->data + m->len, cmd_argv[i]);
+        m->len += strlen(cmd_argv[i]) + 1;
+    }
+    m->argc = cmd_argc;
+    send_message(dest, m);
+}
+
+/* Return this shard's polls matching query, in creation order or for a
+ * paged query name order, setting *count.
+ */
+static struct list_entry *list_shard(struct list_query *query, long *count){
+    PollList *polls = &self->polls;
+    long n = 0;
+    if(!query->paged){
+        struct list_entry *entries = Calloc(polls->count ? polls->count : 1,
+                                            sizeof(struct list_entry));
+        Poll *cur;
+        for(cur = polls->head; cur != NULL; cur = cur->next){
+            entries[n].seq = cur->seq;
+            strcpy(entries[n].name, cur->name);
+            n++;
+        }
+        *count = n;
+        return entries;
+    }
+    
+    // no shard can have more of the page than the whole page
+    long room = polls->count;
+    if(query->limit > 0 && query->limit < room){
+        room = query->limit;
+    }
+    Poll **page = Calloc(room ? room : 1, sizeof(Poll *));
+    struct list_entry *entries = Calloc(room ? room : 1,
+                                        sizeof(struct list_entry));
+    *count = page_polls(polls, query->prefix, query->after, room, page);
+    for(n = 0; n < *count; n++){
+        entries[n].seq = page[n]->seq;
+        strcpy(entries[n].name, page[n]->name);
+    }
+    free(page);
+    return entries;
+}
+
+/* Start collecting parts for p's command seq from every shard, this one
+ * included, by sending each of the others a message of this type with a
+ * copy of the len bytes at data, if any.
+ */
+static struct gather *new_gather(struct client *p, unsigned long seq,
+                                 uint64_t started, int type,
+                                 const void *data, size_t len){
+    struct gather *g = Calloc(1, sizeof(struct gather));
+    g->request = ++self->next_request;
+    g->client.worker = self->id;
+    g->client.fd = p->fd;
+    g->client.id = p->id;
+    g->seq = seq;
+    g->started = started;
+    g->waiting = num_workers - 1;
+    g->next = self->gathers;
+    self->gathers = g;
+    
+    int i;
+    for(i = 0; i < num_workers; i++){
+        if(i != self->id){
+            struct message *m = new_message(type);
+            m->seq = g->request;
+            if(data != NULL){
+                m->data = malloc(len);
+                if(m->data == NULL){
+                    perror("malloc");
+                    exit(1);
+                }
+                memcpy(m->data, data, len);
+                m->len = len;
+            }
+            send_message(i, m);
+        }
+    }
+    return g;
+}
+
+/* Answer list_polls for p. With more than one shard each shard lists its
+ * own polls and the parts are merged back into creation order, or for a
+ * paged list into name order.
+ */
+void start_list(struct client *p, unsigned long seq, uint64_t started,
+                struct list_query *query){
+    if(num_workers == 1 && !query->paged){
+        Buffer out = {NULL};
+        if(p->binary){
+            Poll *cur;
+            bin_begin(BIN_REPLY);
+            bin_u8(BIN_LIST_POLLS);
+            bin_u8(BIN_OK);
+            bin_u32(self->polls.count);
+            for(cur = self->polls.head; cur != NULL; cur = cur->next){
+                bin_str(cur->name);
+            }
+            bin_end(&out);
+        } else {
+            print_polls(&self->polls, &out);
+        }
+        count_command(&self->metrics, BIN_LIST_POLLS, 0, started);
+        deliver_reply(p, seq, &out);
+        return;
+    }
+    
+    // the requests wait in the outbox until this returns, so no answer
+    // can come back before the parts are set up
+    struct gather *g = new_gather(p, seq, started, MSG_LIST,
+                                  query, sizeof(struct list_query));
+    g->query = *query;
+    g->parts = Calloc(num_workers, sizeof(struct list_entry *));
+    g->counts = Calloc(num_workers, sizeof(long));
+    g->parts[self->id] = list_shard(query, &g->counts[self->id]);
+    if(num_workers == 1){
+        self->gathers = g->next;
+        finish_gather(g);
+    }
+}
+
+/* Answer stats for p with the metrics of every worker added up. */
+void start_stats(struct client *p, unsigned long seq, uint64_t started){
+    struct metrics *total = Calloc(1, sizeof(struct metrics));
+    collect_metrics(total);
+    if(num_workers == 1){
+        Buffer out = {NULL};
+        metrics_print(&out, total, num_workers);
+        free(total);
+        deliver_reply(p, seq, &out);
+        return;
+    }
+    struct gather *g = new_gather(p, seq, started, MSG_STATS, NULL, 0);
+    g->metrics = total;
+}
+
+/* Every worker has answered the stats gather g: reply with the total. */
+static void finish_stats(struct gather *g){
+    Buffer out = {NULL};
+    struct client *p = find_client(&g->client);
+    if(p != NULL){
+        metrics_print(&out, g->metrics, num_workers);
+        deliver_reply(p, g->seq, &out);
+    }
+    free(g->metrics);
+    free(g);
+}
+
+/* Does entry a come before entry b in the list query asks for? */
+static int list_before(struct list_query *query, struct list_entry *a,
+                       struct list_entry *b){
+    if(query->paged){
+        return strcmp(a->name, b->name) < 0;
+    }
+    return a->seq < b->seq;
+}
+
+/* Every shard has answered: merge the parts and reply. */
+static void finish_gather(struct gather *g){
+    if(g->metrics != NULL){
+        finish_stats(g);
+        return;
+    }
+    
+    long *pos = Calloc(num_workers, sizeof(long));
+    Buffer out = {NULL};
+    int i;
+    
+    // each part is in order and within the limit, so the merge is too
+    // once it stops at the limit
+    long total = 0;
+    for(i = 0; i < num_workers; i++){
+        total += g->counts[i];
+    }
+    if(g->query.limit > 0 && g->query.limit < total){
+        total = g->query.limit;
+    }
+    
+    struct client *p = find_client(&g->client);
+    count_command(&self->metrics, BIN_LIST_POLLS, 0, g->started);
+    int binary = p != NULL && p->binary;
+    if(binary){
+        bin_begin(BIN_REPLY);
+        bin_u8(BIN_LIST_POLLS);
+        bin_u8(BIN_OK);
+        bin_u32(total);
+    }
+    long n;
+    for(n = 0; n < total; n++){
+        int best = -1;
+        for(i = 0; i < num_workers; i++){
+            if(pos[i] < g->counts[i] &&
+               (best == -1 || list_before(&g->query, &g->parts[i][pos[i]],
+                                          &g->parts[best][pos[best]]))){
+                best = i;
+            }
+        }
+        if(binary){
+            bin_str(g->parts[best][pos[best]].name);
+        } else {
+            buf_puts(&out, g->parts[best][pos[best]].name);
+            buf_append(&out, "\n", 1);
+        }
+        pos[best]++;
+    }
+    if(binary){
+        bin_end(&out);
+    }
+    
+    if(p != NULL){
+        deliver_reply(p, g->seq, &out);
+    }
+    buf_clear(&out);
+    for(i = 0; i < num_workers; i++){
+        free(g->parts[i]);
+    }
+    free(pos);
+    free(g->parts);
+    free(g->counts);
+    free(g);
+}
+
+static void handle_message(struct message *m){
+    struct client *p;
+    int i;
+    
+    switch(m->type){
+        case MSG_BIND:
+            bind_session(&m->client, m->name);
+            break;
+        case MSG_UNBIND:
+            unbind_session(&m->client, m->name);
+            break;
+        case MSG_COMMAND: {
+            char *cmd_argv[INPUT_ARG_MAX_NUM];
+            char *arg = m->data;
+            for(i = 0; i < m->argc; i++){
+                cmd_argv[i] = arg;
+                arg += strlen(arg) + 1;
+            }
+            struct message *reply = new_message(MSG_REPLY);
+            reply->status = process_args(m->argc, cmd_argv, &self->polls,
+                                         m->name, &m->client, m->stamp,
+                                         m->binary, &reply->out);
+            reply->client = m->client;
+            reply->seq = m->seq;
+            reply->op = m->op;
+            reply->started = m->started;
+            send_message(m->from, reply);
+            break;
+        }
+        case MSG_REPLY:
+            count_command(&self->metrics, m->op, m->status, m->started);
+            if((p = find_client(&m->client)) != NULL){
+                deliver_reply(p, m->seq, &m->out);
+            }
+            break;
+        case MSG_NOTIFY:
+            for(i = 0; i < m->num_targets; i++){
+                if((p = find_client(&m->targets[i])) != NULL){
+                    notify_client(p, m->data);
+                }
+            }
+            break;
+        case MSG_LIST: {
+            struct message *reply = new_message(MSG_LIST_REPLY);
+            long count;
+            reply->data = (char *)list_shard((struct list_query *)m->data,
+                                             &count);
+            reply->len = count;
+            reply->seq = m->seq;
+            send_message(m->from, reply);
+            break;
+        }
+        case MSG_UPDATE:
+            for(i = 0; i < m->num_targets; i++){
+                if((p = find_client(&m->targets[i])) != NULL){
+                    update_client(p, m->data, m->len);
+                }
+            }
+            break;
+        case MSG_RESYNC:
+            resync_session(&m->client, m->name);
+            break;
+        case MSG_QUIESCE:
+            quiesce();
+            break;
+        case MSG_STATS: {
+            struct message *reply = new_message(MSG_STATS_REPLY);
+            reply->data = Calloc(1, sizeof(struct metrics));
+            collect_metrics((struct metrics *)reply->data);
+            reply->seq = m->seq;
+            send_message(m->from, reply);
+            break;
+        }
+        case MSG_LIST_REPLY:
+        case MSG_STATS_REPLY: {
+            struct gather **gp;
+            for(gp = &self->gathers; *gp != NULL; gp = &(*gp)->next){
+                struct gather *g = *gp;
+                if(g->request == m->seq){
+                    if(m->type == MSG_STATS_REPLY){
+                        metrics_add(g->metrics, (struct metrics *)m->data);
+                    } else {
+                        // take the entries over from the message
+                        g->parts[m->from] = (struct list_entry *)m->data;
+                        g->counts[m->from] = m->len;
+                        m->data = NULL;
+                    }
+                    if(--g->waiting == 0){
+                        *gp = g->next;
+                        finish_gather(g);
+                    }
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    free_message(m);
+}
+
+/* The list a subscription sits on at its poll's end. */
+static struct subscription **poll_list(struct subscription *sub){
+    return sub->watch ? &sub->poll->watch->watchers : &sub->poll->subscribers;
+}
+
+static struct subscription *subscribe(struct session *s, Poll *poll,
+                                      int watch){
+    struct subscription *sub = Calloc(1, sizeof(struct subscription));
+    sub->session = s;
+    sub->poll = poll;
+    sub->watch = watch;
+    struct subscription **head = poll_list(sub);
+    sub->poll_prev = NULL;
+    sub->poll_next = *head;
+    if(*head != NULL){
+        (*head)->poll_prev = sub;
+    }
+    *head = sub;
+    sub->session_prev = NULL;
+    sub->session_next = s->subs;
+    if(s->subs != NULL){
+        s->subs->session_prev = sub;
+    }
+    s->subs = sub;
+    return sub;
+}
+
+static void unsubscribe(struct subscription *sub){
+    if(sub->poll_prev != NULL){
+        sub->poll_prev->poll_next = sub->poll_next;
+    } else {
+        *poll_list(sub) = sub->poll_next;
+    }
+    if(sub->poll_next != NULL){
+        sub->poll_next->poll_prev = sub->poll_prev;
+    }
+    if(sub->session_prev != NULL){
+        sub->session_prev->session_next = sub->session_next;
+    } else {
+        sub->session->subs = sub->session_next;
+    }
+    if(sub->session_next != NULL){
+        sub->session_next->session_prev = sub->session_prev;
+    }
+    if(sub->watch && sub->poll->watch->watchers == NULL){
+        free_watch(sub->poll);
+    }
+    free(sub);
+}
+
+/* A client has given its name: record its session on this shard and
+ * subscribe it to every poll here that name has voted in.
+ */
+static void bind_session(struct handle *h, char *name){
+    struct session *s = Calloc(1, sizeof(struct session));
+    s->client = *h;
+    strcpy(s->name, name);
+    s->hash = name_hash(s->name);
+    
+    // go just behind the indexed session so the index entry stays put
+    struct session *same = index_find(&self->sessions, s->name, s->hash);
+    s->prev_same_name = same;
+    if(same == NULL){
+        s->next_same_name = NULL;
+        index_insert(&self->sessions, s->name, s->hash, s);
+    } else {
+        s->next_same_name = same->next_same_name;
+        if(same->next_same_name != NULL){
+            same->next_same_name->prev_same_name = s;
+        }
+        same->next_same_name = s;
+    }
+    
+    Participant *part;
+    for(part = find_user_parts(s->name, &self->polls); part != NULL;
+        part = part->next_same_name){
+        subscribe(s, part->poll, 0);
+    }
+}
+
+/* Return the session of the client h, called name, or NULL. */
+static struct session *find_session(struct handle *h, char *name){
+    struct session *s;
+    for(s = index_find(&self->sessions, name, name_hash(name)); s != NULL;
+        s = s->next_same_name){
+        if(s->client.worker == h->worker && s->client.fd == h->fd &&
+           s->client.id == h->id){
+            break;
+        }
+    }
+    return s;
+}
+
+/* Undo bind_session for a client that has gone. */
+static void unbind_session(struct handle *h, char *name){
+    unsigned int hash = name_hash(name);
+    struct session *s = find_session(h, name);
+    if(s == NULL){
+        return;
+    }
+    while(s->subs != NULL){
+        unsubscribe(s->subs);
+    }
+    if(s->prev_same_name != NULL){
+        s->prev_same_name->next_same_name = s->next_same_name;
+    } else {
+        index_remove(&self->sessions, s->name, hash, s);
+        if(s->next_same_name != NULL){
+            index_insert(&self->sessions, s->next_same_name->name, hash,
+                         s->next_same_name);
+        }
+    }
+    if(s->next_same_name != NULL){
+        s->next_same_name->prev_same_name = s->prev_same_name;
+    }
+    free(s);
+}
+
+/* name has just joined poll, so every client using that name follows it. */
+void subscribe_name(char *name, Poll *poll){
+    struct session *s;
+    for(s = index_find(&self->sessions, name, name_hash(name)); s != NULL;
+        s = s->next_same_name){
+        subscribe(s, poll, 0);
+    }
+}
+
+/* poll is about to be deleted, so nobody can follow it any more. */
+void drop_subscribers(Poll *poll){
+    Poll **pp;
+    while(poll->subscribers != NULL){
+        unsubscribe(poll->subscribers);
+    }
+    if(poll->watch != NULL){
+        send_update(poll, NULL, BIN_UPDATE_DELETED, poll->watch->sent,
+                    NULL, 0, NULL);
+        while(poll->watch != NULL){
+            unsubscribe(poll->watch->watchers);
+        }
+    }
+    if(poll->notify_pending){
+        for(pp = &self->pending; *pp != poll; pp = &(*pp)->next_pending);
+        *pp = poll->next_pending;
+        poll->notify_pending = 0;
+    }
+}
+
+/* Tell every client following poll that there has been activity on it.
+ * Clients of this worker are told directly; the rest are batched into
+ * one message per worker, which carries the poll's name.
+ */
+static void broadcast(Poll *poll){
+    struct message **notices = NULL;
+    struct subscription *sub, *next;
+    int i, fanout = 0;
+    
+    for(sub = poll->subscribers; sub != NULL; sub = next){
+        // writing can drop the client and with it this subscription
+        next = sub->poll_next;
+        fanout++;
+        struct handle *h = &sub->session->client;
+        if(h->worker == self->id){
+            struct client *p = find_client(h);
+            if(p != NULL){
+                notify_client(p, poll->name);
+            }
+            continue;
+        }
+        if(notices == NULL){
+            notices = Calloc(num_workers, sizeof(struct message *));
+        }
+        struct message *m = notices[h->worker];
+        if(m == NULL){
+            m = notices[h->worker] = new_message(MSG_NOTIFY);
+            m->data = strdup(poll->name);
+            if(m->data == NULL){
+                perror("strdup");
+                exit(1);
+            }
+            m->len = strlen(poll->name) + 1;
+        }
+        // grow the target list by doubling from 4
+        if(m->num_targets == 0 ||
+           (m->num_targets >= 4 && (m->num_targets & (m->num_targets - 1)) == 0)){
+            int room = m->num_targets ? m->num_targets * 2 : 4;
+            m->targets = realloc(m->targets, sizeof(struct handle) * room);
+            if(m->targets == NULL){
+                perror("realloc");
+                exit(1);
+            }
+        }
+        m->targets[m->num_targets++] = *h;
+    }
+    hist_add(&self->metrics.fanout, fanout);
+    if(notices != NULL){
+        for(i = 0; i < num_workers; i++){
+            if(notices[i] != NULL){
+                send_message(i, notices[i]);
+            }
+        }
+        free(notices);
+    }
+}
+
+/* Have notify_pending see to poll for the reasons in bits. */
+static void queue_pending(Poll *poll, int bits){
+    if(poll->notify_pending & bits){
+        self->metrics.coalesced++;
+    }
+    if(poll->notify_pending == 0){
+        poll->next_pending = self->pending;
+        self->pending = poll;
+    }
+    poll->notify_pending |= bits;
+}
+
+/* Note activity on poll. Its followers are told by notify_pending, once
+ * however many changes there were since they were last told.
+ */
+void mark_active(Poll *poll){
+    queue_pending(poll, PENDING_ACTIVITY);
+}
+
+/* Note that part of poll has changed: its availability or its comment.
+ * Anyone watching the poll is sent the row by notify_pending.
+ */
+void mark_changed(Poll *poll, Participant *part){
+    struct watch *w = poll->watch;
+    poll->version++;
+    if(w == NULL){
+        return;
+    }
+    int word = part->row / 64;
+    uint64_t bit = (uint64_t)1 << (part->row % 64);
+    if(word >= w->rows_words){
+        int words = w->rows_words ? w->rows_words : 1;
+        while(words <= word){
+            words *= 2;
+        }
+        w->changed_rows = realloc(w->changed_rows, sizeof(uint64_t) * words);
+        if(w->changed_rows == NULL){
+            perror("realloc");
+            exit(1);
+        }
+        memset(w->changed_rows + w->rows_words, 0,
+               sizeof(uint64_t) * (words - w->rows_words));
+        w->rows_words = words;
+    }
+    if(!(w->changed_rows[word] & bit)){
+        w->changed_rows[word] |= bit;
+        if(w->num_changed == w->changed_cap){
+            w->changed_cap = w->changed_cap ? w->changed_cap * 2 : 8;
+            w->changed = realloc(w->changed,
+                                 sizeof(Participant *) * w->changed_cap);
+            if(w->changed == NULL){
+                perror("realloc");
+                exit(1);
+            }
+        }
+        w->changed[w->num_changed++] = part;
+    }
+    queue_pending(poll, PENDING_UPDATE);
+}
+
+/* Start keeping track of changes to poll for its first watcher. */
+static struct watch *new_watch(Poll *poll){
+    struct watch *w = Calloc(1, sizeof(struct watch));
+    w->sent = poll->version;
+    w->counts = Calloc(poll->num_slots ? poll->num_slots : 1, sizeof(int));
+    memcpy(w->counts, poll->slot_counts, sizeof(int) * poll->num_slots);
+    poll->watch = w;
+    return w;
+}
+
+/* The last watcher of poll has gone. */
+static void free_watch(Poll *poll){
+    struct watch *w = poll->watch;
+    free(w->changed);
+    free(w->changed_rows);
+    free(w->counts);
+    free(w);
+    poll->watch = NULL;
+}
+
+/* Copy what b holds into one block, setting *len, and empty b. */
+static char *flatten(Buffer *b, size_t *len){
+    struct iovec iov[16];
+    char *data = malloc(b->len ? b->len : 1);
+    int i, n;
+    if(data == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    *len = 0;
+    while(b->len > 0){
+        n = buf_iov(b, iov, 16);
+        size_t taken = 0;
+        for(i = 0; i < n; i++){
+            memcpy(data + *len + taken, iov[i].iov_base, iov[i].iov_len);
+            taken += iov[i].iov_len;
+        }
+        *len += taken;
+        buf_consume(b, taken);
+    }
+    return data;
+}
+
+/* Add an update to poll of this kind, from version from to the poll's
+ * current version, to out in the text or binary protocol. It holds the
+ * num_parts participants in parts and the slots whose counts differ from
+ * counts, or every slot if counts is NULL.
+ */
+static void add_update(Buffer *out, Poll *poll, int kind, unsigned long from,
+                       int binary, Participant **parts, int num_parts,
+                       int *counts){
+    int i;
+    if(binary){
+        bin_update(out, poll, kind, from, poll->version, parts, num_parts,
+                   counts);
+        return;
+    }
+    if(kind == BIN_UPDATE_FULL){
+        buf_printf(out, "Watching poll %s version %lu\n", poll->name,
+                   poll->version);
+        print_poll_info(poll->name, &self->polls, out);
+    } else {
+        buf_printf(out, "Update to poll %s version %lu from %lu\n",
+                   poll->name, poll->version, from);
+    }
+    if(kind == BIN_UPDATE_DELETED){
+        buf_puts(out, "This poll has been deleted\n");
+    } else {
+        for(i = 0; i < num_parts && kind != BIN_UPDATE_FULL; i++){
+            print_participant(poll, parts[i], out);
+        }
+        for(i = 0; i < poll->num_slots; i++){
+            if(counts == NULL || counts[i] != poll->slot_counts[i]){
+                buf_printf(out, "  %s: %d\r\n", poll->slot_labels[i],
+                           poll->slot_counts[i]);
+            }
+        }
+    }
+    buf_puts(out, "End of update\n");
+}
+
+/* Render an update as add_update would add it, in one block of *len
+ * bytes that can be copied to each watcher.
+ */
+static char *render_update(Poll *poll, int kind, unsigned long from,
+                           int binary, Participant **parts, int num_parts,
+                           int *counts, size_t *len){
+    Buffer out = {NULL};
+    add_update(&out, poll, kind, from, binary, parts, num_parts, counts);
+    return flatten(&out, len);
+}
+
+/* Send an update to poll's watchers, or only to the watcher only if it
+ * is not NULL. Each form is rendered at most once; clients of this
+ * worker get it directly and the rest in one message per worker and form.
+ */
+static void send_update(Poll *poll, struct subscription *only, int kind,
+                        unsigned long from, Participant **parts,
+                        int num_parts, int *counts){
+    char *rendered[2] = {NULL, NULL};
+    size_t len[2];
+    struct message **notices = NULL;
+    struct subscription *sub, *next;
+    int i;
+    
+    for(sub = only ? only : poll->watch->watchers; sub != NULL; sub = next){
+        // writing can drop the client and with it this watch
+        next = only ? NULL : sub->poll_next;
+        int form = sub->binary;
+        if(rendered[form] == NULL){
+            rendered[form] = render_update(poll, kind, from, form, parts,
+                                           num_parts, counts, &len[form]);
+        }
+        struct handle *h = &sub->session->client;
+        if(h->worker == self->id){
+            struct client *p = find_client(h);
+            if(p != NULL){
+                update_client(p, rendered[form], len[form]);
+            }
+            continue;
+        }
+        if(notices == NULL){
+            notices = Calloc(num_workers * 2, sizeof(struct message *));
+        }
+        struct message *m = notices[h->worker * 2 + form];
+        if(m == NULL){
+            m = notices[h->worker * 2 + form] = new_message(MSG_UPDATE);
+            m->data = malloc(len[form]);
+            if(m->data == NULL){
+                perror("malloc");
+                exit(1);
+            }
+            memcpy(m->data, rendered[form], len[form]);
+            m->len = len[form];
+        }
+        if(m->num_targets == 0 ||
+           (m->num_targets >= 4 && (m->num_targets & (m->num_targets - 1)) == 0)){
+            int room = m->num_targets ? m->num_targets * 2 : 4;
+            m->targets = realloc(m->targets, sizeof(struct handle) * room);
+            if(m->targets == NULL){
+                perror("realloc");
+                exit(1);
+            }
+        }
+        m->targets[m->num_targets++] = *h;
+    }
+    if(notices != NULL){
+        for(i = 0; i < num_workers * 2; i++){
+            if(notices[i] != NULL){
+                send_message(i / 2, notices[i]);
+            }
+        }
+        free(notices);
+    }
+    free(rendered[0]);
+    free(rendered[1]);
+}
+
+/* Send poll's watchers what changed since the last update, if anything,
+ * and start over from here.
+ */
+static void send_changes(Poll *poll){
+    struct watch *w = poll->watch;
+    int i;
+    if(w == NULL || w->sent == poll->version){
+        return;
+    }
+    send_update(poll, NULL, BIN_UPDATE_DELTA, w->sent, w->changed,
+                w->num_changed, w->counts);
+    // a client may have been dropped, and the watch with it
+    if((w = poll->watch) == NULL){
+        return;
+    }
+    for(i = 0; i < w->num_changed; i++){
+        w->changed_rows[w->changed[i]->row / 64] = 0;
+    }
+    w->num_changed = 0;
+    memcpy(w->counts, poll->slot_counts, sizeof(int) * poll->num_slots);
+    w->sent = poll->version;
+}
+
+/* Tell the followers of every poll marked active since the last call,
+ * and send the watchers of every poll changed since then the changes.
+ */
+void notify_pending(){
+    while(self->pending != NULL){
+        Poll *poll = self->pending;
+        int bits = poll->notify_pending;
+        self->pending = poll->next_pending;
+        poll->notify_pending = 0;
+        if(bits & PENDING_ACTIVITY){
+            broadcast(poll);
+        }
+        if(bits & PENDING_UPDATE){
+            send_changes(poll);
+        }
+    }
+}
+
+/* Have the client h, called name, watch poll: add the whole poll to out,
+ * the watch command's reply, and then send it each change. The reply
+ * goes out in its turn like any other, and later updates wait for it.
+ * Watching a poll again starts it over with the whole poll. Return 0, or
+ * 2 if the client has no session here to send updates to, as when it has
+ * gone or has no name yet.
+ */
+int watch_poll(struct handle *h, char *name, Poll *poll, int binary,
+               Buffer *out){
+    struct session *s;
+    struct subscription *sub;
+    // changes not yet sent to the other watchers go first, so every
+    // watcher counts from the same version; sending them can drop a slow
+    // client, this one included, so look for its session after
+    send_changes(poll);
+    if(name[0] == '\0' || (s = find_session(h, name)) == NULL){
+        return 2;
+    }
+    for(sub = s->subs; sub != NULL; sub = sub->session_next){
+        if(sub->watch && sub->poll == poll){
+            break;
+        }
+    }
+    if(sub == NULL){
+        if(poll->watch == NULL){
+            new_watch(poll);
+        }
+        sub = subscribe(s, poll, 1);
+    }
+    sub->binary = binary;
+    add_update(out, poll, BIN_UPDATE_FULL, 0, binary, NULL, 0, NULL);
+    self->metrics.updates++;
+    return 0;
+}
+
+/* Stop the client h, called name, watching poll. Return 0, or 2 if it
+ * was not watching it.
+ */
+int unwatch_poll(struct handle *h, char *name, Poll *poll){
+    struct session *s = find_session(h, name);
+    struct subscription *sub;
+    for(sub = s ? s->subs : NULL; sub != NULL; sub = sub->session_next){
+        if(sub->watch && sub->poll == poll){
+            unsubscribe(sub);
+            return 0;
+        }
+    }
+    return 2;
+}
+
+/* p missed watch updates while it was slow and has now caught up: have
+ * every shard send it the whole of each poll it watches there.
+ */
+void announce_resync(struct client *p){
+    int i;
+    for(i = 0; i < num_workers; i++){
+        struct message *m = new_message(MSG_RESYNC);
+        m->client.worker = self->id;
+        m->client.fd = p->fd;
+        m->client.id = p->id;
+        strcpy(m->name, p->name);
+        send_message(i, m);
+    }
+}
+
+/* Send the session of client h, called name, the whole of every poll it
+ * watches on this shard.
+ */
+static void resync_session(struct handle *h, char *name){
+    struct session *s = find_session(h, name);
+    struct subscription *sub, *next;
+    for(sub = s ? s->subs : NULL; sub != NULL; sub = next){
+        next = sub->session_next;
+        // only clients that are not dropped for being slow miss updates,
+        // so sending cannot take this session away
+        if(sub->watch){
+            self->metrics.resyncs++;
+            send_changes(sub->poll);
+            send_update(sub->poll, sub, BIN_UPDATE_FULL, 0, NULL, 0, NULL);
+        }
+    }
+}
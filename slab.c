@@ -0,0 +1,75 @@
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// records are aligned as malloc would align them
+#define SLAB_ALIGN 16
+// at least this many records to a block, however big they are
+#define MIN_RECORDS 8
+
+struct slab_block {
+    struct slab_block *next;
+};
+
+// the records of a block start this far in, past the header
+#define BLOCK_HEADER \
+    ((sizeof(struct slab_block) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+/* Add a block and start cutting records from it. */
+static void grow(Slab *slab) {
+    size_t bytes = SLAB_BLOCK;
+    if (bytes < BLOCK_HEADER + slab->size * MIN_RECORDS) {
+        bytes = BLOCK_HEADER + slab->size * MIN_RECORDS;
+    }
+    struct slab_block *block = malloc(bytes);
+    if (block == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    block->next = slab->blocks;
+    slab->blocks = block;
+    long records = (bytes - BLOCK_HEADER) / slab->size;
+    slab->next = (char *)block + BLOCK_HEADER;
+    slab->end = slab->next + records * slab->size;
+    slab->capacity += records;
+}
+
+void *slab_alloc(Slab *slab, size_t size) {
+    void *record;
+    if (slab->size == 0) {
+        // room for the free list link, rounded up to keep records aligned
+        if (size < sizeof(void *)) {
+            size = sizeof(void *);
+        }
+        slab->size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    }
+    if (slab->free_list != NULL) {
+        record = slab->free_list;
+        memcpy(&slab->free_list, record, sizeof(void *));
+    } else {
+        if (slab->next == slab->end) {
+            grow(slab);
+        }
+        record = slab->next;
+        slab->next += slab->size;
+    }
+    slab->in_use++;
+    return record;
+}
+
+void slab_free(Slab *slab, void *record) {
+    memcpy(record, &slab->free_list, sizeof(void *));
+    slab->free_list = record;
+    slab->in_use--;
+}
+
+void slab_release(Slab *slab) {
+    struct slab_block *block = slab->blocks;
+    while (block != NULL) {
+        struct slab_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    memset(slab, 0, sizeof(Slab));
+}
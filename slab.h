@@ -0,0 +1,40 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/* A pool of fixed-size records. Records are cut in address order from
+ * blocks of SLAB_BLOCK bytes, so records made one after another sit next
+ * to each other, and freed records go on a free list to be handed out
+ * again before any new one is cut. Blocks are only given back by
+ * slab_release.
+ *
+ * A slab is not locked: it belongs to whoever owns its records, such as a
+ * shard's PollList or a worker. A zero-initialized Slab is empty.
+ */
+#define SLAB_BLOCK 65536
+
+typedef struct slab {
+   size_t size;               // bytes per record, fixed by the first alloc
+   struct slab_block *blocks;
+   char *next;                // next record never handed out, in blocks
+   char *end;                 // end of the records of the newest block
+   void *free_list;           // freed records, chained through their start
+   long in_use;               // records handed out and not freed
+   long capacity;             // records in all blocks
+} Slab;
+
+/* Return a record of size bytes, which must be the same on every call for
+ * this slab. Like malloc's, its contents are undefined.
+ */
+void *slab_alloc(Slab *slab, size_t size);
+
+/* Give a record from slab_alloc back to the slab.
+ */
+void slab_free(Slab *slab, void *record);
+
+/* Free every block, and with them every record, leaving the slab empty.
+ */
+void slab_release(Slab *slab);
+
+#endif
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "slab.h"
+#include "check.h"
+
+#define RECORDS 10000
+
+typedef struct record {
+    long id;
+    char name[40];
+} Record;
+
+static Record *records[RECORDS];
+
+static void test_reuse() {
+    Slab slab = {0};
+    int i;
+    for (i = 0; i < RECORDS; i++) {
+        records[i] = slab_alloc(&slab, sizeof(Record));
+        CHECK((uintptr_t)records[i] % 16 == 0);
+        records[i]->id = i;
+        snprintf(records[i]->name, sizeof(records[i]->name), "record %d", i);
+    }
+    CHECK(slab.in_use == RECORDS);
+    CHECK(slab.capacity >= RECORDS);
+    long capacity = slab.capacity;
+
+    // freed records come back, newest freed first, before any new one
+    for (i = 0; i < RECORDS; i += 2) {
+        slab_free(&slab, records[i]);
+    }
+    CHECK(slab.in_use == RECORDS / 2);
+    for (i = RECORDS - 2; i >= 0; i -= 2) {
+        Record *again = slab_alloc(&slab, sizeof(Record));
+        CHECK(again == records[i]);
+        again->id = i;
+    }
+    CHECK(slab.in_use == RECORDS);
+    CHECK(slab.capacity == capacity);
+
+    // and none of that touched the records still in use
+    for (i = 1; i < RECORDS; i += 2) {
+        char name[40];
+        snprintf(name, sizeof(name), "record %d", i);
+        CHECK(records[i]->id == i && strcmp(records[i]->name, name) == 0);
+    }
+
+    slab_release(&slab);
+    CHECK(slab.in_use == 0 && slab.capacity == 0 && slab.blocks == NULL);
+    // a released slab starts over
+    CHECK(slab_alloc(&slab, sizeof(Record)) != NULL);
+    CHECK(slab.in_use == 1);
+    slab_release(&slab);
+}
+
+static void test_sizes() {
+    Slab tiny = {0}, huge = {0};
+    // a record too small for the free list link still gets room for it
+    char *a = slab_alloc(&tiny, 1);
+    char *b = slab_alloc(&tiny, 1);
+    CHECK(b - a == 16);
+    slab_free(&tiny, a);
+    CHECK(slab_alloc(&tiny, 1) == a);
+    slab_release(&tiny);
+
+    // records bigger than a block still come several to a block
+    slab_alloc(&huge, SLAB_BLOCK);
+    CHECK(huge.capacity >= 2);
+    slab_release(&huge);
+}
+
+int main() {
+    test_reuse();
+    test_sizes();
+    return check_result("slab_test");
+}
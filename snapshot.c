@@ -0,0 +1,317 @@
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// round n up to a multiple of 8 so the next record is aligned
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+static const char zeros[8];
+
+/* Output through stdio, keeping count of the offset reached. */
+typedef struct writer {
+    FILE *fp;
+    uint64_t at;
+    int failed;
+} Writer;
+
+static void put(Writer *w, const void *data, size_t len) {
+    if (len > 0 && fwrite(data, 1, len, w->fp) != len) {
+        w->failed = 1;
+    }
+    w->at += len;
+}
+
+static void pad(Writer *w) {
+    put(w, zeros, ALIGN8(w->at) - w->at);
+}
+
+static int by_seq(const void *a, const void *b) {
+    const Poll *x = *(Poll * const *)a;
+    const Poll *y = *(Poll * const *)b;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Write one poll and return the offset of its SnapPoll. The offsets of
+ * everything it refers to are worked out before any of it is written.
+ */
+static uint64_t write_poll(Writer *w, Poll *poll, Participant **rows) {
+    size_t words = AVAIL_WORDS(poll->num_slots);
+    size_t part_size = sizeof(SnapPart) + sizeof(uint64_t) * words;
+    uint64_t start = w->at;
+    SnapPoll sp;
+    Participant *part;
+    int i;
+    
+    // participants are on the list newest first, but are written in row
+    // order so loading them in file order rebuilds the same list
+    for (part = poll->participants; part != NULL; part = part->next) {
+        rows[part->row] = part;
+    }
+    
+    memset(&sp, 0, sizeof(sp));
+    strcpy(sp.name, poll->name);
+    sp.num_slots = poll->num_slots;
+    sp.num_participants = poll->num_participants;
+    sp.labels_at = start + sizeof(SnapPoll);
+    sp.parts_at = sp.labels_at + sizeof(uint64_t) * poll->num_slots;
+    put(w, &sp, sizeof(sp));
+    
+    // strings follow the participants
+    uint64_t str_at = sp.parts_at + part_size * poll->num_participants;
+    for (i = 0; i < poll->num_slots; i++) {
+        put(w, &str_at, sizeof(str_at));
+        str_at += strlen(poll->slot_labels[i]) + 1;
+    }
+    for (i = 0; i < poll->num_participants; i++) {
+        SnapPart spart;
+        memset(&spart, 0, sizeof(spart));
+        strcpy(spart.name, rows[i]->name);
+        if (rows[i]->comment != NULL) {
+            spart.comment_at = str_at;
+            str_at += strlen(rows[i]->comment) + 1;
+        }
+        put(w, &spart, sizeof(spart));
+        put(w, rows[i]->availability, sizeof(uint64_t) * words);
+    }
+    for (i = 0; i < poll->num_slots; i++) {
+        put(w, poll->slot_labels[i], strlen(poll->slot_labels[i]) + 1);
+    }
+    for (i = 0; i < poll->num_participants; i++) {
+        if (rows[i]->comment != NULL) {
+            put(w, rows[i]->comment, strlen(rows[i]->comment) + 1);
+        }
+    }
+    pad(w);
+    return start;
+}
+
+int snapshot_write(char *path, PollList **shards, int num_shards,
+                   uint64_t log_offset) {
+    char tmp[strlen(path) + 5];
+    SnapHeader header;
+    Writer w = {NULL, 0, 0};
+    long count = 0, n = 0, most = 0;
+    int i;
+    
+    sprintf(tmp, "%s.tmp", path);
+    if ((w.fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+    
+    // gather the polls from every shard back into creation order
+    for (i = 0; i < num_shards; i++) {
+        count += shards[i]->count;
+    }
+    Poll **polls = malloc(sizeof(Poll *) * (count ? count : 1));
+    uint64_t *offsets = malloc(sizeof(uint64_t) * (count ? count : 1));
+    if (polls == NULL || offsets == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < num_shards; i++) {
+        Poll *poll;
+        for (poll = shards[i]->head; poll != NULL; poll = poll->next) {
+            polls[n++] = poll;
+            if (poll->num_participants > most) {
+                most = poll->num_participants;
+            }
+        }
+    }
+    qsort(polls, count, sizeof(Poll *), by_seq);
+    Participant **rows = malloc(sizeof(Participant *) * (most ? most : 1));
+    if (rows == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    // the header is written again at the end once the table is placed
+    memset(&header, 0, sizeof(header));
+    put(&w, &header, sizeof(header));
+    for (n = 0; n < count; n++) {
+        offsets[n] = write_poll(&w, polls[n], rows);
+    }
+    memcpy(header.magic, SNAP_MAGIC, sizeof(header.magic));
+    header.log_offset = log_offset;
+    header.num_polls = count;
+    header.polls_at = w.at;
+    put(&w, offsets, sizeof(uint64_t) * count);
+    header.file_size = w.at;
+    free(polls);
+    free(offsets);
+    free(rows);
+    
+    if (w.failed || fseek(w.fp, 0, SEEK_SET) == -1 ||
+        fwrite(&header, sizeof(header), 1, w.fp) != 1 ||
+        fflush(w.fp) == EOF || fsync(fileno(w.fp)) == -1) {
+        int saved = errno;
+        fclose(w.fp);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    if (fclose(w.fp) == EOF || rename(tmp, path) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Return whether len bytes at offset at lie inside a file of size bytes
+ * and, when aligned is set, start 8 byte aligned.
+ */
+static int inside(uint64_t size, uint64_t at, uint64_t len, int aligned) {
+    return at <= size && len <= size - at && (!aligned || at % 8 == 0);
+}
+
+/* Return whether a '\0' terminated string starts at offset at. */
+static int string_at(const char *map, uint64_t size, uint64_t at) {
+    return at < size && memchr(map + at, '\0', size - at) != NULL;
+}
+
+/* Return whether the name field holds a '\0' terminated name, and add it
+ * to seen unless it is there already.
+ */
+static int unique_name(const char *name, NameIndex *seen) {
+    if (memchr(name, '\0', MAX_NAME) == NULL) {
+        return 0;
+    }
+    unsigned int hash = name_hash(name);
+    if (index_find(seen, name, hash) != NULL) {
+        return 0;
+    }
+    index_insert(seen, name, hash, (void *)name);
+    return 1;
+}
+
+/* Check that everything the polls table leads to lies inside the file,
+ * so loading it can follow every offset without looking: each poll, its
+ * labels, its participants and their comments, with every string ended
+ * inside the file and no poll or participant name twice. Return 0 if it
+ * does, -1 if not.
+ */
+static int check_snapshot(const char *map, uint64_t size) {
+    const SnapHeader *header = (const SnapHeader *)map;
+    NameIndex poll_names = {NULL}, part_names = {NULL};
+    int result = -1;
+    uint64_t n;
+    uint32_t i;
+    
+    if (header->num_polls > size / sizeof(uint64_t) ||
+        !inside(size, header->polls_at, sizeof(uint64_t) * header->num_polls, 1)) {
+        return -1;
+    }
+    const uint64_t *offsets = (const uint64_t *)(map + header->polls_at);
+    for (n = 0; n < header->num_polls; n++) {
+        if (!inside(size, offsets[n], sizeof(SnapPoll), 1)) {
+            goto done;
+        }
+        const SnapPoll *sp = (const SnapPoll *)(map + offsets[n]);
+        if (!unique_name(sp->name, &poll_names) ||
+            !inside(size, sp->labels_at, sizeof(uint64_t) * sp->num_slots, 1)) {
+            goto done;
+        }
+        const uint64_t *label_at = (const uint64_t *)(map + sp->labels_at);
+        for (i = 0; i < sp->num_slots; i++) {
+            if (!string_at(map, size, label_at[i])) {
+                goto done;
+            }
+        }
+        uint64_t part_size = sizeof(SnapPart) +
+                             sizeof(uint64_t) * AVAIL_WORDS((uint64_t)sp->num_slots);
+        if (!inside(size, sp->parts_at, part_size * sp->num_participants, 1)) {
+            goto done;
+        }
+        index_free(&part_names);
+        for (i = 0; i < sp->num_participants; i++) {
+            const SnapPart *spart =
+                (const SnapPart *)(map + sp->parts_at + part_size * i);
+            if (!unique_name(spart->name, &part_names) ||
+                (spart->comment_at != 0 &&
+                 !string_at(map, size, spart->comment_at))) {
+                goto done;
+            }
+        }
+    }
+    result = 0;
+done:
+    index_free(&poll_names);
+    index_free(&part_names);
+    return result;
+}
+
+long snapshot_load(char *path, PollList *(*polls_for)(char *poll_name),
+                   uint64_t *log_offset) {
+    struct stat st;
+    const char *map;
+    const SnapHeader *header;
+    uint64_t n;
+    int fd;
+    
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(SnapHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    header = (const SnapHeader *)map;
+    if (memcmp(header->magic, SNAP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->file_size != (uint64_t)st.st_size ||
+        check_snapshot(map, st.st_size) == -1) {
+        munmap((void *)map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    const uint64_t *offsets = (const uint64_t *)(map + header->polls_at);
+    for (n = 0; n < header->num_polls; n++) {
+        const SnapPoll *sp = (const SnapPoll *)(map + offsets[n]);
+        const uint64_t *label_at = (const uint64_t *)(map + sp->labels_at);
+        char **labels = malloc(sizeof(char *) * (sp->num_slots ? sp->num_slots : 1));
+        char *name = (char *)sp->name;
+        PollList *polls = polls_for(name);
+        uint32_t i;
+        
+        if (labels == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (i = 0; i < sp->num_slots; i++) {
+            labels[i] = (char *)map + label_at[i];
+        }
+        create_poll(name, labels, sp->num_slots, polls);
+        free(labels);
+        Poll *poll = find_poll(name, polls);
+        
+        size_t part_size = sizeof(SnapPart) +
+                           sizeof(uint64_t) * AVAIL_WORDS(sp->num_slots);
+        const char *rec = map + sp->parts_at;
+        for (i = 0; i < sp->num_participants; i++, rec += part_size) {
+            const SnapPart *spart = (const SnapPart *)rec;
+            restore_participant(poll, polls, (char *)spart->name,
+                                (const uint64_t *)(rec + sizeof(SnapPart)),
+                                spart->comment_at ?
+                                (char *)map + spart->comment_at : NULL);
+        }
+        tally_poll(poll, poll->slot_counts);
+    }
+    *log_offset = header->log_offset;
+    n = header->num_polls;
+    munmap((void *)map, st.st_size);
+    return n;
+}
@@ -0,0 +1,60 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "lists.h"
+
+/* A snapshot is every poll written to one file, so startup can load it
+ * instead of replaying the whole log. The file holds no pointers: every
+ * reference is a byte offset from the start of the file, so it can be
+ * mmap'd and read in place. Strings are stored '\0' terminated and are
+ * passed straight from the mapping, and availability is stored as the
+ * same bit words a Participant holds.
+ *
+ *   SnapHeader
+ *   per poll: SnapPoll, label offsets, participants, strings
+ *   table of poll offsets, oldest poll first
+ *
+ * Each participant is a SnapPart followed by AVAIL_WORDS(num_slots)
+ * words, oldest participant first. Everything is 8 byte aligned.
+ */
+#define SNAP_MAGIC "PSNAP01"
+
+typedef struct snap_header {
+   char magic[8];
+   uint64_t log_offset;   // log records before this are in the snapshot
+   uint64_t num_polls;
+   uint64_t polls_at;     // offset of num_polls uint64_t poll offsets
+   uint64_t file_size;    // so a short file is noticed
+} SnapHeader;
+
+typedef struct snap_poll {
+   char name[MAX_NAME];
+   uint32_t num_slots;
+   uint32_t num_participants;
+   uint64_t labels_at;    // num_slots uint64_t string offsets
+   uint64_t parts_at;     // the first SnapPart
+} SnapPoll;
+
+typedef struct snap_part {
+   char name[MAX_NAME];
+   uint64_t comment_at;   // 0 if there is no comment
+} SnapPart;
+
+/* Write every poll in the num_shards lists to path, oldest first, noting
+ * that the log was log_offset bytes long. The file is written beside
+ * path and renamed over it once it is complete and on disk.
+ * Return 0 on success or -1 with errno set.
+ */
+int snapshot_write(char *path, PollList **shards, int num_shards,
+                   uint64_t log_offset);
+
+/* Load the snapshot at path, adding each poll to the PollList that
+ * polls_for returns for it, and set *log_offset to where the log goes on
+ * from. Return the number of polls loaded, or -1 with errno set; ENOENT
+ * means there is no snapshot yet, and EINVAL that it is damaged, in
+ * which case nothing was loaded.
+ */
+long snapshot_load(char *path, PollList *(*polls_for)(char *poll_name),
+                   uint64_t *log_offset);
+
+#endif
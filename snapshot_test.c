@@ -0,0 +1,159 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "snapshot.h"
+#include "check.h"
+
+#define PATH "/tmp/snapshot_test.snap"
+
+static PollList loaded;
+
+static PollList *into_loaded(char *poll_name) {
+    return &loaded;
+}
+
+/* Everything print_polls, print_poll_info and print_results say about
+ * polls, as one string the caller frees.
+ */
+static char *describe(PollList *polls) {
+    Buffer out = {NULL};
+    struct iovec iov[16];
+    Poll *poll;
+    size_t len = 0;
+    char *text = NULL;
+    print_polls(polls, &out);
+    for (poll = polls->head; poll != NULL; poll = poll->next) {
+        print_poll_info(poll->name, polls, &out);
+        print_results(poll->name, polls, &out);
+    }
+    while (out.len > 0) {
+        int i, n = buf_iov(&out, iov, 16);
+        for (i = 0; i < n; i++) {
+            text = realloc(text, len + iov[i].iov_len + 1);
+            memcpy(text + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+            buf_consume(&out, iov[i].iov_len);
+        }
+    }
+    text = realloc(text, len + 1);
+    text[len] = '\0';
+    return text;
+}
+
+static void clear(PollList *polls) {
+    while (polls->head != NULL) {
+        delete_poll(polls->head->name, polls);
+    }
+}
+
+/* Write a damaged copy of the snapshot, with len bytes at offset at
+ * replaced by data, and check that it is turned down as a whole.
+ */
+static void check_damaged(const char *image, long size, long at,
+                          const void *data, long len, int line) {
+    char *copy = malloc(size);
+    uint64_t offset;
+    memcpy(copy, image, size);
+    memcpy(copy + at, data, len);
+    FILE *fp = fopen(PATH, "w");
+    fwrite(copy, 1, size, fp);
+    fclose(fp);
+    errno = 0;
+    long got = snapshot_load(PATH, into_loaded, &offset);
+    if (got != -1 || errno != EINVAL || loaded.count != 0) {
+        fprintf(stderr, "damage from line %d: got %ld, errno %d, %d polls\n",
+                line, got, errno, loaded.count);
+        check_failures++;
+    }
+    clear(&loaded);
+    free(copy);
+}
+
+#define DAMAGED(at, value) do { \
+        uint64_t v = (value); \
+        check_damaged(image, size, (at), &v, sizeof(v), __LINE__); \
+    } while (0)
+
+int main() {
+    PollList polls = {NULL};
+    char *labels[] = {"mon", "tue", "wed"};
+    uint64_t offset;
+    
+    create_poll("lunch", labels, 3, &polls);
+    create_poll("dinner", labels, 2, &polls);
+    create_poll("empty", labels, 1, &polls);
+    add_participant("alice", "lunch", &polls, "101");
+    add_participant("bob", "lunch", &polls, "011");
+    add_comment("bob", "lunch", "see you there", &polls);
+    add_participant("alice", "dinner", &polls, "11");
+    PollList *shards[] = {&polls};
+    CHECK(snapshot_write(PATH, shards, 1, 1234) == 0);
+    
+    // round trip
+    CHECK(snapshot_load(PATH, into_loaded, &offset) == 3);
+    CHECK(offset == 1234);
+    char *before = describe(&polls), *after = describe(&loaded);
+    CHECK(strcmp(before, after) == 0);
+    free(before);
+    free(after);
+    clear(&loaded);
+    
+    // read the file back to damage copies of it
+    FILE *fp = fopen(PATH, "r");
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    char *image = malloc(size);
+    rewind(fp);
+    CHECK(fread(image, 1, size, fp) == (size_t)size);
+    fclose(fp);
+    const SnapHeader *header = (const SnapHeader *)image;
+    const uint64_t *offsets = (const uint64_t *)(image + header->polls_at);
+    const SnapPoll *lunch = (const SnapPoll *)(image + offsets[0]);
+    long lunch_at = offsets[0];
+    long bob_at = lunch->parts_at + sizeof(SnapPart) + sizeof(uint64_t);
+    
+    DAMAGED(offsetof(SnapHeader, num_polls), 1UL << 60);
+    DAMAGED(offsetof(SnapHeader, polls_at), size);
+    DAMAGED(header->polls_at, size - 8);
+    DAMAGED(header->polls_at, 3);
+    DAMAGED(lunch_at + offsetof(SnapPoll, labels_at), size);
+    DAMAGED(lunch->labels_at, size + 100);
+    DAMAGED(lunch->labels_at + 8, size);
+    DAMAGED(lunch_at + offsetof(SnapPoll, parts_at), size - 16);
+    DAMAGED(lunch_at + offsetof(SnapPoll, num_slots), 0xffffffff);
+    DAMAGED(lunch_at + offsetof(SnapPoll, num_participants), 1000000);
+    DAMAGED(bob_at + offsetof(SnapPart, comment_at), size);
+    // a poll or participant name with no '\0', and one used twice
+    char full[MAX_NAME];
+    memset(full, 'x', MAX_NAME);
+    check_damaged(image, size, lunch_at, full, MAX_NAME, __LINE__);
+    check_damaged(image, size, bob_at, full, MAX_NAME, __LINE__);
+    check_damaged(image, size, bob_at, "alice", 6, __LINE__);
+    check_damaged(image, size, offsets[1], "lunch", 6, __LINE__);
+    
+    // random damage either loads or is turned down, but never crashes
+    srand(1);
+    int i;
+    for (i = 0; i < 20000; i++) {
+        char *copy = malloc(size);
+        memcpy(copy, image, size);
+        int flips = 1 + rand() % 4, j;
+        for (j = 0; j < flips; j++) {
+            copy[sizeof(SnapHeader) + rand() % (size - sizeof(SnapHeader))] = rand();
+        }
+        fp = fopen(PATH, "w");
+        fwrite(copy, 1, size, fp);
+        fclose(fp);
+        snapshot_load(PATH, into_loaded, &offset);
+        clear(&loaded);
+        free(copy);
+    }
+    free(image);
+    clear(&polls);
+    unlink(PATH);
+    return check_result("snapshot_test");
+}
@@ -0,0 +1,61 @@
+#include "tally.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+
+static long popcount_scalar(const uint64_t *words, long n) {
+    long count = 0;
+    long i;
+    for (i = 0; i < n; i++) {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/* Count bits a nibble at a time with a vpshufb table lookup, summing the
+ * per-byte counts into 64-bit lanes with vpsadbw every 32 bytes.
+ */
+__attribute__((target("avx2")))
+static long popcount_avx2(const uint64_t *words, long n) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                           1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3,
+                                           1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    long i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(words + i));
+        __m256i lo = _mm256_and_si256(v, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(table, lo),
+                                        _mm256_shuffle_epi8(table, hi));
+        total = _mm256_add_epi64(total,
+                    _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+    long count = _mm256_extract_epi64(total, 0) +
+                 _mm256_extract_epi64(total, 1) +
+                 _mm256_extract_epi64(total, 2) +
+                 _mm256_extract_epi64(total, 3);
+    return count + popcount_scalar(words + i, n - i);
+}
+#endif
+
+// set by tally_init before the workers start, and only read after
+static long (*kernel)(const uint64_t *, long) = popcount_scalar;
+
+void tally_init(void) {
+#ifdef HAVE_AVX2_KERNEL
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = popcount_avx2;
+    }
+#endif
+}
+
+long popcount_words(const uint64_t *words, long n) {
+    return kernel(words, n);
+}
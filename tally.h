@@ -0,0 +1,16 @@
+#ifndef TALLY_H
+#define TALLY_H
+
+#include <stdint.h>
+
+/* Pick the popcount kernel for this CPU: AVX2 when it has it, a scalar
+ * popcount loop otherwise. Call it once at startup, before any thread
+ * counts; until then the scalar loop is used.
+ */
+void tally_init(void);
+
+/* Return the number of set bits in the n words starting at words.
+ */
+long popcount_words(const uint64_t *words, long n);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lists.h"
+#include "tally.h"
+#include "check.h"
+
+#define MAX_SLOTS 130
+#define MAX_WORDS 40
+
+static char label_text[MAX_SLOTS][8];
+static char *labels[MAX_SLOTS];
+
+static long slow_popcount(const uint64_t *words, long n) {
+    long count = 0, i;
+    int b;
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < 64; b++) {
+            count += (words[i] >> b) & 1;
+        }
+    }
+    return count;
+}
+
+static uint64_t random_word() {
+    return (uint64_t)rand() << 42 ^ (uint64_t)rand() << 21 ^ rand();
+}
+
+// every length, so the vector loop's leftover words are covered too
+static void test_popcount() {
+    uint64_t words[MAX_WORDS];
+    long n;
+    for (n = 0; n < MAX_WORDS; n++) {
+        words[n] = random_word();
+    }
+    words[3] = ~(uint64_t)0;
+    for (n = 0; n <= MAX_WORDS; n++) {
+        CHECK(popcount_words(words, n) == slow_popcount(words, n));
+        // and from a start that is not 32-byte aligned
+        if (n > 0) {
+            CHECK(popcount_words(words + 1, n - 1) ==
+                  slow_popcount(words + 1, n - 1));
+        }
+    }
+}
+
+/* Vote num_parts participants into a poll of num_slots slots, change
+ * some votes, and check tally_poll against the kept counts and against
+ * counting the votes here.
+ */
+static void check_poll(int num_slots, int num_parts) {
+    PollList polls = {0};
+    int expect[MAX_SLOTS] = {0};
+    int counts[MAX_SLOTS];
+    char avail[MAX_SLOTS + 1];
+    char name[16];
+    int i, j;
+    create_poll("p", labels, num_slots, &polls);
+    for (i = 0; i < num_parts; i++) {
+        for (j = 0; j < num_slots; j++) {
+            avail[j] = rand() % 3 == 0 ? '1' : '0';
+        }
+        avail[num_slots] = '\0';
+        snprintf(name, sizeof(name), "u%d", i);
+        CHECK(add_participant(name, "p", &polls, avail) == 0);
+        // every third one changes its mind and is counted as it ends up
+        if (i % 3 == 0) {
+            for (j = 0; j < num_slots; j++) {
+                avail[j] = rand() % 2 ? '1' : '0';
+            }
+            CHECK(update_availability(name, "p", avail, &polls) == 0);
+        }
+        for (j = 0; j < num_slots; j++) {
+            expect[j] += avail[j] == '1';
+        }
+    }
+    Poll *poll = find_poll("p", &polls);
+    tally_poll(poll, counts);
+    for (j = 0; j < num_slots; j++) {
+        CHECK(counts[j] == expect[j]);
+        CHECK(poll->slot_counts[j] == expect[j]);
+    }
+    delete_poll("p", &polls);
+}
+
+static void test_polls() {
+    // participant counts either side of a column word and of the four
+    // words the vector loop takes at once
+    int parts[] = {1, 2, 63, 64, 65, 255, 256, 257, 300, 1000};
+    int slots[] = {1, 3, 64, 65, MAX_SLOTS};
+    int i, j;
+    for (i = 0; i < MAX_SLOTS; i++) {
+        snprintf(label_text[i], sizeof(label_text[i]), "s%d", i);
+        labels[i] = label_text[i];
+    }
+    for (i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+        for (j = 0; j < sizeof(parts) / sizeof(parts[0]); j++) {
+            check_poll(slots[i], parts[j]);
+        }
+    }
+}
+
+int main() {
+    srand(3);
+    // the scalar loop until tally_init, then the kernel for this CPU
+    test_popcount();
+    tally_init();
+    test_popcount();
+    test_polls();
+    return check_result("tally_test");
+}
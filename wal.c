@@ -0,0 +1,333 @@
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// iovecs handed to each writev
+#define WAL_IOV 64
+// room for a record header
+#define WAL_HEADER 8
+
+// keeps one thread's records from being split by another's
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Encoding. A record is built in a small scratch area and then appended,
+ * since its length and checksum go in front of it.
+ */
+typedef struct record {
+    char *data;
+    size_t len;
+    size_t cap;
+} Record;
+
+static void rec_reserve(Record *r, size_t more) {
+    if (r->len + more <= r->cap) {
+        return;
+    }
+    while (r->len + more > r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 256;
+    }
+    if ((r->data = realloc(r->data, r->cap)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+}
+
+static void put_varint(Record *r, size_t v) {
+    rec_reserve(r, 10);
+    while (v >= 0x80) {
+        r->data[r->len++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    r->data[r->len++] = (char)v;
+}
+
+static void put_string(Record *r, const char *s) {
+    size_t len = strlen(s);
+    put_varint(r, len);
+    rec_reserve(r, len);
+    memcpy(r->data + r->len, s, len);
+    r->len += len;
+}
+
+/* FNV-1a over the record body, enough to spot a torn write. */
+static uint32_t checksum(const char *data, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Start a record of this type; the header is filled in by finish. */
+static void start(Record *r, int type) {
+    r->len = 0;
+    rec_reserve(r, WAL_HEADER + 1);
+    r->len = WAL_HEADER;
+    r->data[r->len++] = (char)type;
+}
+
+static void finish(Record *r, Buffer *log) {
+    uint32_t body = r->len - WAL_HEADER;
+    uint32_t sum = checksum(r->data + WAL_HEADER, body);
+    memcpy(r->data, &body, 4);
+    memcpy(r->data + 4, &sum, 4);
+    buf_append(log, r->data, r->len);
+}
+
+// each thread keeps its scratch record between calls
+static __thread Record scratch;
+
+void wal_create(Buffer *log, char *poll_name, char **slot_labels, int num_slots) {
+    int i;
+    start(&scratch, WAL_CREATE);
+    put_string(&scratch, poll_name);
+    put_varint(&scratch, num_slots);
+    for (i = 0; i < num_slots; i++) {
+        put_string(&scratch, slot_labels[i]);
+    }
+    finish(&scratch, log);
+}
+
+void wal_vote(Buffer *log, char *poll_name, char *part_name, char *avail) {
+    start(&scratch, WAL_VOTE);
+    put_string(&scratch, poll_name);
+    put_string(&scratch, part_name);
+    put_string(&scratch, avail);
+    finish(&scratch, log);
+}
+
+void wal_comment(Buffer *log, char *poll_name, char *part_name, char *comment) {
+    start(&scratch, WAL_COMMENT);
+    put_string(&scratch, poll_name);
+    put_string(&scratch, part_name);
+    put_string(&scratch, comment);
+    finish(&scratch, log);
+}
+
+void wal_delete(Buffer *log, char *poll_name) {
+    start(&scratch, WAL_DELETE);
+    put_string(&scratch, poll_name);
+    finish(&scratch, log);
+}
+
+int wal_commit(int fd, Buffer *log) {
+    struct iovec iov[WAL_IOV];
+    int n;
+    ssize_t written;
+    
+    if (log->len == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&wal_lock);
+    while (log->len > 0) {
+        n = buf_iov(log, iov, WAL_IOV);
+        if ((written = writev(fd, iov, n)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            pthread_mutex_unlock(&wal_lock);
+            buf_clear(log);
+            return -1;
+        }
+        buf_consume(log, written);
+    }
+    pthread_mutex_unlock(&wal_lock);
+    // outside the lock, so threads committing together share the flush
+    if (fdatasync(fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Decoding. Fields are read from the body in place; strings are copied
+ * out so they can be passed on '\0' terminated.
+ */
+typedef struct reader {
+    const unsigned char *pos;
+    const unsigned char *end;
+    int bad;   // set once a field runs past the end of the body
+} Reader;
+
+static size_t get_varint(Reader *rd) {
+    size_t v = 0;
+    int shift = 0;
+    while (rd->pos < rd->end && shift < 64) {
+        unsigned char c = *rd->pos++;
+        v |= (size_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return v;
+        }
+        shift += 7;
+    }
+    rd->bad = 1;
+    return 0;
+}
+
+/* Copy the next string onto the end of strings and return its offset. */
+static size_t get_string(Reader *rd, Record *strings) {
+    size_t len = get_varint(rd);
+    size_t at = strings->len;
+    if (rd->bad || len > (size_t)(rd->end - rd->pos)) {
+        rd->bad = 1;
+        len = 0;
+    }
+    rec_reserve(strings, len + 1);
+    memcpy(strings->data + at, rd->pos, len);
+    strings->data[at + len] = '\0';
+    strings->len += len + 1;
+    rd->pos += len;
+    return at;
+}
+
+/* Apply one record body. Return -1 if it doesn't decode. */
+static int apply(const unsigned char *body, size_t len,
+                 PollList *(*polls_for)(char *), Record *strings) {
+    Reader rd = {body + 1, body + len, 0};
+    size_t poll_at, part_at, text_at;
+    char *poll_name;
+    PollList *polls;
+    
+    if (len == 0) {
+        return -1;
+    }
+    strings->len = 0;
+    poll_at = get_string(&rd, strings);
+    
+    switch (body[0]) {
+        case WAL_CREATE: {
+            size_t num_slots = get_varint(&rd);
+            size_t *label_at;
+            char **labels;
+            size_t i;
+            if (rd.bad || num_slots > len) {
+                return -1;
+            }
+            label_at = malloc(sizeof(size_t) * (num_slots + 1));
+            labels = malloc(sizeof(char *) * (num_slots + 1));
+            if (label_at == NULL || labels == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            for (i = 0; i < num_slots; i++) {
+                label_at[i] = get_string(&rd, strings);
+            }
+            // strings may have moved while growing, so point in last
+            for (i = 0; i < num_slots; i++) {
+                labels[i] = strings->data + label_at[i];
+            }
+            if (!rd.bad) {
+                poll_name = strings->data + poll_at;
+                create_poll(poll_name, labels, num_slots, polls_for(poll_name));
+            }
+            free(label_at);
+            free(labels);
+            break;
+        }
+        case WAL_VOTE:
+        case WAL_COMMENT:
+            part_at = get_string(&rd, strings);
+            text_at = get_string(&rd, strings);
+            if (rd.bad) {
+                break;
+            }
+            poll_name = strings->data + poll_at;
+            polls = polls_for(poll_name);
+            if (body[0] == WAL_COMMENT) {
+                add_comment(strings->data + part_at, poll_name,
+                            strings->data + text_at, polls);
+            } else if (add_participant(strings->data + part_at, poll_name,
+                                       polls, strings->data + text_at) == 2) {
+                update_availability(strings->data + part_at, poll_name,
+                                    strings->data + text_at, polls);
+            }
+            break;
+        case WAL_DELETE:
+            if (!rd.bad) {
+                poll_name = strings->data + poll_at;
+                delete_poll(poll_name, polls_for(poll_name));
+            }
+            break;
+        default:
+            return -1;
+    }
+    return rd.bad ? -1 : 0;
+}
+
+long wal_replay(int fd, uint64_t from, PollList *(*polls_for)(char *poll_name)) {
+    struct stat st;
+    const unsigned char *map;
+    size_t pos = from;
+    long records = 0;
+    int damaged = 0;
+    Record strings = {NULL, 0, 0};
+    
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    // records past from would be appended where a replay never looks
+    if ((uint64_t)st.st_size < from) {
+        fprintf(stderr, "log is %ld bytes but the snapshot needs it to be at "
+                "least %llu; restore the log that goes with the snapshot\n",
+                (long)st.st_size, (unsigned long long)from);
+        errno = EINVAL;
+        return -1;
+    }
+    if ((uint64_t)st.st_size == from) {
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+    
+    while (pos < (size_t)st.st_size) {
+        uint32_t body, sum;
+        // a header or body running past the end is a write a crash cut short
+        if (st.st_size - pos < WAL_HEADER) {
+            break;
+        }
+        memcpy(&body, map + pos, 4);
+        memcpy(&sum, map + pos + 4, 4);
+        if (body > st.st_size - pos - WAL_HEADER) {
+            break;
+        }
+        // anything else wrong with a whole record is damage, and what
+        // follows it can't be trusted or thrown away
+        if (checksum((const char *)map + pos + WAL_HEADER, body) != sum ||
+            apply(map + pos + WAL_HEADER, body, polls_for, &strings) == -1) {
+            fprintf(stderr, "log record at byte %ld is damaged, after %ld good "
+                    "records; repair the log before starting again\n",
+                    (long)pos, records);
+            damaged = 1;
+            break;
+        }
+        pos += WAL_HEADER + body;
+        records++;
+    }
+    munmap((void *)map, st.st_size);
+    free(strings.data);
+    
+    if (damaged) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pos < (size_t)st.st_size) {
+        fprintf(stderr, "log ends in a torn record after %ld records, "
+                "dropping %ld bytes\n", records, (long)(st.st_size - pos));
+        if (ftruncate(fd, pos) == -1) {
+            perror("ftruncate");
+            return -1;
+        }
+    }
+    return records;
+}
@@ -0,0 +1,48 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "lists.h"
+#include "buffer.h"
+
+/* A write-ahead log of every change made to the polls, so they can be
+ * rebuilt after a restart. Changes are encoded into a Buffer as they are
+ * made and written out together by wal_commit, so one fdatasync covers
+ * everything a loop iteration did. Each record is
+ *
+ *   u32 body length, u32 checksum of the body, body
+ *
+ * and a body is a type byte followed by its fields, each string as a
+ * varint length and its bytes. A torn record at the end, one whose
+ * header or body runs past the end of the file after a crash mid-write, is
+ * dropped on replay. Any other damage stops the replay.
+ */
+#define WAL_CREATE 1    // poll name, label count, labels
+#define WAL_VOTE 2      // poll name, participant, availability
+#define WAL_COMMENT 3   // poll name, participant, comment
+#define WAL_DELETE 4    // poll name
+
+/* Add a record to log for each kind of change.
+ */
+void wal_create(Buffer *log, char *poll_name, char **slot_labels, int num_slots);
+void wal_vote(Buffer *log, char *poll_name, char *part_name, char *avail);
+void wal_comment(Buffer *log, char *poll_name, char *part_name, char *comment);
+void wal_delete(Buffer *log, char *poll_name);
+
+/* Append the records in log to the file fd and wait until they are on
+ * disk. log is left empty. Several threads may commit to the same fd; each
+ * one's records are written together. Return -1 on a write error.
+ */
+int wal_commit(int fd, Buffer *log);
+
+/* Apply every record in the log file fd from byte offset from on, through
+ * the lists.c functions. polls_for returns the PollList a poll belongs
+ * in. A torn last record is cut off so new records follow the last good
+ * one. Return the number of records applied, or -1 if the file can't be
+ * read, is shorter than from, or has a whole record in it damaged (errno
+ * EINVAL for those two). The file is left as it was then, for the
+ * operator to repair.
+ */
+long wal_replay(int fd, uint64_t from, PollList *(*polls_for)(char *poll_name));
+
+#endif
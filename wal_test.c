@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "check.h"
+
+#define RECORDS 5
+
+static PollList *replaying;
+
+static PollList *polls_for(char *poll_name) {
+    return replaying;
+}
+
+static long file_size(int fd) {
+    struct stat st;
+    fstat(fd, &st);
+    return st.st_size;
+}
+
+// replay the log from byte from on into polls, without its notes about damage
+static long replay(int fd, uint64_t from, PollList *polls) {
+    int saved = dup(2), null = open("/dev/null", O_WRONLY);
+    dup2(null, 2);
+    replaying = polls;
+    long records = wal_replay(fd, from, polls_for);
+    dup2(saved, 2);
+    close(saved);
+    close(null);
+    return records;
+}
+
+static void clear(PollList *polls) {
+    while (polls->head != NULL) {
+        delete_poll(polls->head->name, polls);
+    }
+}
+
+// write change number i as its own commit
+static void change(int fd, int i) {
+    Buffer log = {NULL};
+    char *labels[] = {"mon", "tue"};
+    switch (i) {
+        case 0: wal_create(&log, "lunch", labels, 2); break;
+        case 1: wal_vote(&log, "lunch", "alice", "10"); break;
+        case 2: wal_vote(&log, "lunch", "bob", "11"); break;
+        case 3: wal_comment(&log, "lunch", "alice", "either day"); break;
+        case 4: wal_vote(&log, "lunch", "alice", "01"); break;
+        case 5: wal_vote(&log, "lunch", "carol", "11"); break;
+    }
+    CHECK(wal_commit(fd, &log) == 0);
+}
+
+// the polls as the text protocol would print the one poll, lunch
+static char *describe(PollList *polls) {
+    static char text[1024];
+    Buffer out = {NULL};
+    struct iovec iov[16];
+    size_t len = 0;
+    print_poll_info("lunch", polls, &out);
+    while (out.len > 0) {
+        int i, n = buf_iov(&out, iov, 16);
+        for (i = 0; i < n; i++) {
+            if (len + iov[i].iov_len < sizeof(text)) {
+                memcpy(text + len, iov[i].iov_base, iov[i].iov_len);
+                len += iov[i].iov_len;
+            }
+            buf_consume(&out, iov[i].iov_len);
+        }
+    }
+    text[len] = '\0';
+    return text;
+}
+
+static void test_truncated() {
+    char path[] = "/tmp/wal_testXXXXXX";
+    int fd = mkstemp(path);
+    long ends[RECORDS];
+    char before[1024];
+    PollList polls = {0};
+    int i;
+    CHECK(fd != -1);
+    unlink(path);
+    for (i = 0; i < RECORDS; i++) {
+        change(fd, i);
+        ends[i] = file_size(fd);
+    }
+    // what the log holds without its last record
+    CHECK(ftruncate(fd, ends[RECORDS - 2]) == 0);
+    CHECK(replay(fd, 0, &polls) == RECORDS - 1);
+    strcpy(before, describe(&polls));
+    clear(&polls);
+
+    // cut anywhere inside the last record, that record alone is dropped
+    long cut;
+    for (cut = ends[RECORDS - 2] + 1; cut < ends[RECORDS - 1]; cut++) {
+        CHECK(ftruncate(fd, ends[RECORDS - 2]) == 0);
+        lseek(fd, 0, SEEK_END);
+        change(fd, RECORDS - 1);
+        CHECK(ftruncate(fd, cut) == 0);
+        CHECK(replay(fd, 0, &polls) == RECORDS - 1);
+        CHECK(strcmp(describe(&polls), before) == 0);
+        // and the tail is gone, so a new record follows the last good one
+        CHECK(file_size(fd) == ends[RECORDS - 2]);
+        clear(&polls);
+    }
+
+    // a record written after the cut is replayed with the rest
+    lseek(fd, 0, SEEK_END);
+    change(fd, RECORDS);
+    CHECK(replay(fd, 0, &polls) == RECORDS);
+    CHECK(strstr(describe(&polls), "carol:  11") != NULL);
+    CHECK(strstr(describe(&polls), "alice:  10") != NULL);
+    clear(&polls);
+
+    // a whole last record with a bad checksum is damage, not a torn
+    // write, so the replay is refused and the file kept for repair
+    long size = file_size(fd);
+    char byte;
+    CHECK(pread(fd, &byte, 1, size - 1) == 1);
+    byte ^= 1;
+    CHECK(pwrite(fd, &byte, 1, size - 1) == 1);
+    CHECK(replay(fd, 0, &polls) == -1);
+    CHECK(file_size(fd) == size);
+    clear(&polls);
+    byte ^= 1;
+    CHECK(pwrite(fd, &byte, 1, size - 1) == 1);
+
+    // and the same for damage with good records after it
+    CHECK(pread(fd, &byte, 1, ends[1] - 1) == 1);
+    byte ^= 1;
+    CHECK(pwrite(fd, &byte, 1, ends[1] - 1) == 1);
+    CHECK(replay(fd, 0, &polls) == -1);
+    CHECK(file_size(fd) == size);
+    clear(&polls);
+    byte ^= 1;
+    CHECK(pwrite(fd, &byte, 1, ends[1] - 1) == 1);
+    CHECK(replay(fd, 0, &polls) == RECORDS);
+    clear(&polls);
+
+    // a snapshot taken further along than the log goes is refused too
+    CHECK(replay(fd, size, &polls) == 0);
+    CHECK(replay(fd, size + 1, &polls) == -1);
+    CHECK(file_size(fd) == size);
+    close(fd);
+}
+
+int main() {
+    test_truncated();
+    return check_result("wal_test");
+}